@@ -10,6 +10,8 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 
+#include "../common/obj_parser.h"
+
 #define Panic(...) \
     do { \
         int e; \
@@ -99,36 +101,6 @@ static u8 B_[1024 * 1024];
 static struct Arena A = {&A_, sizeof(A_), 0};
 static struct Arena B = {&B_, sizeof(B_), 0};
 
-struct MemoryMappedFile {
-    void *addr;
-    u64 size;
-};
-
-static struct MemoryMappedFile Memory_MapFile(const char *path)
-{
-    struct MemoryMappedFile f;
-    int fd;
-    struct stat st;
-
-    fd = open(path, O_RDONLY);
-    if (fd < 0) {
-        Panic("unable to open '%s'", path);
-    }
-
-    if (fstat(fd, &st) != 0) {
-        Panic("unable to fstat '%s'", path);
-    }
-    f.size = st.st_size;
-
-    f.addr = mmap(NULL, f.size, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (f.addr == MAP_FAILED) {
-        Panic("unable to mmap '%s'", path);
-    }
-    close(fd);
-
-    return f;
-}
-
 struct f32x3 { f32 x, y, z; };
 struct u16x3 { u16 x, y, z; };
 
@@ -142,38 +114,31 @@ struct Obj {
 struct Obj Obj_Load(const char *path)
 {
     struct Obj obj;
-    struct MemoryMappedFile f;
-    const char *s;
-    struct f32x3 v;
-    struct u16x3 u;
-    u16 d;
-    size_t i;
+    struct ObjData d;
+    const f32 *p;
+    const u32 *q;
+    u32 i;
 
     memset(&obj, 0, sizeof(obj));
-    f = Memory_MapFile(path);
-    s = f.addr;
-    for (i = 0; i < f.size; i++) {
-        switch (s[i]) {
-        case 'v':
-            switch (s[i + 1]) {
-            case ' ':
-                if (sscanf(&s[i], "v %f %f %f", &v.x, &v.y, &v.z) == 3) {
-                    Reserve(obj.v, obj.v_n, obj.v_i + 1, B);
-                    obj.v[obj.v_i++] = v;
-                }
-                break;
-            }
-            break;
-        case 'f':
-            if (sscanf(&s[i], "f %hu/%hu/%hu %hu/%hu/%hu %hu/%hu/%hu",
-                       &u.x, &d, &d, &u.y, &d, &d, &u.z, &d, &d) == 9) {
-                Reserve(obj.f, obj.f_n, obj.f_i + 1, B);
-                obj.f[obj.f_i++] = u;
-            }
-            break;
-        }
+    if (obj_parse_file(path, 0, &d) != 0) {
+        Panic("unable to load '%s'", path);
+    }
+    if (d.position_count > UINT16_MAX + 1) {
+        errno = 0;
+        Panic("too many vertices for 16-bit indices in '%s': %u", path, d.position_count);
+    }
+
+    for (i = 0; i < d.position_count; i++) {
+        p = &d.positions[i * 3];
+        Reserve(obj.v, obj.v_n, obj.v_i + 1, B);
+        obj.v[obj.v_i++] = (struct f32x3){p[0], p[1], p[2]};
+    }
+    for (i = 0; i < d.face_count; i++) {
+        q = &d.faces[i * 3];
+        Reserve(obj.f, obj.f_n, obj.f_i + 1, B);
+        obj.f[obj.f_i++] = (struct u16x3){q[0], q[1], q[2]};
     }
-    munmap(f.addr, f.size);
+    obj_data_free(&d);
 
     return obj;
 }
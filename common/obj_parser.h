@@ -0,0 +1,529 @@
+#ifndef OBJ_PARSER_H
+#define OBJ_PARSER_H
+
+// An OBJ parser shared by the renderers, as a header that C and C++ can both
+// include. The file is mapped and split at line boundaries into chunks, which
+// are first counted and then parsed in parallel, each straight into its place
+// in the output arrays, so the result is in file order. Lines are found with
+// SSE2 where it's available, and numbers are parsed by hand rather than with
+// sscanf.
+//
+// Supports v, vt and vn, and f with any of the index forms a, a/b, a/b/c and
+// a//c, including negative indices. Polygons are split into triangle fans.
+// Anything from a '#' to the end of its line is a comment, and lines of any
+// other kind are ignored.
+//
+// obj_parse_file allocates with malloc and runs on threads of its own.
+// obj_parse_file_with takes hooks for both instead, for programs with their
+// own allocators and thread pools.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Where a face corner has no texture coordinate or normal.
+#define OBJ_NO_INDEX UINT32_MAX
+
+struct ObjHooks {
+    void *ctx;
+    // Returns size bytes aligned for floats and uint32_ts, or null.
+    void *(*alloc)(void *ctx, size_t size);
+    // Frees what alloc returned. Null if there's nothing to do.
+    void (*free)(void *ctx, void *p);
+    // Calls task(arg, i) for every i below count, on any threads in any
+    // order, and returns once they have all finished.
+    void (*run)(void *ctx, uint32_t count, void (*task)(void *arg, uint32_t i), void *arg);
+};
+
+struct ObjData {
+    // 3 floats per position and normal, and 2 per texture coordinate.
+    float *positions;
+    float *texcoords;
+    float *normals;
+    uint32_t position_count;
+    uint32_t texcoord_count;
+    uint32_t normal_count;
+    // 3 zero-based indices per triangle. face_texcoords and face_normals are
+    // null if the file has no texture coordinates or normals.
+    uint32_t *faces;
+    uint32_t *face_texcoords;
+    uint32_t *face_normals;
+    uint32_t face_count;
+    // What the arrays were allocated with, for obj_data_free.
+    struct ObjHooks hooks;
+};
+
+struct ObjCounts {
+    uint64_t positions, texcoords, normals, faces;
+};
+
+struct ObjChunk {
+    const char *begin, *end;
+    // Lines of each kind in the chunk, and then the number before it.
+    struct ObjCounts counts;
+    int failed;
+};
+
+struct ObjJob {
+    struct ObjChunk *chunks;
+    // Null while counting.
+    struct ObjData *out;
+};
+
+struct ObjThreadRun {
+    uint32_t count;
+    uint32_t next;
+    void (*task)(void *arg, uint32_t i);
+    void *arg;
+};
+
+#define OBJ_CHUNK_SIZE (1024 * 1024)
+#define OBJ_MAX_THREADS 64
+
+// Returns the first '\n' in [p, end), or end if there is none.
+static inline const char *obj_find_newline(const char *p, const char *end)
+{
+#if defined(__SSE2__)
+    __m128i newline = _mm_set1_epi8('\n');
+    for (; end - p >= 16; p += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)p);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; p < end; p++) {
+        if (*p == '\n') {
+            return p;
+        }
+    }
+    return end;
+}
+
+static inline int obj_is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline int obj_is_digit(char c)
+{
+    return (unsigned)(c - '0') < 10;
+}
+
+static inline const char *obj_skip_spaces(const char *p, const char *end)
+{
+    while (p < end && obj_is_space(*p)) {
+        p++;
+    }
+    return p;
+}
+
+// Parses a decimal float at p. Returns the end of it, or null if there isn't
+// one. Mantissas of up to 15 digits with small exponents, which is nearly
+// every number in an OBJ file, are exact in doubles and scaled by one exact
+// power of ten; the rest go through strtod.
+static inline const char *obj_parse_float(const char *p, const char *end, float *out)
+{
+    static const double powers_of_ten[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+    };
+    const char *start = p;
+    int negative = p < end && *p == '-';
+    p += p < end && (*p == '-' || *p == '+');
+
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    int any = 0;
+    for (; p < end && obj_is_digit(*p); p++, any = 1) {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += mantissa != 0;
+        } else {
+            exponent++;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && obj_is_digit(*p); p++, any = 1) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += mantissa != 0;
+                exponent--;
+            }
+        }
+    }
+    if (!any) {
+        return NULL;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        int exponent_negative = q < end && *q == '-';
+        q += q < end && (*q == '-' || *q == '+');
+        if (q < end && obj_is_digit(*q)) {
+            int e = 0;
+            for (; q < end && obj_is_digit(*q); q++) {
+                e = e < 10000 ? e * 10 + (*q - '0') : e;
+            }
+            exponent += exponent_negative ? -e : e;
+            p = q;
+        }
+    }
+
+    double value;
+    if (digits <= 15 && exponent >= -22 && exponent <= 22) {
+        value = exponent < 0 ? mantissa / powers_of_ten[-exponent] : mantissa * powers_of_ten[exponent];
+        value = negative ? -value : value;
+    } else {
+        char copy[64];
+        size_t n = p - start;
+        if (n >= sizeof(copy)) {
+            return NULL;
+        }
+        memcpy(copy, start, n);
+        copy[n] = '\0';
+        value = strtod(copy, NULL);
+    }
+    *out = (float)value;
+    return p;
+}
+
+// Parses a decimal integer at p. Returns the end of it, or null if there
+// isn't one.
+static inline const char *obj_parse_index(const char *p, const char *end, int64_t *out)
+{
+    int negative = p < end && *p == '-';
+    p += p < end && (*p == '-' || *p == '+');
+    if (p == end || !obj_is_digit(*p)) {
+        return NULL;
+    }
+    int64_t value = 0;
+    for (; p < end && obj_is_digit(*p); p++) {
+        value = value < (INT64_C(1) << 40) ? value * 10 + (*p - '0') : value;
+    }
+    *out = negative ? -value : value;
+    return p;
+}
+
+// Turns a one-based index, or a negative one counting back from the last of
+// count elements so far, into a zero-based one.
+static inline uint32_t obj_resolve_index(int64_t index, uint64_t count, int *failed)
+{
+    if (index > 0 && (uint64_t)index <= count) {
+        return (uint32_t)(index - 1);
+    }
+    if (index < 0 && (uint64_t)-index <= count) {
+        return (uint32_t)(count + index);
+    }
+    *failed = 1;
+    return 0;
+}
+
+// Parses n floats after the keyword at p into out, if it isn't null. Those
+// past the first required may be left out, and are then 0.
+static inline int obj_parse_floats(const char *p, const char *end, uint32_t n, uint32_t required, float *out)
+{
+    for (uint32_t i = 0; i < n; i++) {
+        float value = 0.0f;
+        const char *q = obj_skip_spaces(p, end);
+        if (q == end && i >= required) {
+            p = q;
+        } else if (q == p || !(p = obj_parse_float(q, end, &value))) {
+            return 0;
+        }
+        if (out) {
+            out[i] = value;
+        }
+    }
+    return 1;
+}
+
+// Counts the lines of each kind in a chunk or, with out, parses them into
+// out, starting at the places given by chunk->counts.
+static inline void obj_parse_chunk(struct ObjChunk *chunk, struct ObjData *out)
+{
+    struct ObjCounts at = chunk->counts;
+    if (!out) {
+        memset(&at, 0, sizeof(at));
+    }
+    const char *end = chunk->end;
+    for (const char *p = chunk->begin; p < end && !chunk->failed;) {
+        const char *next = obj_find_newline(p, end) + 1;
+        const char *line_end = (const char *)memchr(p, '#', next - 1 - p);
+        line_end = line_end ? line_end : next - 1;
+        p = obj_skip_spaces(p, line_end);
+        const char *q = p + 2;
+        if (line_end - p < 2) {
+            // Too short to be anything.
+        } else if (p[0] == 'v' && obj_is_space(p[1])) {
+            chunk->failed |= !obj_parse_floats(p + 1, line_end, 3, 3, out ? &out->positions[at.positions * 3] : NULL);
+            at.positions++;
+        } else if (p[0] == 'v' && p[1] == 't' && q < line_end && obj_is_space(*q)) {
+            chunk->failed |= !obj_parse_floats(q, line_end, 2, 1, out ? &out->texcoords[at.texcoords * 2] : NULL);
+            at.texcoords++;
+        } else if (p[0] == 'v' && p[1] == 'n' && q < line_end && obj_is_space(*q)) {
+            chunk->failed |= !obj_parse_floats(q, line_end, 3, 3, out ? &out->normals[at.normals * 3] : NULL);
+            at.normals++;
+        } else if (p[0] == 'f' && obj_is_space(p[1])) {
+            // The first corner, the one before this one, and this one, each
+            // as position, texture coordinate and normal.
+            uint32_t corners[3][3];
+            uint32_t n = 0;
+            for (q = p + 1;; n++) {
+                const char *r = obj_skip_spaces(q, line_end);
+                if (r == line_end) {
+                    break;
+                }
+                if (r == q) {
+                    chunk->failed = 1;
+                    break;
+                }
+                int64_t index[3] = {0, 0, 0};
+                q = obj_parse_index(r, line_end, &index[0]);
+                if (q && q < line_end && *q == '/') {
+                    q++;
+                    if (q < line_end && *q != '/') {
+                        q = obj_parse_index(q, line_end, &index[1]);
+                    }
+                    if (q && q < line_end && *q == '/') {
+                        q = obj_parse_index(q + 1, line_end, &index[2]);
+                    }
+                }
+                if (!q) {
+                    chunk->failed = 1;
+                    break;
+                }
+                if (!out) {
+                    continue;
+                }
+                uint32_t *corner = corners[n < 2 ? n : 2];
+                corner[0] = obj_resolve_index(index[0], at.positions, &chunk->failed);
+                corner[1] = index[1] ? obj_resolve_index(index[1], at.texcoords, &chunk->failed) : OBJ_NO_INDEX;
+                corner[2] = index[2] ? obj_resolve_index(index[2], at.normals, &chunk->failed) : OBJ_NO_INDEX;
+                if (n < 2) {
+                    continue;
+                }
+                uint64_t t = (at.faces + n - 2) * 3;
+                for (uint32_t i = 0; i < 3; i++) {
+                    out->faces[t + i] = corners[i][0];
+                    if (out->face_texcoords) {
+                        out->face_texcoords[t + i] = corners[i][1];
+                    }
+                    if (out->face_normals) {
+                        out->face_normals[t + i] = corners[i][2];
+                    }
+                }
+                memcpy(corners[1], corners[2], sizeof(corners[2]));
+            }
+            chunk->failed |= n < 3;
+            at.faces += n >= 3 ? n - 2 : 0;
+        }
+        p = next;
+    }
+    if (!out) {
+        chunk->counts = at;
+    }
+}
+
+static inline void obj_parse_chunk_task(void *arg, uint32_t i)
+{
+    struct ObjJob *job = (struct ObjJob *)arg;
+    obj_parse_chunk(&job->chunks[i], job->out);
+}
+
+static inline void *obj_thread_work(void *arg)
+{
+    struct ObjThreadRun *run = (struct ObjThreadRun *)arg;
+    for (uint32_t i; (i = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED)) < run->count;) {
+        run->task(run->arg, i);
+    }
+    return NULL;
+}
+
+// The default run hook: runs the tasks on the calling thread and up to
+// (uintptr_t)ctx - 1 others.
+static inline void obj_run_threads(void *ctx, uint32_t count, void (*task)(void *arg, uint32_t i), void *arg)
+{
+    struct ObjThreadRun run = {count, 0, task, arg};
+    uint32_t threads = (uint32_t)(uintptr_t)ctx;
+    pthread_t helpers[OBJ_MAX_THREADS];
+    uint32_t started = 0;
+    while (started + 1 < threads && started + 1 < count &&
+           pthread_create(&helpers[started], NULL, obj_thread_work, &run) == 0) {
+        started++;
+    }
+    obj_thread_work(&run);
+    for (uint32_t i = 0; i < started; i++) {
+        pthread_join(helpers[i], NULL);
+    }
+}
+
+static inline void *obj_malloc(void *ctx, size_t size)
+{
+    (void)ctx;
+    return malloc(size);
+}
+
+static inline void obj_free(void *ctx, void *p)
+{
+    (void)ctx;
+    free(p);
+}
+
+// Allocates room for n elements of the given size, never 0 bytes.
+static inline void *obj_alloc(const struct ObjHooks *hooks, uint64_t n, size_t size)
+{
+    return hooks->alloc(hooks->ctx, n * size + 1);
+}
+
+static inline void obj_dealloc(const struct ObjHooks *hooks, void *p)
+{
+    if (p && hooks->free) {
+        hooks->free(hooks->ctx, p);
+    }
+}
+
+static inline void obj_data_free(struct ObjData *obj)
+{
+    obj_dealloc(&obj->hooks, obj->positions);
+    obj_dealloc(&obj->hooks, obj->texcoords);
+    obj_dealloc(&obj->hooks, obj->normals);
+    obj_dealloc(&obj->hooks, obj->faces);
+    obj_dealloc(&obj->hooks, obj->face_texcoords);
+    obj_dealloc(&obj->hooks, obj->face_normals);
+    memset(obj, 0, sizeof(*obj));
+}
+
+// Parses the OBJ file at path into out, allocating and running with hooks.
+// Returns 0, or -1 with errno set if the file can't be read (or EINVAL if
+// it's malformed or too big for 32-bit indices, or ENOMEM if it doesn't fit
+// in memory), in which case out is left empty.
+static inline int obj_parse_file_with(const char *path, const struct ObjHooks *hooks, struct ObjData *out)
+{
+    memset(out, 0, sizeof(*out));
+    out->hooks = *hooks;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    if (size == 0) {
+        close(fd);
+        return 0;
+    }
+    void *addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return -1;
+    }
+    const char *s = (const char *)addr;
+    const char *end = s + size;
+
+    uint32_t count = (uint32_t)((size + OBJ_CHUNK_SIZE - 1) / OBJ_CHUNK_SIZE);
+    struct ObjChunk *chunks = (struct ObjChunk *)obj_alloc(hooks, count, sizeof(*chunks));
+    if (!chunks) {
+        munmap(addr, size);
+        errno = ENOMEM;
+        return -1;
+    }
+    const char *begin = s;
+    for (uint32_t i = 0; i < count; i++) {
+        const char *chunk_end = end;
+        if ((i + 1) * (size_t)OBJ_CHUNK_SIZE < size) {
+            chunk_end = obj_find_newline(s + (i + 1) * (size_t)OBJ_CHUNK_SIZE, end);
+            chunk_end += chunk_end < end;
+        }
+        chunk_end = chunk_end > begin ? chunk_end : begin;
+        memset(&chunks[i], 0, sizeof(chunks[i]));
+        chunks[i].begin = begin;
+        chunks[i].end = chunk_end;
+        begin = chunk_end;
+    }
+
+    struct ObjJob job = {chunks, NULL};
+    hooks->run(hooks->ctx, count, obj_parse_chunk_task, &job);
+
+    // Each chunk starts where the ones before it end.
+    struct ObjCounts total = {0, 0, 0, 0};
+    int failed = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        struct ObjCounts n = chunks[i].counts;
+        chunks[i].counts = total;
+        total.positions += n.positions;
+        total.texcoords += n.texcoords;
+        total.normals += n.normals;
+        total.faces += n.faces;
+        failed |= chunks[i].failed;
+    }
+    failed |= total.positions >= OBJ_NO_INDEX || total.texcoords >= OBJ_NO_INDEX ||
+              total.normals >= OBJ_NO_INDEX || total.faces * 3 >= OBJ_NO_INDEX;
+
+    int error = EINVAL;
+    if (!failed) {
+        out->position_count = (uint32_t)total.positions;
+        out->texcoord_count = (uint32_t)total.texcoords;
+        out->normal_count = (uint32_t)total.normals;
+        out->face_count = (uint32_t)total.faces;
+        out->positions = (float *)obj_alloc(hooks, total.positions * 3, sizeof(float));
+        out->texcoords = (float *)obj_alloc(hooks, total.texcoords * 2, sizeof(float));
+        out->normals = (float *)obj_alloc(hooks, total.normals * 3, sizeof(float));
+        out->faces = (uint32_t *)obj_alloc(hooks, total.faces * 3, sizeof(uint32_t));
+        if (total.texcoords) {
+            out->face_texcoords = (uint32_t *)obj_alloc(hooks, total.faces * 3, sizeof(uint32_t));
+        }
+        if (total.normals) {
+            out->face_normals = (uint32_t *)obj_alloc(hooks, total.faces * 3, sizeof(uint32_t));
+        }
+        if (!out->positions || !out->texcoords || !out->normals || !out->faces ||
+            (total.texcoords && !out->face_texcoords) || (total.normals && !out->face_normals)) {
+            failed = 1;
+            error = ENOMEM;
+        }
+    }
+    if (!failed) {
+        job.out = out;
+        hooks->run(hooks->ctx, count, obj_parse_chunk_task, &job);
+        for (uint32_t i = 0; i < count; i++) {
+            failed |= chunks[i].failed;
+        }
+    }
+
+    munmap(addr, size);
+    obj_dealloc(hooks, chunks);
+    if (failed) {
+        obj_data_free(out);
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+// Parses the OBJ file at path into out like obj_parse_file_with, with malloc
+// and up to threads threads, or as many as there are CPUs if threads is 0.
+static inline int obj_parse_file(const char *path, uint32_t threads, struct ObjData *out)
+{
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (uint32_t)cpus : 1;
+    }
+    threads = threads < OBJ_MAX_THREADS ? threads : OBJ_MAX_THREADS;
+    struct ObjHooks hooks = {(void *)(uintptr_t)threads, obj_malloc, obj_free, obj_run_threads};
+    return obj_parse_file_with(path, &hooks, out);
+}
+
+#endif
@@ -1,9 +1,12 @@
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <unistd.h>
 #include <math.h>
 #include "math.hh"
 #include "tga.hh"
 #include "obj.hh"
+#include "raster.hh"
 
 using obj::Obj;
 using tga::Image;
@@ -29,29 +32,36 @@ struct int3 {
 
 static void draw_triangle(Image& image, int3 a, int3 b, int3 c, Pixel color)
 {
-  auto min_x = min(min(a.x, b.x), c.x);
-  auto max_x = max(max(a.x, b.x), c.x);
-  auto min_y = min(min(a.y, b.y), c.y);
-  auto max_y = max(max(a.y, b.y), c.y);
-  for (int x = min_x; x <= max_x; x++) {
-    if (x >= image.width) {
-      continue;
-    }
-    for (int y = min_y; y <= max_y; y++) {
-      if (y >= image.height) {
-        continue;
-      }
-      auto p = float3{float(c.x - a.x), float(b.x - a.x), float(a.x - x)};
-      auto q = float3{float(c.y - a.y), float(b.y - a.y), float(a.y - y)};
-      auto s = cross(p, q);
-      if (fabsf(s.z) < 1.0f) {
-        continue;
-      }
-      auto t = float3{1.0f - (s.x + s.y) / s.z, s.y / s.z, s.x / s.z};
-      if (t.x < 0.0f || t.y < 0.0f || t.z < 0.0f) {
-        continue;
+  static const auto kernel = raster::select_kernel();
+
+  raster::Edges e;
+  if (!e.setup(a.x, a.y, b.x, b.y, c.x, c.y)) {
+    return;
+  }
+  auto min_x = max(min(min(a.x, b.x), c.x), 0);
+  auto max_x = min(max(max(a.x, b.x), c.x), int(image.width) - 1);
+  auto min_y = max(min(min(a.y, b.y), c.y), 0);
+  auto max_y = min(max(max(a.y, b.y), c.y), int(image.height) - 1);
+
+  // Walk the bounding box in blocks of up to 64 x 64 spans.
+  constexpr int BLOCK = 64;
+  uint8_t masks[BLOCK * BLOCK];
+  for (int y0 = min_y; y0 <= max_y; y0 += BLOCK) {
+    auto rows = min(max_y - y0 + 1, BLOCK);
+    for (int x0 = min_x; x0 <= max_x; x0 += BLOCK * 8) {
+      auto spans = min((max_x - x0 + 8) / 8, BLOCK);
+      kernel(e, x0, y0, spans, rows, masks);
+      for (int r = 0; r < rows; r++) {
+        auto row = &image.pixels[(y0 + r) * image.width];
+        for (int s = 0; s < spans; s++) {
+          for (unsigned m = masks[r * spans + s]; m; m &= m - 1) {
+            auto x = x0 + s * 8 + __builtin_ctz(m);
+            if (x <= max_x) {
+              row[x] = color;
+            }
+          }
+        }
       }
-      image.pixels[y * image.width + x] = color;
     }
   }
 }
@@ -65,9 +75,31 @@ static int3 world_to_screen(float3 v, uint16_t width, uint16_t height)
 
 constexpr auto SPOTLIGHT = float3(0.0f, 0.0f, -1.0f);
 
-static void draw_obj(const Obj& obj, Image& image)
+struct DrawStats {
+  uint32_t clusters;
+  // Clusters entirely off the screen, or facing away from the light.
+  uint32_t culled_clusters;
+};
+
+static DrawStats draw_obj(const Obj& obj, Image& image)
 {
-  for (auto& f : obj.faces) {
+  // The screen covers -1 <= x, y <= 1, and faces are drawn when their normal
+  // points toward the spotlight.
+  auto visible = static_cast<bool*>(malloc(obj.clusters.len));
+  DrawStats stats = {obj.clusters.len, 0};
+  for (uint32_t i = 0; i < obj.clusters.len; i++) {
+    auto& c = obj.clusters[i];
+    auto off_screen = c.center.x + c.radius < -1.0f || c.center.x - c.radius > 1.0f ||
+                      c.center.y + c.radius < -1.0f || c.center.y - c.radius > 1.0f;
+    visible[i] = !off_screen && c.cone_axis * SPOTLIGHT >= -c.cone_cutoff;
+    stats.culled_clusters += !visible[i];
+  }
+
+  for (uint32_t i = 0; i < obj.faces.len; i++) {
+    if (!visible[obj.face_clusters[i]]) {
+      continue;
+    }
+    auto& f = obj.faces[i];
     auto v0 = obj.vertices[f.v0];
     auto v1 = obj.vertices[f.v1];
     auto v2 = obj.vertices[f.v2];
@@ -84,15 +116,36 @@ static void draw_obj(const Obj& obj, Image& image)
     auto b = uint8_t(I * 255.0f);
     draw_triangle(image, s0, s1, s2, {b, g, r});
   }
+  ::free(visible);
+  return stats;
 }
 
 int main(int argc, char** argv) {
+  // SWR_OUTPUT picks how out.tga is written: "write" (the default) draws into
+  // memory and writes that out afterwards, "mmap" draws straight into the
+  // mapped file, and "mmap-msync" or "mmap-fdatasync" then wait for it to
+  // reach the disk.
+  auto output = getenv("SWR_OUTPUT");
+  auto mapped = output && strncmp(output, "mmap", 4) == 0;
+  auto sync = tga::Sync::None;
+  if (output && strcmp(output, "mmap-msync") == 0) {
+    sync = tga::Sync::Msync;
+  } else if (output && strcmp(output, "mmap-fdatasync") == 0) {
+    sync = tga::Sync::Fdatasync;
+  }
+
   auto obj = Obj::from_file("head.obj");
-  auto image = Image::allocate(1000, 1000);
-  draw_obj(obj, image);
+  auto image = mapped ? Image::map("out.tga", 1000, 1000) : Image::allocate(1000, 1000);
+  auto stats = draw_obj(obj, image);
+  printf("%u of %u clusters culled (%.1f%%)\n", stats.culled_clusters, stats.clusters,
+         stats.clusters ? 100.0 * stats.culled_clusters / stats.clusters : 0.0);
   obj.free();
-  image.write("out.tga");
-  image.free();
+  if (mapped) {
+    image.unmap(sync);
+  } else {
+    image.write("out.tga");
+    image.free();
+  }
 
   execlp("open", "open", "out.tga", NULL);
 }
@@ -1,64 +1,175 @@
 #include <cstdio>
+#include <cstdlib>
 #include <cassert>
+#include <cfloat>
+#include <math.h>
 #include "obj.hh"
 #include "math.hh"
+#include "../common/obj_parser.h"
 
 using namespace obj;
 
-Obj Obj::from_file(const char* path)
+// Spreads the low 10 bits of x out to every third bit.
+static uint32_t spread_bits(uint32_t x)
 {
-  Vec<float3> vertices;
-  Vec<Face> faces;
+  x &= 0x3FF;
+  x = (x | x << 16) & 0x030000FF;
+  x = (x | x << 8) & 0x0300F00F;
+  x = (x | x << 4) & 0x030C30C3;
+  x = (x | x << 2) & 0x09249249;
+  return x;
+}
+
+static int compare_keys(const void* a, const void* b)
+{
+  auto x = *static_cast<const uint64_t*>(a);
+  auto y = *static_cast<const uint64_t*>(b);
+  return (x > y) - (x < y);
+}
 
-  vertices.reserve(16);
-  faces.reserve(16);
+static float3 face_normal(const Vec<float3>& vertices, Face f)
+{
+  auto v0 = vertices[f.v0];
+  return cross(vertices[f.v2] - v0, vertices[f.v1] - v0);
+}
 
-  auto file = fopen(path, "r");
-  assert(file);
+// Groups faces into clusters of FACES_PER_CLUSTER by sorting them along a
+// Morton curve through an 8 by 8 octahedral map of their normals'
+// directions, and within each cell of it, along a Morton curve through their
+// centroids, then bounds each cluster.
+static void build_clusters(Obj& obj)
+{
+  // Covers rounding in the normals and the test, so a cone never culls a
+  // face that would have been drawn.
+  constexpr float CONE_MARGIN = 1e-3f;
 
-  char line[64];
-  while (fgets(line, sizeof(line), file)) {
-    if (vertices.len >= vertices.cap) {
-      vertices.reserve(vertices.cap * 3 / 2);
+  auto lo = float3(FLT_MAX, FLT_MAX, FLT_MAX);
+  auto hi = float3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+  for (auto& v : obj.vertices) {
+    lo = float3(fminf(lo.x, v.x), fminf(lo.y, v.y), fminf(lo.z, v.z));
+    hi = float3(fmaxf(hi.x, v.x), fmaxf(hi.y, v.y), fmaxf(hi.z, v.z));
+  }
+  // Sums of a face's three vertices, three times its centroid, are scaled to
+  // 8 bits.
+  auto scale = float3(hi.x > lo.x ? 255.0f / (3.0f * (hi.x - lo.x)) : 0.0f,
+                      hi.y > lo.y ? 255.0f / (3.0f * (hi.y - lo.y)) : 0.0f,
+                      hi.z > lo.z ? 255.0f / (3.0f * (hi.z - lo.z)) : 0.0f);
+
+  // The sort key in the high bits, and the face in the low 32.
+  auto count = obj.faces.len;
+  auto keys = static_cast<uint64_t*>(malloc(count * sizeof(uint64_t)));
+  for (uint32_t i = 0; i < count; i++) {
+    auto f = obj.faces[i];
+    auto a = obj.vertices[f.v0];
+    auto b = obj.vertices[f.v1];
+    auto c = obj.vertices[f.v2];
+    // Project the normal onto the octahedron |x| + |y| + |z| = 1, and unfold
+    // its lower half over the upper one's corners.
+    auto n = face_normal(obj.vertices, f);
+    auto l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+    auto u = 0.0f, v = 0.0f;
+    if (l1 > 0.0f) {
+      u = n.x / l1;
+      v = n.y / l1;
+      if (n.z < 0.0f) {
+        auto fold_u = (1.0f - fabsf(v)) * (u < 0.0f ? -1.0f : 1.0f);
+        auto fold_v = (1.0f - fabsf(u)) * (v < 0.0f ? -1.0f : 1.0f);
+        u = fold_u;
+        v = fold_v;
+      }
     }
-    if (faces.len >= faces.cap) {
-      faces.reserve(faces.cap * 3 / 2);
+    auto cell_u = uint32_t(fminf((u + 1.0f) * 4.0f, 7.0f));
+    auto cell_v = uint32_t(fminf((v + 1.0f) * 4.0f, 7.0f));
+    auto direction = spread_bits(cell_u) | spread_bits(cell_v) << 1;
+    auto x = uint32_t((a.x + b.x + c.x - 3.0f * lo.x) * scale.x);
+    auto y = uint32_t((a.y + b.y + c.y - 3.0f * lo.y) * scale.y);
+    auto z = uint32_t((a.z + b.z + c.z - 3.0f * lo.z) * scale.z);
+    auto position = spread_bits(x) | spread_bits(y) << 1 | spread_bits(z) << 2;
+    keys[i] = uint64_t(direction << 24 | position) << 32 | i;
+  }
+  qsort(keys, count, sizeof(uint64_t), compare_keys);
+
+  auto cluster_count = (count + FACES_PER_CLUSTER - 1) / FACES_PER_CLUSTER;
+  obj.clusters.reserve(cluster_count);
+  obj.face_clusters.reserve(count);
+  obj.face_clusters.len = count;
+  for (uint32_t first = 0; first < count; first += FACES_PER_CLUSTER) {
+    auto end = first + FACES_PER_CLUSTER < count ? first + FACES_PER_CLUSTER : count;
+    auto box_lo = float3(FLT_MAX, FLT_MAX, FLT_MAX);
+    auto box_hi = float3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    auto sum = float3(0.0f, 0.0f, 0.0f);
+    for (auto k = first; k < end; k++) {
+      auto f = obj.faces[uint32_t(keys[k])];
+      uint32_t corners[] = {f.v0, f.v1, f.v2};
+      for (auto i : corners) {
+        auto p = obj.vertices[i];
+        box_lo = float3(fminf(box_lo.x, p.x), fminf(box_lo.y, p.y), fminf(box_lo.z, p.z));
+        box_hi = float3(fmaxf(box_hi.x, p.x), fmaxf(box_hi.y, p.y), fmaxf(box_hi.z, p.z));
+      }
+      auto n = face_normal(obj.vertices, f);
+      if (n * n > 0.0f) {
+        auto u = n.normalize();
+        sum = float3(sum.x + u.x, sum.y + u.y, sum.z + u.z);
+      }
+      obj.face_clusters[uint32_t(keys[k])] = obj.clusters.len;
     }
-    switch (line[0]) {
-      case 'v': {
-        float x, y, z;
-        auto n = sscanf(line, "v %f %f %f", &x, &y, &z);
-        if (n != 3) {
-          continue;
-        }
-        vertices.append(float3(x, y, z));
-        break;
+
+    auto center = float3((box_lo.x + box_hi.x) * 0.5f, (box_lo.y + box_hi.y) * 0.5f,
+                         (box_lo.z + box_hi.z) * 0.5f);
+    auto radius = 0.0f;
+    auto axis = float3(0.0f, 0.0f, 0.0f);
+    auto min_cos = sum * sum > 0.0f ? 1.0f : -1.0f;
+    if (sum * sum > 0.0f) {
+      axis = sum.normalize();
+    }
+    for (auto k = first; k < end; k++) {
+      auto f = obj.faces[uint32_t(keys[k])];
+      uint32_t corners[] = {f.v0, f.v1, f.v2};
+      for (auto i : corners) {
+        auto d = obj.vertices[i] - center;
+        radius = fmaxf(radius, sqrtf(d * d));
       }
-      case 'f': {
-        Face f;
-        uint16_t discard;
-        auto n = sscanf(line, "f %hu/%hu/%hu %hu/%hu/%hu %hu/%hu/%hu",
-                        &f.v0, &discard, &discard, &f.v1, &discard, &discard,
-                        &f.v2, &discard, &discard);
-        if (n != 9) {
-          continue;
-        }
-        f.v0--;
-        f.v1--;
-        f.v2--;
-        faces.append(f);
-        break;
+      auto n = face_normal(obj.vertices, f);
+      if (n * n > 0.0f) {
+        min_cos = fminf(min_cos, n.normalize() * axis);
       }
     }
+    auto cutoff = min_cos > CONE_MARGIN ? sqrtf(fmaxf(1.0f - min_cos * min_cos, 0.0f)) + CONE_MARGIN : 2.0f;
+    obj.clusters.append(Cluster{center, radius, axis, cutoff});
   }
+  ::free(keys);
+}
 
-  fclose(file);
+Obj Obj::from_file(const char* path)
+{
+  ObjData data;
+  auto result = obj_parse_file(path, 0, &data);
+  assert(result == 0);
+  (void)result;
+
+  Vec<float3> vertices;
+  Vec<Face> faces;
+  vertices.reserve(data.position_count ? data.position_count : 1);
+  faces.reserve(data.face_count ? data.face_count : 1);
+  for (uint32_t i = 0; i < data.position_count; i++) {
+    auto p = &data.positions[i * 3];
+    vertices.append(float3(p[0], p[1], p[2]));
+  }
+  for (uint32_t i = 0; i < data.face_count; i++) {
+    auto f = &data.faces[i * 3];
+    faces.append(Face{f[0], f[1], f[2]});
+  }
+  obj_data_free(&data);
 
-  return {vertices, faces};
+  Obj obj = {vertices, faces};
+  build_clusters(obj);
+  return obj;
 }
 
 void Obj::free()
 {
   vertices.free();
   faces.free();
+  clusters.free();
+  face_clusters.free();
 }
@@ -2,18 +2,37 @@
 #define OBJ_HH
 #include <cstdint>
 #include "vec.hh"
-
-struct float3;
+#include "math.hh"
 
 namespace obj {
 
 struct Face {
-  uint16_t v0, v1, v2;
+  uint32_t v0, v1, v2;
+};
+
+// Most faces in a cluster.
+constexpr uint32_t FACES_PER_CLUSTER = 64;
+
+// Bounds of a group of faces that let them be skipped together: a sphere
+// around their vertices, and a cone around their unit normals n, which all
+// have n * cone_axis >= cos(a) for the cone's half-angle a. cone_cutoff is
+// sin(a), rounded up a little, or more than 1 if the cone is too wide to
+// cull anything.
+struct Cluster {
+  float3 center;
+  float radius;
+  float3 cone_axis;
+  float cone_cutoff;
 };
 
 struct Obj {
   Vec<float3> vertices;
   Vec<Face> faces;
+  // Faces grouped by where they are and which way they face. Faces stay in
+  // file order, since they're drawn in it, so each one has the index of its
+  // cluster.
+  Vec<Cluster> clusters;
+  Vec<uint32_t> face_clusters;
 
   static Obj from_file(const char* path);
   void free();
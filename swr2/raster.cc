@@ -0,0 +1,145 @@
+#include <cstdlib>
+#include <cstring>
+#include <math.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "raster.hh"
+
+using namespace raster;
+
+bool Edges::setup(float x0, float y0, float x1, float y1, float x2, float y2)
+{
+  auto area = (x2 - x0) * (y1 - y0) - (x1 - x0) * (y2 - y0);
+  if (fabsf(area) < 1.0f) {
+    return false;
+  }
+  auto sign = area < 0.0f ? -1.0f : 1.0f;
+  // Edge i runs between the two vertices other than vertex i.
+  float from_x[3] = {x1, x2, x0};
+  float from_y[3] = {y1, y2, y0};
+  float to_x[3] = {x2, x0, x1};
+  float to_y[3] = {y2, y0, y1};
+  for (int i = 0; i < 3; i++) {
+    a[i] = (to_y[i] - from_y[i]) * sign;
+    b[i] = (from_x[i] - to_x[i]) * sign;
+    c[i] = -(a[i] * from_x[i] + b[i] * from_y[i]);
+  }
+  return true;
+}
+
+static void kernel_scalar(const Edges& e, int x, int y, int spans, int rows, uint8_t* masks)
+{
+  float row[3];
+  for (int i = 0; i < 3; i++) {
+    row[i] = e.a[i] * x + e.b[i] * y + e.c[i];
+  }
+  for (int r = 0; r < rows; r++) {
+    float w[3] = {row[0], row[1], row[2]};
+    for (int s = 0; s < spans; s++) {
+      uint8_t mask = 0;
+      for (int j = 0; j < 8; j++) {
+        if (w[0] >= 0.0f && w[1] >= 0.0f && w[2] >= 0.0f) {
+          mask |= 1 << j;
+        }
+        for (int i = 0; i < 3; i++) {
+          w[i] += e.a[i];
+        }
+      }
+      masks[r * spans + s] = mask;
+    }
+    for (int i = 0; i < 3; i++) {
+      row[i] += e.b[i];
+    }
+  }
+}
+
+#if defined(__x86_64__)
+static void kernel_sse(const Edges& e, int x, int y, int spans, int rows, uint8_t* masks)
+{
+  auto lane = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+  auto zero = _mm_setzero_ps();
+  __m128 row[3], step_x[3], step_y[3];
+  for (int i = 0; i < 3; i++) {
+    auto a = _mm_set1_ps(e.a[i]);
+    row[i] = _mm_add_ps(_mm_set1_ps(e.a[i] * x + e.b[i] * y + e.c[i]), _mm_mul_ps(a, lane));
+    step_x[i] = _mm_mul_ps(a, _mm_set1_ps(4.0f));
+    step_y[i] = _mm_set1_ps(e.b[i]);
+  }
+  for (int r = 0; r < rows; r++) {
+    auto w0 = row[0], w1 = row[1], w2 = row[2];
+    for (int s = 0; s < spans * 2; s++) {
+      auto inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(w0, zero), _mm_cmpge_ps(w1, zero)),
+                               _mm_cmpge_ps(w2, zero));
+      auto bits = _mm_movemask_ps(inside);
+      if (s % 2 == 0) {
+        masks[r * spans + s / 2] = bits;
+      } else {
+        masks[r * spans + s / 2] |= bits << 4;
+      }
+      w0 = _mm_add_ps(w0, step_x[0]);
+      w1 = _mm_add_ps(w1, step_x[1]);
+      w2 = _mm_add_ps(w2, step_x[2]);
+    }
+    for (int i = 0; i < 3; i++) {
+      row[i] = _mm_add_ps(row[i], step_y[i]);
+    }
+  }
+}
+
+__attribute__((target("avx2")))
+static void kernel_avx2(const Edges& e, int x, int y, int spans, int rows, uint8_t* masks)
+{
+  auto lane = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+  auto zero = _mm256_setzero_ps();
+  __m256 row[3], step_x[3], step_y[3];
+  for (int i = 0; i < 3; i++) {
+    auto a = _mm256_set1_ps(e.a[i]);
+    row[i] = _mm256_add_ps(_mm256_set1_ps(e.a[i] * x + e.b[i] * y + e.c[i]),
+                           _mm256_mul_ps(a, lane));
+    step_x[i] = _mm256_mul_ps(a, _mm256_set1_ps(8.0f));
+    step_y[i] = _mm256_set1_ps(e.b[i]);
+  }
+  for (int r = 0; r < rows; r++) {
+    auto w0 = row[0], w1 = row[1], w2 = row[2];
+    for (int s = 0; s < spans; s++) {
+      auto inside = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(w0, zero, _CMP_GE_OQ),
+                                                _mm256_cmp_ps(w1, zero, _CMP_GE_OQ)),
+                                  _mm256_cmp_ps(w2, zero, _CMP_GE_OQ));
+      masks[r * spans + s] = _mm256_movemask_ps(inside);
+      w0 = _mm256_add_ps(w0, step_x[0]);
+      w1 = _mm256_add_ps(w1, step_x[1]);
+      w2 = _mm256_add_ps(w2, step_x[2]);
+    }
+    for (int i = 0; i < 3; i++) {
+      row[i] = _mm256_add_ps(row[i], step_y[i]);
+    }
+  }
+}
+#endif
+
+static const struct {
+  const char* name;
+  Kernel kernel;
+  bool (*supported)();
+} kernels[] = {
+#if defined(__x86_64__)
+  {"avx2", kernel_avx2, [] { return bool(__builtin_cpu_supports("avx2")); }},
+  {"sse", kernel_sse, [] { return true; }},
+#endif
+  {"scalar", kernel_scalar, [] { return true; }},
+};
+
+Kernel raster::select_kernel()
+{
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+#endif
+  auto name = getenv("SWR_KERNEL");
+  for (auto& k : kernels) {
+    if ((!name || strcmp(name, k.name) == 0) && k.supported()) {
+      return k.kernel;
+    }
+  }
+  return kernel_scalar;
+}
@@ -0,0 +1,35 @@
+#ifndef RASTER_HH
+#define RASTER_HH
+#include <cstdint>
+
+namespace raster {
+
+// The edge functions of a screen-space triangle, E[i](x, y) = a[i] * x +
+// b[i] * y + c[i], oriented so that a pixel is inside the triangle when all
+// three are non-negative.
+struct Edges {
+  // Change in each edge function per pixel in x.
+  float a[3];
+  // Change in each edge function per pixel in y.
+  float b[3];
+  // Value of each edge function at the origin.
+  float c[3];
+
+  // Set up the edge functions of triangle (x0, y0), (x1, y1), (x2, y2).
+  // Returns false if the triangle is too thin to cover any pixels.
+  bool setup(float x0, float y0, float x1, float y1, float x2, float y2);
+};
+
+// Computes coverage for a block of pixels starting at (x, y), 8 x spans pixels
+// wide and rows pixels tall. masks[row * spans + span] gets bit i set if pixel
+// (x + span * 8 + i, y + row) is covered.
+using Kernel = void (*)(const Edges& e, int x, int y, int spans, int rows, uint8_t* masks);
+
+// Return the fastest kernel this CPU supports, or the one named by the
+// SWR_KERNEL environment variable ("avx2", "sse" or "scalar") if it is set and
+// supported.
+Kernel select_kernel();
+
+};
+
+#endif
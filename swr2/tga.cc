@@ -2,6 +2,9 @@
 #include <cstdlib>
 #include <cstring>
 #include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "tga.hh"
 
 using namespace tga;
@@ -17,9 +20,26 @@ using namespace tga;
     abort(); \
   })
 
+constexpr size_t HEADER_SIZE = 18;
+
+static void write_header(uint8_t* header, uint32_t width, uint32_t height)
+{
+  memset(header, 0, HEADER_SIZE);
+  // Uncompressed true color image.
+  header[2] = 2;
+  // Width, little-endian byte-order.
+  header[12] = width & 0xFF;
+  header[13] = (width & 0xFF00) >> 8;
+  // Height, little-endian byte-order.
+  header[14] = height & 0xFF;
+  header[15] = (height & 0xFF00) >> 8;
+  // Bits-per-pixel.
+  header[16] = sizeof(Pixel) * 8;
+}
+
 Image Image::allocate(uint32_t width, uint32_t height)
 {
-  auto p = malloc(width * height * sizeof(pixels[0]));
+  auto p = calloc(size_t(width) * height, sizeof(pixels[0]));
   if (!p) {
     panic("unable to allocate pixels, %ux%u", width, height);
   }
@@ -27,25 +47,54 @@ Image Image::allocate(uint32_t width, uint32_t height)
   return {pixels, width, height};
 }
 
+Image Image::map(const char* path, uint32_t width, uint32_t height)
+{
+  auto fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    panic("unable to create %s", path);
+  }
+  auto size = HEADER_SIZE + size_t(width) * height * sizeof(Pixel);
+  // Allocating the whole file up front keeps page faults cheap, and turns a
+  // full disk into an error here instead of a SIGBUS while drawing.
+  if (auto error = posix_fallocate(fd, 0, size)) {
+    errno = error;
+    panic("unable to allocate %s", path);
+  }
+  auto p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    panic("unable to map %s", path);
+  }
+  auto file = static_cast<uint8_t*>(p);
+  write_header(file, width, height);
+  return {reinterpret_cast<Pixel*>(file + HEADER_SIZE), width, height, fd};
+}
+
 void Image::free()
 {
   ::free(pixels);
 }
 
+void Image::unmap(Sync sync)
+{
+  auto file = reinterpret_cast<uint8_t*>(pixels) - HEADER_SIZE;
+  auto size = HEADER_SIZE + size_t(width) * height * sizeof(Pixel);
+  if (sync == Sync::Msync && msync(file, size, MS_SYNC) != 0) {
+    panic("unable to msync pixels");
+  }
+  if (munmap(file, size) != 0) {
+    panic("unable to unmap pixels");
+  }
+  if (sync == Sync::Fdatasync && fdatasync(fd) != 0) {
+    panic("unable to fdatasync pixels");
+  }
+  close(fd);
+  fd = -1;
+}
+
 void Image::write(const char* path)
 {
-  uint8_t header[18];
-  memset(header, 0, sizeof(header));
-  // Uncompressed true color image.
-  header[2] = 2;
-  // Width, little-endian byte-order.
-  header[12] = width & 0xFF;
-  header[13] = (width & 0xFF00) >> 8;
-  // Height, little-endian byte-order.
-  header[14] = height & 0xFF;
-  header[15] = (height & 0xFF00) >> 8;
-  // Bits-per-pixel.
-  header[16] = sizeof(pixels[0]) * 8;
+  uint8_t header[HEADER_SIZE];
+  write_header(header, width, height);
 
   auto file = fopen(path, "w");
   fwrite(header, sizeof(header), 1, file);
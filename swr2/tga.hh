@@ -14,6 +14,16 @@ struct Pixel {
   uint8_t r;
 };
 
+// What to wait for when closing a mapped image.
+enum class Sync {
+  // Nothing, the kernel writes the pixels back in its own time.
+  None,
+  // msync the mapping, so the pixels are on disk.
+  Msync,
+  // fdatasync the file, so the pixels are on disk.
+  Fdatasync,
+};
+
 // A TGA image, containing a pixel array formatted for output to a file.
 struct Image {
   // Array of pixels, len = width x height.
@@ -22,11 +32,18 @@ struct Image {
   uint32_t width;
   // Height of the image, in pixel units.
   uint32_t height;
+  // File the pixels are mapped from, or -1 if they were allocated.
+  int fd = -1;
 
   // Allocate a pixel array of width x height pixels.
   static Image allocate(uint32_t width, uint32_t height);
+  // Create a file of width x height pixels, write the TGA header, and map the
+  // pixel array onto the rest of it, so drawing writes the file directly.
+  static Image map(const char* path, uint32_t width, uint32_t height);
   // Free the pixel array associated with this image.
   void free();
+  // Unmap a mapped image, finishing its file, after waiting as sync says.
+  void unmap(Sync sync);
   // Create a file and write the TGA header and pixel data.
   void write(const char* path);
 };
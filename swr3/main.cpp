@@ -8,6 +8,7 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include "../common/obj_parser.h"
 
 #define panic(...) \
   do { \
@@ -33,8 +34,8 @@ struct f32x3 {
   f32 x, y, z;
 };
 
-struct u16x3 {
-  u16 x, y, z;
+struct u32x3 {
+  u32 x, y, z;
 };
 
 static u8* align_address(u8* addr, u64 alignment) {
@@ -131,45 +132,19 @@ struct Vec {
 };
 
 int main(int argc, char** argv) {
-  int fd = open("head.obj", O_RDONLY);
-  if (fd < 0) {
-    panic("Unable to open head.obj");
+  ObjData data;
+  if (obj_parse_file("head.obj", 0, &data) != 0) {
+    panic("Unable to load head.obj");
   }
-  struct stat st;
-  if (fstat(fd, &st) != 0) {
-    panic("Unable to fstat head.obj");
+  auto vertices = Vec<f32x3>::with_capacity(data.position_count ? data.position_count : 1, g_arena);
+  auto faces = Vec<u32x3>::with_capacity(data.face_count ? data.face_count : 1, g_arena);
+  for (u32 i = 0; i < data.position_count; i++) {
+    const f32 *p = &data.positions[i * 3];
+    vertices.push(f32x3{p[0], p[1], p[2]}, g_arena);
   }
-  void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-  if (addr == MAP_FAILED) {
-    panic("Unable to mmap head.obj");
+  for (u32 i = 0; i < data.face_count; i++) {
+    const u32 *f = &data.faces[i * 3];
+    faces.push(u32x3{f[0], f[1], f[2]}, g_arena);
   }
-  const char *text = static_cast<const char*>(addr);
-  auto vertices = Vec<f32x3>::with_capacity(1500, g_arena);
-  auto faces = Vec<u16x3>::with_capacity(2500, g_arena);
-  for (size_t i = 0; i < st.st_size; i++) {
-    switch (text[i]) {
-      case 'v':
-        switch (text[i + 1]) {
-          case ' ': {
-            f32x3 v;
-            if (sscanf(&text[i], "v %f %f %f", &v.x, &v.y, &v.z) == 3) {
-              vertices.push(v, g_arena);
-            }
-            break;
-          }
-        }
-        break;
-      case 'f': {
-        u16x3 f;
-        u16 d;
-        if (sscanf(&text[i], "f %hu/%hu/%hu %hu/%hu/%hu %hu/%hu/%hu",
-                   &f.x, &d, &d, &f.y, &d, &d, &f.z, &d, &d) == 9) {
-          faces.push(f, g_arena);
-        }
-        break;
-      }
-    }
-  }
-  munmap(addr, st.st_size);
-  close(fd);
+  obj_data_free(&data);
 }
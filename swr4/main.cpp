@@ -5,11 +5,27 @@
 #include <cerrno>
 #include <cassert>
 #include <limits>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 #include <math.h>
 #include <fcntl.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 #include <unistd.h>
+#include <time.h>
+#include <limits.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#include "../common/obj_parser.h"
 
 #define panic(...) \
   do { \
@@ -22,6 +38,11 @@
     exit(1); \
   } while (0)
 
+// Marks kernels that have to give the same results as their other versions.
+// -ffast-math lets GCC swap division and square roots for approximate
+// reciprocals, in vector code even at -O0, so these are built without it.
+#define EXACT_MATH __attribute__((optimize("no-unsafe-math-optimizations")))
+
 using i8 = int8_t;
 using i16 = int16_t;
 using i32 = int32_t;
@@ -62,7 +83,7 @@ static MemoryMappedFile mmap_read_only(const char *path) {
 
   void *addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
   if (addr == MAP_FAILED) {
-    panic("unable to mmap head.obj");
+    panic("unable to mmap '%s'", path);
   }
   close(fd);
 
@@ -76,6 +97,14 @@ struct f32x3 {
   f32x3 normalize() const;
 };
 
+struct f32x2 {
+  f32 x, y;
+};
+
+struct f32x4 {
+  f32 x, y, z, w;
+};
+
 struct u16x3 {
   u16 x, y, z;
 };
@@ -99,6 +128,68 @@ static f32x3 operator*(f32x3 a, f32 s) {
   return {a.x * s, a.y * s, a.z * s};
 }
 
+static f32 dot(f32x4 a, f32x4 b) {
+  return a.x * b.x + a.y * b.y + a.z * b.z + a.w * b.w;
+}
+
+// Linear interpolation from a (t = 0) to b (t = 1).
+static f32x4 lerp(f32x4 a, f32x4 b, f32 t) {
+  return {
+    a.x + (b.x - a.x) * t,
+    a.y + (b.y - a.y) * t,
+    a.z + (b.z - a.z) * t,
+    a.w + (b.w - a.w) * t,
+  };
+}
+
+// A 4x4 matrix that transforms column vectors, stored by rows.
+struct Mat4 {
+  f32 m[4][4];
+
+  // Looks down -z at the cube from -1 to 1, magnified by zoom about its
+  // center. Depth is -z.
+  static Mat4 orthographic(f32 zoom) {
+    return {{
+      {zoom, 0.0f, 0.0f, 0.0f},
+      {0.0f, zoom, 0.0f, 0.0f},
+      {0.0f, 0.0f, -1.0f, 0.0f},
+      {0.0f, 0.0f, 0.0f, 1.0f},
+    }};
+  }
+
+  // Turns counterclockwise by angle radians about y, looking down -y.
+  static Mat4 rotation_y(f32 angle) {
+    f32 c = cosf(angle);
+    f32 s = sinf(angle);
+    return {{
+      {c, 0.0f, s, 0.0f},
+      {0.0f, 1.0f, 0.0f, 0.0f},
+      {-s, 0.0f, c, 0.0f},
+      {0.0f, 0.0f, 0.0f, 1.0f},
+    }};
+  }
+
+  // Applies b, then this.
+  Mat4 operator*(const Mat4 &b) const {
+    Mat4 r;
+    for (u32 i = 0; i < 4; i++) {
+      for (u32 j = 0; j < 4; j++) {
+        r.m[i][j] = m[i][0] * b.m[0][j] + m[i][1] * b.m[1][j] + m[i][2] * b.m[2][j] + m[i][3] * b.m[3][j];
+      }
+    }
+    return r;
+  }
+
+  // Transforms the point v, with w = 1.
+  f32x4 operator*(f32x3 v) const {
+    f32 r[4];
+    for (u32 i = 0; i < 4; i++) {
+      r[i] = m[i][0] * v.x + m[i][1] * v.y + m[i][2] * v.z + m[i][3];
+    }
+    return {r[0], r[1], r[2], r[3]};
+  }
+};
+
 static f32x3 operator/(f32x3 a, f32 d) {
   return a * (1.0f / d);
 }
@@ -125,28 +216,79 @@ static u8 *align_address(u8 *addr, u64 alignment) {
   return reinterpret_cast<u8 *>(x);
 }
 
+static u64 align_offset(u64 offset, u64 alignment) {
+  return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+// A bump allocator. Either over a fixed array, or over a reserved range of
+// address space whose pages are committed as the arena grows, so a reserved
+// arena can be made far larger than it will ever need to be.
 struct Arena {
   u8 *data;
-  u32 capacity;
-  u32 pos;
+  u64 capacity;
+  u64 pos;
+  // Bytes at the start of data that are readable and writable.
+  u64 committed;
+  // For reserved arenas, reset() gives pages above this many bytes back to the
+  // OS, so a spike doesn't keep memory resident for good.
+  u64 retain;
+  bool reserved;
+
+  // Reserved arenas commit memory in steps of this many bytes.
+  static constexpr u64 COMMIT_SIZE = 1024 * 1024;
 
   template<u32 N>
   constexpr static Arena from_array(u8 (&array)[N]) {
-    return {array, sizeof(array), 0};
+    return {array, sizeof(array), 0, sizeof(array), sizeof(array), false};
+  }
+
+  static Arena reserve(u64 capacity, u64 retain) {
+    void *data = mmap(nullptr, capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (data == MAP_FAILED) {
+      panic("unable to reserve %lu bytes of address space", capacity);
+    }
+    return {static_cast<u8 *>(data), capacity, 0, 0, align_offset(retain, COMMIT_SIZE), true};
+  }
+
+  // Frees everything allocated since pos was mark.
+  void reset_to(u64 mark) {
+    assert(mark <= pos);
+    pos = mark;
+    u64 keep = align_offset(max(pos, retain), COMMIT_SIZE);
+    if (reserved && committed > keep) {
+      u8 *p = data + keep;
+      u64 size = committed - keep;
+      if (madvise(p, size, MADV_DONTNEED) != 0 || mprotect(p, size, PROT_NONE) != 0) {
+        panic("unable to decommit arena memory");
+      }
+      committed = keep;
+    }
   }
 
   void reset() {
-    pos = 0;
+    reset_to(0);
+  }
+
+  // Makes the first new_pos bytes usable, or panics if they don't fit.
+  void grow(u64 new_pos) {
+    if (new_pos > capacity) {
+      panic("Exceeded arena capacity: %lu > %lu", new_pos, capacity);
+    }
+    if (new_pos > committed) {
+      assert(reserved);
+      u64 new_committed = min(align_offset(new_pos, COMMIT_SIZE), capacity);
+      if (mprotect(data + committed, new_committed - committed, PROT_READ | PROT_WRITE) != 0) {
+        panic("unable to commit %lu bytes of arena memory", new_committed);
+      }
+      committed = new_committed;
+    }
   }
 
   u8 *aligned_alloc(u64 size, u64 alignment) {
     u8 *ret = data + pos;
     ret = align_address(ret, alignment);
-    u32 new_pos = ret + size - data;
-
-    if (new_pos > capacity) {
-      panic("Exceeded arena capacity: %u > %u", new_pos, capacity);
-    }
+    u64 new_pos = ret + size - data;
+    grow(new_pos);
     pos = new_pos;
 
     return ret;
@@ -155,16 +297,16 @@ struct Arena {
   u8 *aligned_realloc(u8 *ptr, u64 size, u64 new_size, u64 alignment) {
     u8 *ret = &data[pos];
     if (ret == ptr + size) {
-      u32 new_pos = ptr + new_size - data;
-      if (new_pos > capacity) {
-        panic("Exceeded arena capacity: %u > %u", new_pos, capacity);
-      }
+      u64 new_pos = ptr + new_size - data;
+      grow(new_pos);
       pos = new_pos;
       return ptr;
     }
 
     ret = aligned_alloc(new_size, alignment);
-    memcpy(ret, ptr, size);
+    if (size) {
+      memcpy(ret, ptr, size);
+    }
     return ret;
   }
 
@@ -221,173 +363,5082 @@ struct Vector {
   }
 };
 
-static u8 g_tmp_memory[1024 * 1024];
-static u8 g_memory[1024 * 1024];
-static Arena g_tmp_arena = Arena::from_array(g_tmp_memory);
-static Arena g_arena = Arena::from_array(g_memory);
+static Arena g_tmp_arena = Arena::reserve(u64(16) << 30, 1024 * 1024);
+static Arena g_arena = Arena::reserve(u64(64) << 30, 0);
+static Arena g_frame_arena = Arena::reserve(u64(64) << 30, 64 * 1024 * 1024);
 
-struct Obj {
-  Vector<f32x3> vertices;
-  Vector<u16x3> faces;
+static u64 now_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return u64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+#ifndef SWR_TRACE
+#define SWR_TRACE 0
+#endif
+
+#if SWR_TRACE
+// Built with SWR_TRACE, TRACE_SCOPE(name) records when the enclosing scope
+// begins and ends on the calling thread, and write_trace dumps the records as
+// Chrome trace JSON, which Perfetto and chrome://tracing open. Each thread
+// records into a ring buffer of its own, so recording takes no locks and only
+// the most recent events of a long run are kept.
+
+struct TraceEvent {
+  u64 time_ns;
+  // The scope's name for a begin event, nullptr for an end event.
+  const char *name;
 };
 
-static Obj load_obj(const char *path) {
-  MemoryMappedFile file = mmap_read_only("head.obj");
-  const char *s = static_cast<const char *>(file.addr);
+struct TraceBuffer {
+  static constexpr u32 CAPACITY = 1 << 16;
 
-  Vector<f32x3> vertices;
-  Vector<u16x3> faces;
-  for (size_t i = 0; i < file.size;) {
-    f32 x, y, z;
-    u16 a, b, c, d;
-    switch (s[i]) {
-      case 'v':
-        switch (s[i + 1]) {
-          case ' ':
-            if (sscanf(&s[i], "v %f %f %f", &x, &y, &z) == 3) {
-              vertices.push({x, y, z}, g_tmp_arena);
-            }
-            break;
-        }
-        break;
-      case 'f':
-        if (sscanf(&s[i], "f %hu/%hu/%hu %hu/%hu/%hu %hu/%hu/%hu",
-                   &a, &d, &d, &b, &d, &d, &c, &d, &d) == 9) {
-          a--;
-          b--;
-          c--;
-          faces.push({a, b, c}, g_tmp_arena);
-        }
-        break;
+  TraceEvent events[CAPACITY];
+  // Events ever recorded. The last CAPACITY of them are in events.
+  u64 count;
+  const char *thread_name;
+};
+
+constexpr u32 MAX_TRACE_THREADS = 1024;
+
+static bool g_tracing = false;
+static u64 g_trace_start_ns = 0;
+static TraceBuffer *g_trace_buffers[MAX_TRACE_THREADS];
+static std::atomic<u32> g_trace_buffer_count = 0;
+// Buffers of threads that have exited, for the next threads to carry on in.
+static std::mutex g_free_trace_buffers_mutex;
+static TraceBuffer *g_free_trace_buffers[MAX_TRACE_THREADS];
+static u32 g_free_trace_buffer_count = 0;
+
+// Hands the thread's buffer on when the thread exits, so threads started
+// over and over, like one per draw, share a few buffers. A buffer keeps its
+// events when it's handed on, so its row in the trace shows each thread that
+// had it in turn, under the last one's name.
+struct TraceBufferOwner {
+  TraceBuffer *buffer = nullptr;
+  // Whether buffer is in g_trace_buffers, to be written out.
+  bool kept = false;
+
+  ~TraceBufferOwner() {
+    if (!buffer) {
+      return;
     }
-    for (; i < file.size && s[i] != '\n'; i++);
-    i++;
+    if (!kept) {
+      munmap(buffer, sizeof(TraceBuffer));
+      return;
+    }
+    std::lock_guard<std::mutex> lock(g_free_trace_buffers_mutex);
+    g_free_trace_buffers[g_free_trace_buffer_count++] = buffer;
   }
-  munmap(file.addr, file.size);
+};
 
-  vertices = vertices.clone_in(g_arena);
-  faces = faces.clone_in(g_arena);
-  g_tmp_arena.reset();
+static thread_local TraceBufferOwner t_trace_buffer;
+
+// Threads past the first MAX_TRACE_THREADS running at once still get a
+// buffer, but it's never written out.
+static TraceBuffer *trace_buffer() {
+  TraceBufferOwner &owner = t_trace_buffer;
+  if (owner.buffer) {
+    return owner.buffer;
+  }
+  {
+    std::lock_guard<std::mutex> lock(g_free_trace_buffers_mutex);
+    if (g_free_trace_buffer_count) {
+      owner.buffer = g_free_trace_buffers[--g_free_trace_buffer_count];
+      owner.kept = true;
+      return owner.buffer;
+    }
+  }
+  void *p = mmap(nullptr, sizeof(TraceBuffer), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    panic("unable to allocate a trace buffer");
+  }
+  owner.buffer = static_cast<TraceBuffer *>(p);
+  u32 i = g_trace_buffer_count.fetch_add(1, std::memory_order_relaxed);
+  if (i < MAX_TRACE_THREADS) {
+    g_trace_buffers[i] = owner.buffer;
+    owner.kept = true;
+  }
+  return owner.buffer;
+}
 
-  return {vertices, faces};
+static void trace_event(const char *name) {
+  if (g_tracing) {
+    TraceBuffer *b = trace_buffer();
+    b->events[b->count++ & (TraceBuffer::CAPACITY - 1)] = {now_ns(), name};
+  }
 }
 
-struct Pixel {
-  u8 b, g, r;
+static void trace_thread_name(const char *name) {
+  if (g_tracing) {
+    trace_buffer()->thread_name = name;
+  }
+}
+
+struct TraceScope {
+  explicit TraceScope(const char *name) {
+    trace_event(name);
+  }
+  ~TraceScope() {
+    trace_event(nullptr);
+  }
 };
 
-struct Image {
-  Pixel *pixels;
-  f32 *zbuffer;
-  u32 width;
-  u32 height;
+static void start_tracing() {
+  g_trace_start_ns = now_ns();
+  g_tracing = true;
+}
 
-  template<u32 N, u32 M>
-  static Image from_arrays(Pixel (&pixels)[N][M], f32 (&zbuffer)[N][M]) {
-    memset(pixels, 0, sizeof(pixels));
-    for (u32 i = 0; i < N; i++) {
-      for (u32 j = 0; j < M; j++) {
-        zbuffer[i][j] = std::numeric_limits<f32>::max();
+// Writes every thread's events to path. The threads must have finished
+// recording.
+static void write_trace(const char *path) {
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    panic("unable to open '%s'", path);
+  }
+  fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+  const char *separator = "\n";
+  u32 buffer_count = g_trace_buffer_count.load();
+  if (buffer_count > MAX_TRACE_THREADS) {
+    fprintf(stderr, "trace: only the first %u of %u threads are kept\n", MAX_TRACE_THREADS, buffer_count);
+    buffer_count = MAX_TRACE_THREADS;
+  }
+  for (u32 tid = 0; tid < buffer_count; tid++) {
+    const TraceBuffer &b = *g_trace_buffers[tid];
+    if (b.thread_name) {
+      fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, ", separator, tid);
+      fprintf(f, "\"args\": {\"name\": \"%s\"}}", b.thread_name);
+      separator = ",\n";
+    }
+    // Skip the ends of scopes whose beginnings the ring has overwritten.
+    u32 depth = 0;
+    u64 first = b.count > TraceBuffer::CAPACITY ? b.count - TraceBuffer::CAPACITY : 0;
+    for (u64 i = first; i < b.count; i++) {
+      const TraceEvent &e = b.events[i & (TraceBuffer::CAPACITY - 1)];
+      f64 ts = (i64(e.time_ns) - i64(g_trace_start_ns)) / 1e3;
+      if (e.name) {
+        depth++;
+        fprintf(f, "%s{\"name\": \"%s\", \"ph\": \"B\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f}", separator,
+                e.name, tid, ts);
+      } else if (depth) {
+        depth--;
+        fprintf(f, "%s{\"ph\": \"E\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f}", separator, tid, ts);
+      } else {
+        continue;
       }
+      separator = ",\n";
     }
-    return {&pixels[0][0], &zbuffer[0][0], M, N};
   }
-
-  Pixel &at(u32 x, u32 y) {
-    assert(x < width);
-    assert(y < height);
-    return pixels[y * width + x];
+  fprintf(f, "\n]}\n");
+  if (fclose(f) != 0) {
+    panic("unable to write '%s'", path);
   }
+}
 
-  const Pixel &at(u32 x, u32 y) const {
-    assert(x < width);
-    assert(y < height);
-    return pixels[y * width + x];
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_THREAD_NAME(name) trace_thread_name(name)
+#else
+#define TRACE_SCOPE(name)
+#define TRACE_THREAD_NAME(name)
+#endif
+
+// A fixed set of worker threads that execute indexed tasks. The calling thread
+// participates too, so a pool with thread_count == 0 runs everything inline.
+struct WorkerPool {
+  static constexpr u32 MAX_THREADS = 256;
+
+  using Task = void (*)(void *ctx, u32 index);
+
+  std::thread threads[MAX_THREADS];
+  u32 thread_count = 0;
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  u64 generation = 0;
+  u32 active = 0;
+  bool quit = false;
+
+  Task task = nullptr;
+  void *ctx = nullptr;
+  u32 count = 0;
+  std::atomic<u32> next = 0;
+
+  // Starts n threads. name is the threads' name in traces.
+  void start(u32 n, const char *name = "worker") {
+    thread_count = min(n, MAX_THREADS);
+    for (u32 i = 0; i < thread_count; i++) {
+      threads[i] = std::thread([this, name] {
+        TRACE_THREAD_NAME(name);
+        work();
+      });
+    }
   }
 
-  f32x3 screen_coord(const f32x3 &v) {
-    f32 x = (v.x + 1.0f) * f32(width / 2);
-    f32 y = (v.y + 1.0f) * f32(height / 2);
-    return {x, y, v.z};
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      quit = true;
+    }
+    wake.notify_all();
+    for (u32 i = 0; i < thread_count; i++) {
+      threads[i].join();
+    }
+    thread_count = 0;
   }
 
-  void draw_triangle(f32x3 a, f32x3 b, f32x3 c, Pixel color) {
-    a = screen_coord(a);
-    b = screen_coord(b);
-    c = screen_coord(c);
-    f32 min_x = min(min(a.x, b.x), c.x);
-    f32 max_x = max(max(a.x, b.x), c.x);
-    f32 min_y = min(min(a.y, b.y), c.y);
-    f32 max_y = max(max(a.y, b.y), c.y);
-    for (i32 x = min_x; x <= max_x; x++) {
-      if (x >= width) {
-        continue;
+  // Calls task(ctx, i) for every i in [0, n) and returns once all of them
+  // have finished. Indices are handed out dynamically, in increasing order.
+  void run(Task t, void *c, u32 n) {
+    if (thread_count == 0 || n <= 1) {
+      for (u32 i = 0; i < n; i++) {
+        t(c, i);
       }
-      for (i32 y = min_y; y <= max_y; y++) {
-        if (y >= height) {
-          continue;
-        }
-        f32x3 p = {c.x - a.x, b.x - a.x, a.x - f32(x)};
-        f32x3 q = {c.y - a.y, b.y - a.y, a.y - f32(y)};
-        f32x3 s = cross(p, q);
-        if (fabsf(s.z) < 1.0f) {
-          continue;
-        }
-        f32x3 t = {1.0f - (s.x + s.y) / s.z, s.y / s.z, s.x / s.z};
-        if (t.x < 0.0f || t.y < 0.0f || t.z < 0.0f) {
-          continue;
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      task = t;
+      ctx = c;
+      count = n;
+      next = 0;
+      active = thread_count;
+      generation++;
+    }
+    wake.notify_all();
+
+    drain();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return active == 0; });
+  }
+
+  template<typename F>
+  void parallel_for(u32 n, const F &f) {
+    run([](void *c, u32 i) { (*static_cast<const F *>(c))(i); }, (void *)&f, n);
+  }
+
+  void drain() {
+    for (u32 i; (i = next.fetch_add(1, std::memory_order_relaxed)) < count;) {
+      task(ctx, i);
+    }
+  }
+
+  void work() {
+    u64 seen = 0;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [&] { return quit || generation != seen; });
+        if (quit) {
+          return;
         }
-        at(x, y) = color;
+        seen = generation;
+      }
+
+      drain();
+
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--active == 0) {
+        done.notify_one();
       }
     }
   }
+};
 
-  void save_as_tga_file(const char *path) {
-    assert(width <= UINT16_MAX);
-    assert(height <= UINT16_MAX);
+// Index used in Obj::face_texcoords and Obj::face_normals for a face vertex
+// that doesn't have one.
+constexpr u16 NO_INDEX = UINT16_MAX;
 
-    constexpr u8 bytes_per_pixel = sizeof(pixels[0]);
-    constexpr u8 bits_per_pixel = bytes_per_pixel * 8;
+// A cone around the unit normals of a group of faces. Every normal n has
+// dot(n, axis) >= cos(a) for the cone's half-angle a, and cutoff is sin(a),
+// rounded up a little; it's more than 1 for cones too wide to cull.
+struct NormalCone {
+  f32x3 axis;
+  f32 cutoff;
+};
 
-    u8 header[18] = {};
-    header[2] = 2;
-    header[12] = width & 0xFF;
-    header[13] = (width & 0xFF00) >> 8;
-    header[14] = height & 0xFF;
-    header[15] = (height & 0xFF00) >> 8;
-    header[16] = bits_per_pixel;
+// Faces in a cluster: each run of this many in Obj::faces, and the rest at
+// the end. A multiple of 8, so shade_faces' vector loop covers whole clusters.
+constexpr u32 FACES_PER_CLUSTER = 64;
 
-    FILE *f = fopen(path, "w");
-    assert(f);
-    fwrite(header, sizeof(header), 1, f);
-    fwrite(pixels, bytes_per_pixel, width * height, f);
-    fclose(f);
-  }
+// Bounds of a cluster of faces that let it be culled as a whole: a sphere
+// around its vertices and a cone around its normals.
+struct FaceCluster {
+  f32x3 center;
+  f32 radius;
+  NormalCone cone;
 };
 
-int main(int argc, char **argv) {
-  static Pixel pixels[1000][1000];
-  static f32 zbuffer[1000][1000];
-  Image image = Image::from_arrays(pixels, zbuffer);
+struct Obj {
+  Vector<f32x3> vertices;
+  Vector<f32x2> texcoords;
+  Vector<f32x3> normals;
+  // Triangles, as indices into vertices, with polygons split into fans.
+  Vector<u16x3> faces;
+  // Indices into texcoords and normals for each triangle in faces. Each is
+  // empty if the file has no vt or vn lines.
+  Vector<u16x3> face_texcoords;
+  Vector<u16x3> face_normals;
+  // Bounds of each FACES_PER_CLUSTER faces, if they've been computed.
+  Vector<FaceCluster> clusters;
+};
+
+template<typename T>
+static Vector<T> alloc_vector(u32 count, Arena &arena) {
+  return {arena.alloc_array<T>(count), count, count};
+}
+
+// Gives each vertex of an obj without vn lines the average of the normals of
+// the faces around it, weighted by their area, so it can be smooth shaded.
+static void compute_vertex_normals(Obj &obj, Arena &arena) {
+  TRACE_SCOPE("compute_vertex_normals");
+  if (obj.normals.count || !obj.faces.count) {
+    return;
+  }
+  obj.normals = alloc_vector<f32x3>(obj.vertices.count, arena);
+  memset(obj.normals.data, 0, obj.normals.count * sizeof(f32x3));
+  for (u32 i = 0; i < obj.faces.count; i++) {
+    u16x3 f = obj.faces[i];
+    f32x3 a = obj.vertices[f.x];
+    // Twice the area of the face, pointing out of its front.
+    f32x3 n = cross(obj.vertices[f.y] - a, obj.vertices[f.z] - a);
+    for (u16 v : {f.x, f.y, f.z}) {
+      f32x3 &sum = obj.normals.data[v];
+      sum = {sum.x + n.x, sum.y + n.y, sum.z + n.z};
+    }
+  }
+  obj.face_normals = obj.faces;
+}
+
+static_assert(sizeof(f32x3) == 3 * sizeof(f32) && sizeof(f32x2) == 2 * sizeof(f32),
+              "ObjData's arrays are read as vectors");
 
-  Obj obj = load_obj("head.obj");
+static void *alloc_obj_data(void *, size_t size) {
+  return g_tmp_arena.aligned_alloc(size, 16);
+}
+
+static void run_obj_tasks(void *ctx, u32 count, void (*task)(void *arg, u32 i), void *arg) {
+  static_cast<WorkerPool *>(ctx)->parallel_for(count, [&](u32 i) {
+    TRACE_SCOPE("obj chunk");
+    task(arg, i);
+  });
+}
+
+// Parses an OBJ file with the shared parser, on pool and into g_tmp_arena,
+// which the caller resets once it's done with the data.
+static ObjData parse_obj_file(const char *path, WorkerPool &pool) {
+  TRACE_SCOPE("parse_obj_file");
+  ObjHooks hooks = {&pool, alloc_obj_data, nullptr, run_obj_tasks};
+  ObjData data;
+  if (obj_parse_file_with(path, &hooks, &data) != 0) {
+    panic("unable to load '%s'", path);
+  }
+  return data;
+}
+
+// Whether every index into the elements of data fits in an Obj, with
+// NO_INDEX left over.
+static bool fits_in_obj(const ObjData &data) {
+  return data.position_count <= NO_INDEX && data.texcoord_count <= NO_INDEX && data.normal_count <= NO_INDEX;
+}
+
+// Copies a corner index of a triangle, which fits_in_obj checked fits in 16
+// bits.
+static u16 narrow_obj_index(u32 i) {
+  return i == OBJ_NO_INDEX ? NO_INDEX : u16(i);
+}
+
+static Vector<u16x3> copy_obj_triangles(const u32 *indices, u32 count, Arena &arena) {
+  Vector<u16x3> triangles = alloc_vector<u16x3>(indices ? count : 0, arena);
+  for (u32 i = 0; i < triangles.count; i++) {
+    const u32 *t = &indices[i * 3];
+    triangles.data[i] = {narrow_obj_index(t[0]), narrow_obj_index(t[1]), narrow_obj_index(t[2])};
+  }
+  return triangles;
+}
+
+// Copies parsed OBJ data into an Obj in arena.
+static Obj copy_obj(const ObjData &data, Arena &arena) {
+  Obj obj;
+  obj.vertices = alloc_vector<f32x3>(data.position_count, arena);
+  obj.texcoords = alloc_vector<f32x2>(data.texcoord_count, arena);
+  obj.normals = alloc_vector<f32x3>(data.normal_count, arena);
+  memcpy(obj.vertices.data, data.positions, data.position_count * sizeof(f32x3));
+  memcpy(obj.texcoords.data, data.texcoords, data.texcoord_count * sizeof(f32x2));
+  memcpy(obj.normals.data, data.normals, data.normal_count * sizeof(f32x3));
+  obj.faces = copy_obj_triangles(data.faces, data.face_count, arena);
+  obj.face_texcoords = copy_obj_triangles(data.face_texcoords, data.face_count, arena);
+  obj.face_normals = copy_obj_triangles(data.face_normals, data.face_count, arena);
+  return obj;
+}
+
+// Bounds the normals of count faces, where normal(i) is the unnormalized
+// normal of face i: the axis is the direction of the sum of the unit normals,
+// and the half-angle is the widest angle from it. Faces with no area don't
+// count.
+template<typename F>
+static NormalCone bound_normals(u32 count, const F &normal) {
+  // Covers rounding in the normals and in the test, so a cone never culls a
+  // face that would have been drawn.
+  constexpr f32 CONE_MARGIN = 1e-3f;
+  NormalCone cone = {{0.0f, 0.0f, 0.0f}, 2.0f};
+  f32x3 sum = {0.0f, 0.0f, 0.0f};
+  for (u32 i = 0; i < count; i++) {
+    f32x3 n = normal(i);
+    f32 length_squared = dot(n, n);
+    if (length_squared > 0.0f) {
+      n = n * (1.0f / sqrtf(length_squared));
+      sum = {sum.x + n.x, sum.y + n.y, sum.z + n.z};
+    }
+  }
+  f32 sum_squared = dot(sum, sum);
+  if (sum_squared == 0.0f) {
+    return cone;
+  }
+  cone.axis = sum * (1.0f / sqrtf(sum_squared));
+  f32 min_cos = 1.0f;
+  for (u32 i = 0; i < count; i++) {
+    f32x3 n = normal(i);
+    f32 length_squared = dot(n, n);
+    if (length_squared > 0.0f) {
+      min_cos = min(min_cos, dot(n, cone.axis) / sqrtf(length_squared));
+    }
+  }
+  if (min_cos > CONE_MARGIN) {
+    cone.cutoff = sqrtf(max(1.0f - min_cos * min_cos, 0.0f)) + CONE_MARGIN;
+  }
+  return cone;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  u64 x = *static_cast<const u64 *>(a);
+  u64 y = *static_cast<const u64 *>(b);
+  return (x > y) - (x < y);
+}
+
+// Spreads the low 10 bits of x out to every third bit.
+static u32 spread_bits(u32 x) {
+  x &= 0x3FF;
+  x = (x | x << 16) & 0x030000FF;
+  x = (x | x << 8) & 0x0300F00F;
+  x = (x | x << 4) & 0x030C30C3;
+  x = (x | x << 2) & 0x09249249;
+  return x;
+}
+
+// Reorders the faces of obj so that each run of FACES_PER_CLUSTER of them is
+// small and faces about the same way, which is what lets clusters be culled.
+// Faces are sorted along a Morton curve through an 8 by 8 octahedral map of
+// their normals' directions, and within each cell of it, along a Morton curve
+// through their centroids.
+static void sort_faces_for_clusters(Obj &obj) {
+  TRACE_SCOPE("sort_faces_for_clusters");
+  u32 count = obj.faces.count;
+  if (count <= FACES_PER_CLUSTER) {
+    return;
+  }
+  u64 mark = g_tmp_arena.pos;
+  constexpr f32 far = std::numeric_limits<f32>::max();
+  f32x3 lo = {far, far, far};
+  f32x3 hi = {-far, -far, -far};
+  for (u32 i = 0; i < obj.vertices.count; i++) {
+    f32x3 p = obj.vertices[i];
+    lo = {min(lo.x, p.x), min(lo.y, p.y), min(lo.z, p.z)};
+    hi = {max(hi.x, p.x), max(hi.y, p.y), max(hi.z, p.z)};
+  }
+  // Sums of a face's three vertices, three times its centroid, are scaled to
+  // 8 bits.
+  f32x3 scale = {
+    hi.x > lo.x ? 255.0f / (3.0f * (hi.x - lo.x)) : 0.0f,
+    hi.y > lo.y ? 255.0f / (3.0f * (hi.y - lo.y)) : 0.0f,
+    hi.z > lo.z ? 255.0f / (3.0f * (hi.z - lo.z)) : 0.0f,
+  };
 
-  constexpr f32x3 spotlight = {0.0f, 0.0f, -1.0f};
-  for (int i = 0; i < obj.faces.count; i++) {
+  // The sort key in the high bits, and the face in the low 32, which keeps
+  // ties in file order.
+  u64 *keys = g_tmp_arena.alloc_array<u64>(count);
+  for (u32 i = 0; i < count; i++) {
     u16x3 f = obj.faces[i];
     f32x3 a = obj.vertices[f.x];
     f32x3 b = obj.vertices[f.y];
     f32x3 c = obj.vertices[f.z];
-    f32x3 ab = b - a;
-    f32x3 ac = c - a;
-    f32x3 n = cross(ac, ab).normalize();
-    f32 I = dot(n, spotlight);
-    if (I <= 0.0f) {
-      continue;
+    // Project the normal onto the octahedron |x| + |y| + |z| = 1, and unfold
+    // its lower half over the upper one's corners.
+    f32x3 n = cross(b - a, c - a);
+    f32 l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+    f32 u = 0.0f, v = 0.0f;
+    if (l1 > 0.0f) {
+      u = n.x / l1;
+      v = n.y / l1;
+      if (n.z < 0.0f) {
+        f32 fold_u = (1.0f - fabsf(v)) * (u < 0.0f ? -1.0f : 1.0f);
+        f32 fold_v = (1.0f - fabsf(u)) * (v < 0.0f ? -1.0f : 1.0f);
+        u = fold_u;
+        v = fold_v;
+      }
     }
-    u8 p = I * 255.0f;
-    image.draw_triangle(a, b, c, {p, p, p});
+    u32 cell_u = min(u32((u + 1.0f) * 4.0f), 7u);
+    u32 cell_v = min(u32((v + 1.0f) * 4.0f), 7u);
+    u32 direction = spread_bits(cell_u) | spread_bits(cell_v) << 1;
+    u32 x = (a.x + b.x + c.x - 3.0f * lo.x) * scale.x;
+    u32 y = (a.y + b.y + c.y - 3.0f * lo.y) * scale.y;
+    u32 z = (a.z + b.z + c.z - 3.0f * lo.z) * scale.z;
+    u32 position = spread_bits(x) | spread_bits(y) << 1 | spread_bits(z) << 2;
+    keys[i] = u64(direction << 24 | position) << 32 | i;
   }
+  qsort(keys, count, sizeof(u64), compare_u64);
 
-  image.save_as_tga_file("out.tga");
+  auto permute = [&](Vector<u16x3> &v) {
+    // face_normals is faces when compute_vertex_normals made the normals.
+    if (!v.count || (&v != &obj.faces && v.data == obj.faces.data)) {
+      return;
+    }
+    u16x3 *sorted = g_tmp_arena.alloc_array<u16x3>(count);
+    for (u32 i = 0; i < count; i++) {
+      sorted[i] = v.data[u32(keys[i])];
+    }
+    memcpy(v.data, sorted, count * sizeof(u16x3));
+  };
+  permute(obj.faces);
+  permute(obj.face_texcoords);
+  permute(obj.face_normals);
+  g_tmp_arena.reset_to(mark);
+}
+
+// Computes the bounds of each cluster of obj's faces, which should have been
+// sorted for it first.
+static Vector<FaceCluster> compute_face_clusters(const Obj &obj, Arena &arena) {
+  TRACE_SCOPE("compute_face_clusters");
+  u32 count = (obj.faces.count + FACES_PER_CLUSTER - 1) / FACES_PER_CLUSTER;
+  Vector<FaceCluster> clusters = alloc_vector<FaceCluster>(count, arena);
+  constexpr f32 far = std::numeric_limits<f32>::max();
+  for (u32 c = 0; c < count; c++) {
+    u32 begin = c * FACES_PER_CLUSTER;
+    u32 n = min(obj.faces.count - begin, FACES_PER_CLUSTER);
+    const u16x3 *faces = &obj.faces.data[begin];
+    f32x3 lo = {far, far, far};
+    f32x3 hi = {-far, -far, -far};
+    for (u32 i = 0; i < n; i++) {
+      for (u16 v : {faces[i].x, faces[i].y, faces[i].z}) {
+        f32x3 p = obj.vertices[v];
+        lo = {min(lo.x, p.x), min(lo.y, p.y), min(lo.z, p.z)};
+        hi = {max(hi.x, p.x), max(hi.y, p.y), max(hi.z, p.z)};
+      }
+    }
+    FaceCluster &cluster = clusters.data[c];
+    cluster.center = {(lo.x + hi.x) * 0.5f, (lo.y + hi.y) * 0.5f, (lo.z + hi.z) * 0.5f};
+    f32 radius_squared = 0.0f;
+    for (u32 i = 0; i < n; i++) {
+      for (u16 v : {faces[i].x, faces[i].y, faces[i].z}) {
+        f32x3 d = obj.vertices[v] - cluster.center;
+        radius_squared = max(radius_squared, dot(d, d));
+      }
+    }
+    cluster.radius = sqrtf(radius_squared);
+    cluster.cone = bound_normals(n, [&](u32 i) {
+      f32x3 a = obj.vertices[faces[i].x];
+      return cross(obj.vertices[faces[i].y] - a, obj.vertices[faces[i].z] - a);
+    });
+  }
+  return clusters;
+}
+
+// Loads an OBJ file into arena, in file order. Its indices must fit in 16
+// bits; bigger meshes are streamed as meshlets instead.
+static Obj load_obj(const char *path, WorkerPool &pool, Arena &arena) {
+  TRACE_SCOPE("load_obj");
+  ObjData data = parse_obj_file(path, pool);
+  if (!fits_in_obj(data)) {
+    panic("'%s' has %u vertices, too many for 16-bit indices", path, data.position_count);
+  }
+  Obj obj = copy_obj(data, arena);
+  g_tmp_arena.reset();
+
+  compute_vertex_normals(obj, arena);
+  sort_faces_for_clusters(obj);
+  obj.clusters = compute_face_clusters(obj, arena);
+  return obj;
+}
+
+// Most levels of detail a mesh is simplified into, counting the mesh itself.
+constexpr u32 MAX_LODS = 12;
+// Simplification stops before a level would have fewer faces than this.
+constexpr u32 MIN_LOD_FACES = 256;
+
+// A mesh and a chain of simpler versions of it, each with about half the
+// faces of the one before. Every level shares the texcoords of the first, but
+// has its own normals.
+struct MeshLods {
+  Obj levels[MAX_LODS];
+  // How far the surface of each level is from the mesh's, in model units:
+  // the largest RMS distance to the original planes of any vertex that was
+  // collapsed to make it.
+  f32 errors[MAX_LODS];
+  u32 count;
+  // The mesh cache the levels point into, if they came from one.
+  MemoryMappedFile cache;
+};
+
+// A sum of weighted squared distances to planes, as the symmetric matrix Q
+// with error(v) = [v 1] Q [v 1]^T, stored as its upper triangle, and the sum
+// of the weights.
+struct Quadric {
+  f64 xx, xy, xz, xw, yy, yz, yw, zz, zw, ww;
+  f64 weight;
+
+  // The squared distance to the plane through p with unit normal n, times
+  // weight.
+  static Quadric plane(f32x3 n, f32x3 p, f64 weight) {
+    f64 a = n.x, b = n.y, c = n.z;
+    f64 d = -(a * p.x + b * p.y + c * p.z);
+    return {
+      a * a * weight, a * b * weight, a * c * weight, a * d * weight,
+      b * b * weight, b * c * weight, b * d * weight,
+      c * c * weight, c * d * weight,
+      d * d * weight,
+      weight,
+    };
+  }
+
+  void add(const Quadric &q) {
+    f64 *a = &xx;
+    const f64 *b = &q.xx;
+    for (u32 i = 0; i < 11; i++) {
+      a[i] += b[i];
+    }
+  }
+
+  f64 error(f32x3 p) const {
+    f64 x = p.x, y = p.y, z = p.z;
+    return xx * x * x + yy * y * y + zz * z * z + 2.0 * (xy * x * y + xz * x * z + yz * y * z) +
+           2.0 * (xw * x + yw * y + zw * z) + ww;
+  }
+
+  // Finds the point with the least error, or returns false if there isn't
+  // just one, as on a flat or straight stretch of surface.
+  bool minimum(f32x3 &p) const {
+    f64 c0 = yy * zz - yz * yz;
+    f64 c1 = xz * yz - xy * zz;
+    f64 c2 = xy * yz - xz * yy;
+    f64 det = xx * c0 + xy * c1 + xz * c2;
+    f64 scale = xx + yy + zz;
+    if (!(fabs(det) > 1e-9 * scale * scale * scale)) {
+      return false;
+    }
+    // Solve the 3x3 system by Cramer's rule, with the cofactors of the
+    // symmetric matrix.
+    f64 inv = -1.0 / det;
+    f64 x = (c0 * xw + c1 * yw + c2 * zw) * inv;
+    f64 y = (c1 * xw + (xx * zz - xz * xz) * yw + (xy * xz - xx * yz) * zw) * inv;
+    f64 z = (c2 * xw + (xy * xz - xx * yz) * yw + (xx * yy - xy * xy) * zw) * inv;
+    p = {f32(x), f32(y), f32(z)};
+    return true;
+  }
+};
+
+// An edge that could be collapsed, and the cost of doing it. It's stale if
+// either vertex has changed since the cost was worked out.
+struct EdgeCollapse {
+  f64 cost;
+  u16 a, b;
+  u32 version_a, version_b;
+};
+
+// A min-heap of edge collapses by cost.
+struct CollapseHeap {
+  Vector<EdgeCollapse> items;
+
+  void push(const EdgeCollapse &e, Arena &arena) {
+    items.push(e, arena);
+    EdgeCollapse *h = items.data;
+    for (u32 i = items.count - 1; i > 0;) {
+      u32 parent = (i - 1) / 2;
+      if (h[parent].cost <= h[i].cost) {
+        break;
+      }
+      EdgeCollapse t = h[i];
+      h[i] = h[parent];
+      h[parent] = t;
+      i = parent;
+    }
+  }
+
+  EdgeCollapse pop() {
+    EdgeCollapse *h = items.data;
+    EdgeCollapse top = h[0];
+    h[0] = h[--items.count];
+    for (u32 i = 0;;) {
+      u32 least = i;
+      for (u32 child = 2 * i + 1; child <= 2 * i + 2 && child < items.count; child++) {
+        if (h[child].cost < h[least].cost) {
+          least = child;
+        }
+      }
+      if (least == i) {
+        break;
+      }
+      EdgeCollapse t = h[i];
+      h[i] = h[least];
+      h[least] = t;
+      i = least;
+    }
+    return top;
+  }
+};
+
+// Simplifies a mesh by collapsing its edges in order of quadric error
+// (Garland and Heckbert, "Surface Simplification Using Quadric Error
+// Metrics", 1997). Faces keep their texcoord indices through collapses, so
+// only positions are simplified.
+struct Simplifier {
+  // Working copies of the mesh, where collapses move vertices and rewrite
+  // faces.
+  f32x3 *positions;
+  u16x3 *faces;
+  bool *face_alive;
+  Quadric *quadrics;
+  // Bumped whenever a vertex moves or is collapsed away, to spot stale heap
+  // entries.
+  u32 *versions;
+  bool *vertex_alive;
+  // The faces that use each vertex. Dead faces are pruned lazily.
+  Vector<u32> *vertex_faces;
+  // Per-vertex stamps, for marking neighbours.
+  u32 *marks;
+  u32 mark;
+  u32 vertex_count;
+  u32 face_count;
+  u32 live_faces;
+  CollapseHeap heap;
+
+  static Simplifier start(const Obj &obj, Arena &arena) {
+    // Edges that belong to only one face get a plane at right angles to the
+    // face, this much heavier than a face, so the outline holds its shape.
+    constexpr f64 BORDER_WEIGHT = 16.0;
+
+    Simplifier s = {};
+    s.vertex_count = obj.vertices.count;
+    s.face_count = obj.faces.count;
+    s.live_faces = s.face_count;
+    s.positions = arena.alloc_array<f32x3>(s.vertex_count);
+    memcpy(s.positions, obj.vertices.data, s.vertex_count * sizeof(f32x3));
+    s.faces = arena.alloc_array<u16x3>(s.face_count);
+    memcpy(s.faces, obj.faces.data, s.face_count * sizeof(u16x3));
+    s.face_alive = arena.alloc_array<bool>(s.face_count);
+    memset(s.face_alive, 1, s.face_count);
+    s.quadrics = arena.alloc_array<Quadric>(s.vertex_count);
+    memset(s.quadrics, 0, s.vertex_count * sizeof(Quadric));
+    s.versions = arena.alloc_array<u32>(s.vertex_count);
+    memset(s.versions, 0, s.vertex_count * sizeof(u32));
+    s.vertex_alive = arena.alloc_array<bool>(s.vertex_count);
+    memset(s.vertex_alive, 1, s.vertex_count);
+    s.vertex_faces = arena.alloc_array<Vector<u32>>(s.vertex_count);
+    for (u32 v = 0; v < s.vertex_count; v++) {
+      s.vertex_faces[v] = {};
+    }
+    s.marks = arena.alloc_array<u32>(s.vertex_count);
+    memset(s.marks, 0, s.vertex_count * sizeof(u32));
+
+    // Every edge of every face as (low << 16 | high), sorted so the copies of
+    // an edge shared by two faces are next to each other.
+    u64 *edges = arena.alloc_array<u64>(3 * s.face_count);
+    for (u32 f = 0; f < s.face_count; f++) {
+      const u16 *v = &s.faces[f].x;
+      for (u32 i = 0; i < 3; i++) {
+        u16 a = v[i];
+        u16 b = v[(i + 1) % 3];
+        edges[3 * f + i] = a < b ? u64(a) << 16 | b : u64(b) << 16 | a;
+        s.vertex_faces[a].push(f, arena);
+      }
+    }
+    qsort(edges, 3 * s.face_count, sizeof(u64), compare_u64);
+    u32 edge_count = 3 * s.face_count;
+
+    for (u32 f = 0; f < s.face_count; f++) {
+      const u16 *v = &s.faces[f].x;
+      f32x3 p0 = s.positions[v[0]];
+      f32x3 n = cross(s.positions[v[1]] - p0, s.positions[v[2]] - p0);
+      f32 length = n.magnitude();
+      if (!(length > 0.0f)) {
+        continue;
+      }
+      n = n * (1.0f / length);
+      // Weighted by area, so the error doesn't depend on how finely a
+      // surface happens to be tessellated.
+      Quadric q = Quadric::plane(n, p0, 0.5 * length);
+      for (u32 i = 0; i < 3; i++) {
+        s.quadrics[v[i]].add(q);
+      }
+      for (u32 i = 0; i < 3; i++) {
+        u16 a = v[i];
+        u16 b = v[(i + 1) % 3];
+        u64 key = a < b ? u64(a) << 16 | b : u64(b) << 16 | a;
+        u64 *e = static_cast<u64 *>(bsearch(&key, edges, edge_count, sizeof(u64), compare_u64));
+        bool shared = (e > edges && e[-1] == key) || (e + 1 < edges + edge_count && e[1] == key);
+        if (!shared) {
+          f32x3 d = s.positions[b] - s.positions[a];
+          f32x3 m = cross(d, n).normalize();
+          Quadric border = Quadric::plane(m, s.positions[a], BORDER_WEIGHT * dot(d, d));
+          s.quadrics[a].add(border);
+          s.quadrics[b].add(border);
+        }
+      }
+    }
+
+    for (u32 i = 0; i < edge_count; i++) {
+      if (i == 0 || edges[i] != edges[i - 1]) {
+        s.push_collapse(u16(edges[i] >> 16), u16(edges[i]), arena);
+      }
+    }
+    return s;
+  }
+
+  // Where the vertices of edge ab should go if it's collapsed, and the error
+  // there.
+  f64 collapse_target(u16 a, u16 b, f32x3 &p) const {
+    Quadric q = quadrics[a];
+    q.add(quadrics[b]);
+    f32x3 pa = positions[a];
+    f32x3 pb = positions[b];
+    f32x3 mid = {(pa.x + pb.x) * 0.5f, (pa.y + pb.y) * 0.5f, (pa.z + pb.z) * 0.5f};
+    // The minimum of a badly conditioned quadric can be far off, so it's
+    // only used when it stays near the edge.
+    f32x3 d = pb - pa;
+    if (q.minimum(p)) {
+      f32x3 off = p - mid;
+      if (dot(off, off) <= dot(d, d)) {
+        return q.error(p);
+      }
+    }
+    p = mid;
+    f64 cost = q.error(mid);
+    for (f32x3 candidate : {pa, pb}) {
+      f64 c = q.error(candidate);
+      if (c < cost) {
+        cost = c;
+        p = candidate;
+      }
+    }
+    return cost;
+  }
+
+  void push_collapse(u16 a, u16 b, Arena &arena) {
+    f32x3 p;
+    f64 cost = collapse_target(a, b, p);
+    heap.push({cost, a, b, versions[a], versions[b]}, arena);
+  }
+
+  // Whether moving v to p, with the faces it shares with other gone, would
+  // fold over or squash any of its other faces.
+  bool collapse_folds(u16 v, u16 other, f32x3 p) const {
+    // Smallest cosine of the angle a face may turn through.
+    constexpr f32 MIN_COSINE = 0.2f;
+    const Vector<u32> &fs = vertex_faces[v];
+    for (u32 i = 0; i < fs.count; i++) {
+      u32 f = fs.data[i];
+      const u16 *c = &faces[f].x;
+      if (!face_alive[f] || c[0] == other || c[1] == other || c[2] == other) {
+        continue;
+      }
+      u32 k = c[0] == v ? 0 : c[1] == v ? 1 : 2;
+      f32x3 p1 = positions[c[(k + 1) % 3]];
+      f32x3 p2 = positions[c[(k + 2) % 3]];
+      f32x3 before = cross(p1 - positions[v], p2 - positions[v]);
+      f32x3 after = cross(p1 - p, p2 - p);
+      f32 d = dot(before, after);
+      if (!(d > MIN_COSINE * before.magnitude() * after.magnitude())) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Whether collapsing ab keeps the surface a manifold: the only vertices
+  // next to both a and b must be the far corners of the faces they share.
+  bool collapse_keeps_manifold(u16 a, u16 b) {
+    u32 around_a = mark += 2;
+    u32 common = 0;
+    u32 shared_faces = 0;
+    for (u32 i = 0; i < vertex_faces[a].count; i++) {
+      u32 f = vertex_faces[a].data[i];
+      if (face_alive[f]) {
+        const u16 *c = &faces[f].x;
+        for (u32 k = 0; k < 3; k++) {
+          marks[c[k]] = around_a;
+        }
+        shared_faces += c[0] == b || c[1] == b || c[2] == b;
+      }
+    }
+    for (u32 i = 0; i < vertex_faces[b].count; i++) {
+      u32 f = vertex_faces[b].data[i];
+      if (face_alive[f]) {
+        const u16 *c = &faces[f].x;
+        for (u32 k = 0; k < 3; k++) {
+          if (c[k] != a && c[k] != b && marks[c[k]] == around_a) {
+            marks[c[k]] = around_a + 1;
+            common++;
+          }
+        }
+      }
+    }
+    return common == shared_faces;
+  }
+
+  // Collapses edge ab into b at p, and queues the new edges around b.
+  void collapse(u16 a, u16 b, f32x3 p, Arena &arena) {
+    positions[b] = p;
+    quadrics[b].add(quadrics[a]);
+    vertex_alive[a] = false;
+    versions[a]++;
+    versions[b]++;
+
+    Vector<u32> &fs = vertex_faces[b];
+    for (u32 i = 0; i < vertex_faces[a].count; i++) {
+      u32 f = vertex_faces[a].data[i];
+      if (!face_alive[f]) {
+        continue;
+      }
+      u16 *c = &faces[f].x;
+      if (c[0] == b || c[1] == b || c[2] == b) {
+        face_alive[f] = false;
+        live_faces--;
+        continue;
+      }
+      for (u32 k = 0; k < 3; k++) {
+        c[k] = c[k] == a ? b : c[k];
+      }
+      fs.push(f, arena);
+    }
+
+    u32 n = 0;
+    u32 neighbours = mark += 2;
+    for (u32 i = 0; i < fs.count; i++) {
+      u32 f = fs.data[i];
+      if (!face_alive[f]) {
+        continue;
+      }
+      fs.data[n++] = f;
+      const u16 *c = &faces[f].x;
+      for (u32 k = 0; k < 3; k++) {
+        if (c[k] != b && marks[c[k]] != neighbours) {
+          marks[c[k]] = neighbours;
+          push_collapse(b, c[k], arena);
+        }
+      }
+    }
+    fs.count = n;
+  }
+
+  // Copies the faces that are left, and the vertices they use, into a new Obj
+  // that shares obj's texcoords. The normals of obj belong to vertices that
+  // may have moved or gone, so the new Obj gets its own from its faces.
+  Obj snapshot(const Obj &obj, Arena &arena) const {
+    u16 *remap = arena.alloc_array<u16>(vertex_count);
+    u32 used = 0;
+    for (u32 v = 0; v < vertex_count; v++) {
+      remap[v] = NO_INDEX;
+    }
+    for (u32 f = 0; f < face_count; f++) {
+      if (face_alive[f]) {
+        const u16 *c = &faces[f].x;
+        for (u32 k = 0; k < 3; k++) {
+          if (remap[c[k]] == NO_INDEX) {
+            remap[c[k]] = used++;
+          }
+        }
+      }
+    }
+
+    Obj lod;
+    lod.texcoords = obj.texcoords;
+    lod.vertices = alloc_vector<f32x3>(used, arena);
+    lod.faces = alloc_vector<u16x3>(live_faces, arena);
+    lod.face_texcoords = alloc_vector<u16x3>(obj.face_texcoords.count ? live_faces : 0, arena);
+    for (u32 v = 0; v < vertex_count; v++) {
+      if (remap[v] != NO_INDEX) {
+        lod.vertices.data[remap[v]] = positions[v];
+      }
+    }
+    u32 n = 0;
+    for (u32 f = 0; f < face_count; f++) {
+      if (face_alive[f]) {
+        u16x3 c = faces[f];
+        lod.faces.data[n] = {remap[c.x], remap[c.y], remap[c.z]};
+        if (lod.face_texcoords.count) {
+          lod.face_texcoords.data[n] = obj.face_texcoords.data[f];
+        }
+        n++;
+      }
+    }
+    compute_vertex_normals(lod, arena);
+    lod.clusters = compute_face_clusters(lod, arena);
+    return lod;
+  }
+};
+
+// Simplifies obj into a chain of levels of detail in arena, each with about
+// half the faces of the one before, by collapsing the cheapest edges first.
+// Level 0 is obj itself.
+static MeshLods build_lods(const Obj &obj, Arena &arena) {
+  TRACE_SCOPE("build_lods");
+  MeshLods lods = {};
+  lods.levels[0] = obj;
+  lods.count = 1;
+  u32 target = obj.faces.count / 2;
+  if (target < MIN_LOD_FACES) {
+    return lods;
+  }
+
+  Simplifier s = Simplifier::start(obj, g_tmp_arena);
+  f64 error = 0.0;
+  while (s.heap.items.count) {
+    EdgeCollapse e = s.heap.pop();
+    if (!s.vertex_alive[e.a] || !s.vertex_alive[e.b] || s.versions[e.a] != e.version_a ||
+        s.versions[e.b] != e.version_b) {
+      continue;
+    }
+    f32x3 p;
+    s.collapse_target(e.a, e.b, p);
+    if (!s.collapse_keeps_manifold(e.a, e.b) || s.collapse_folds(e.a, e.b, p) ||
+        s.collapse_folds(e.b, e.a, p)) {
+      continue;
+    }
+    s.collapse(e.a, e.b, p, g_tmp_arena);
+    f64 weight = s.quadrics[e.b].weight;
+    if (weight > 0.0) {
+      error = max(error, sqrt(max(e.cost, 0.0) / weight));
+    }
+
+    if (s.live_faces <= target) {
+      lods.levels[lods.count] = s.snapshot(obj, arena);
+      lods.errors[lods.count] = error;
+      lods.count++;
+      target /= 2;
+      if (lods.count == MAX_LODS || target < MIN_LOD_FACES) {
+        break;
+      }
+    }
+  }
+  g_tmp_arena.reset();
+  return lods;
+}
+
+// A binary copy of an Obj and its levels of detail, stored next to the OBJ
+// file it came from, that is used in place of parsing and simplifying the OBJ
+// again. The header is followed by the arrays of Obj in order, then a
+// MeshCacheLod for each level after the first, then the vertices, normals,
+// faces, face_texcoords, face_normals and clusters of each of those levels, each array
+// starting on a 64-byte boundary. The cache is only meant for the machine that wrote
+// it, so everything is in native byte order.
+struct MeshCacheHeader {
+  static constexpr char MAGIC[8] = {'S', 'W', 'R', 'M', 'E', 'S', 'H', '\0'};
+  static constexpr u32 VERSION = 4;
+  static constexpr u32 ALIGNMENT = 64;
+
+  char magic[8];
+  u32 version;
+  // Number of levels of detail, counting the mesh itself.
+  u32 lods;
+  // Size and modification time of the OBJ file the cache was built from.
+  u64 source_size;
+  i64 source_mtime_ns;
+  u32 vertices;
+  u32 texcoords;
+  u32 normals;
+  u32 faces;
+  u32 face_texcoords;
+  u32 face_normals;
+  u32 clusters;
+};
+
+struct MeshCacheLod {
+  u32 vertices;
+  u32 normals;
+  u32 faces;
+  u32 face_texcoords;
+  u32 face_normals;
+  u32 clusters;
+  f32 error;
+};
+
+static i64 mtime_ns(const struct stat &st) {
+#if defined(__APPLE__)
+  return i64(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+  return i64(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+}
+
+// Returns a view of the array at *offset in a cache, and advances *offset
+// past it.
+template<typename T>
+static Vector<T> mesh_cache_array(u8 *base, u64 &offset, u32 count) {
+  offset = align_offset(offset, MeshCacheHeader::ALIGNMENT);
+  T *data = reinterpret_cast<T *>(base + offset);
+  offset += u64(count) * sizeof(T);
+  return {data, count, count};
+}
+
+// Maps the cache at cache_path into memory and returns views of its arrays,
+// or returns false if it is missing, malformed or older than the source.
+static bool map_mesh_cache(const char *cache_path, const struct stat &source, MeshLods &lods) {
+  int fd = open(cache_path, O_RDONLY);
+  if (fd < 0) {
+    errno = 0;
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(MeshCacheHeader)) {
+    close(fd);
+    errno = 0;
+    return false;
+  }
+  size_t size = st.st_size;
+  void *addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    errno = 0;
+    return false;
+  }
+
+  const MeshCacheHeader &h = *static_cast<const MeshCacheHeader *>(addr);
+  bool valid = memcmp(h.magic, MeshCacheHeader::MAGIC, sizeof(h.magic)) == 0 &&
+               h.version == MeshCacheHeader::VERSION &&
+               h.source_size == u64(source.st_size) &&
+               h.source_mtime_ns == mtime_ns(source) &&
+               h.lods >= 1 && h.lods <= MAX_LODS;
+
+  u8 *base = static_cast<u8 *>(addr);
+  u64 offset = sizeof(MeshCacheHeader);
+  Obj o;
+  o.vertices = mesh_cache_array<f32x3>(base, offset, h.vertices);
+  o.texcoords = mesh_cache_array<f32x2>(base, offset, h.texcoords);
+  o.normals = mesh_cache_array<f32x3>(base, offset, h.normals);
+  o.faces = mesh_cache_array<u16x3>(base, offset, h.faces);
+  o.face_texcoords = mesh_cache_array<u16x3>(base, offset, h.face_texcoords);
+  o.face_normals = mesh_cache_array<u16x3>(base, offset, h.face_normals);
+  o.clusters = mesh_cache_array<FaceCluster>(base, offset, h.clusters);
+
+  MeshLods l = {};
+  l.levels[0] = o;
+  l.count = valid ? h.lods : 1;
+  Vector<MeshCacheLod> records = mesh_cache_array<MeshCacheLod>(base, offset, l.count - 1);
+  for (u32 i = 1; i < l.count && offset <= size; i++) {
+    const MeshCacheLod &r = records.data[i - 1];
+    Obj &level = l.levels[i];
+    level.texcoords = o.texcoords;
+    level.vertices = mesh_cache_array<f32x3>(base, offset, r.vertices);
+    level.normals = mesh_cache_array<f32x3>(base, offset, r.normals);
+    level.faces = mesh_cache_array<u16x3>(base, offset, r.faces);
+    level.face_texcoords = mesh_cache_array<u16x3>(base, offset, r.face_texcoords);
+    level.face_normals = mesh_cache_array<u16x3>(base, offset, r.face_normals);
+    level.clusters = mesh_cache_array<FaceCluster>(base, offset, r.clusters);
+    l.errors[i] = r.error;
+  }
+  if (!valid || offset > size) {
+    munmap(addr, size);
+    return false;
+  }
+
+  l.cache = {addr, size};
+  lods = l;
+  return true;
+}
+
+template<typename T>
+static void write_mesh_cache_array(FILE *f, u64 &offset, const Vector<T> &v) {
+  static const u8 padding[MeshCacheHeader::ALIGNMENT] = {};
+  u64 aligned = align_offset(offset, MeshCacheHeader::ALIGNMENT);
+  fwrite(padding, 1, aligned - offset, f);
+  fwrite(v.data, sizeof(T), v.count, f);
+  offset = aligned + u64(v.count) * sizeof(T);
+}
+
+// Writes obj to cache_path. The cache is written to a temporary file first
+// and renamed into place, so a concurrent reader never sees half of one.
+static void write_mesh_cache(const char *cache_path, const struct stat &source, const MeshLods &lods) {
+  TRACE_SCOPE("write_mesh_cache");
+  char tmp_path[4096];
+  int n = snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", cache_path, int(getpid()));
+  FILE *f = n < int(sizeof(tmp_path)) ? fopen(tmp_path, "w") : nullptr;
+  if (!f) {
+    // The cache is an optimization; carry on without it.
+    errno = 0;
+    return;
+  }
+
+  const Obj &obj = lods.levels[0];
+  MeshCacheHeader h = {};
+  memcpy(h.magic, MeshCacheHeader::MAGIC, sizeof(h.magic));
+  h.version = MeshCacheHeader::VERSION;
+  h.lods = lods.count;
+  h.source_size = source.st_size;
+  h.source_mtime_ns = mtime_ns(source);
+  h.vertices = obj.vertices.count;
+  h.texcoords = obj.texcoords.count;
+  h.normals = obj.normals.count;
+  h.faces = obj.faces.count;
+  h.face_texcoords = obj.face_texcoords.count;
+  h.face_normals = obj.face_normals.count;
+  h.clusters = obj.clusters.count;
+
+  u64 offset = sizeof(h);
+  fwrite(&h, sizeof(h), 1, f);
+  write_mesh_cache_array(f, offset, obj.vertices);
+  write_mesh_cache_array(f, offset, obj.texcoords);
+  write_mesh_cache_array(f, offset, obj.normals);
+  write_mesh_cache_array(f, offset, obj.faces);
+  write_mesh_cache_array(f, offset, obj.face_texcoords);
+  write_mesh_cache_array(f, offset, obj.face_normals);
+  write_mesh_cache_array(f, offset, obj.clusters);
+
+  Vector<MeshCacheLod> records = {};
+  MeshCacheLod record_data[MAX_LODS];
+  records.data = record_data;
+  for (u32 i = 1; i < lods.count; i++) {
+    const Obj &level = lods.levels[i];
+    record_data[records.count++] = {level.vertices.count, level.normals.count, level.faces.count,
+                                    level.face_texcoords.count, level.face_normals.count,
+                                    level.clusters.count, lods.errors[i]};
+  }
+  write_mesh_cache_array(f, offset, records);
+  for (u32 i = 1; i < lods.count; i++) {
+    const Obj &level = lods.levels[i];
+    write_mesh_cache_array(f, offset, level.vertices);
+    write_mesh_cache_array(f, offset, level.normals);
+    write_mesh_cache_array(f, offset, level.faces);
+    write_mesh_cache_array(f, offset, level.face_texcoords);
+    write_mesh_cache_array(f, offset, level.face_normals);
+    write_mesh_cache_array(f, offset, level.clusters);
+  }
+
+  bool ok = !ferror(f);
+  ok = fclose(f) == 0 && ok;
+  if (!ok || rename(tmp_path, cache_path) != 0) {
+    unlink(tmp_path);
+  }
+  errno = 0;
+}
+
+// Unmaps the mesh cache lods came from, if any.
+static void unmap_mesh_lods(MeshLods &lods) {
+  if (lods.cache.addr) {
+    munmap(lods.cache.addr, lods.cache.size);
+  }
+  lods.cache = {};
+}
+
+// Most vertices and triangles in a meshlet. Its triangles index its vertices
+// with 8 bits, and the two fill a 2 KB record.
+constexpr u32 MESHLET_MAX_VERTICES = 64;
+constexpr u32 MESHLET_MAX_TRIANGLES = 126;
+
+// A cluster of neighboring triangles of a mesh too big for 16-bit indices,
+// with its own copies of the vertices they use, so it can be drawn on its own.
+struct Meshlet {
+  f32x3 min;
+  u32 vertex_count;
+  f32x3 max;
+  u32 triangle_count;
+  NormalCone cone;
+  f32x3 positions[MESHLET_MAX_VERTICES];
+  // Each vertex's area-weighted sum of the normals of the faces around it in
+  // the whole mesh, so shading doesn't change at meshlet borders.
+  f32x3 normals[MESHLET_MAX_VERTICES];
+  u8 triangles[MESHLET_MAX_TRIANGLES][3];
+  u8 padding[86];
+};
+
+static_assert(sizeof(Meshlet) == 2048, "meshlets are fixed-size records");
+
+// A mesh's meshlets, in a file at "<path>.meshlets": this header and then the
+// meshlets, in the order of their first triangles in the OBJ file, so the
+// file can be drawn reading it front to back. Like the mesh cache, it's in
+// native byte order.
+struct MeshletFileHeader {
+  static constexpr char MAGIC[8] = {'S', 'W', 'R', 'M', 'L', 'E', 'T', '\0'};
+  static constexpr u32 VERSION = 2;
+
+  char magic[8];
+  u32 version;
+  u32 meshlets;
+  // Size and modification time of the OBJ file the meshlets were built from.
+  u64 source_size;
+  i64 source_mtime_ns;
+  u32 vertices;
+  u32 triangles;
+  f32x3 min;
+  f32x3 max;
+  // Keeps the meshlets at multiples of their size in the file.
+  u8 padding[sizeof(Meshlet) - 64];
+};
+
+static_assert(sizeof(MeshletFileHeader) == sizeof(Meshlet), "the header is one record");
+
+// An open meshlet file; fd is -1 if there is none.
+struct MeshletFile {
+  int fd = -1;
+  u32 count;
+  u32 triangles;
+};
+
+// Opens the meshlets at path, or returns false if they are missing,
+// malformed or older than the source.
+static bool open_meshlet_file(const char *path, const struct stat &source, MeshletFile &file) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    errno = 0;
+    return false;
+  }
+  MeshletFileHeader h;
+  struct stat st;
+  bool valid = fstat(fd, &st) == 0 && pread(fd, &h, sizeof(h), 0) == sizeof(h) &&
+               memcmp(h.magic, MeshletFileHeader::MAGIC, sizeof(h.magic)) == 0 &&
+               h.version == MeshletFileHeader::VERSION &&
+               h.source_size == u64(source.st_size) &&
+               h.source_mtime_ns == mtime_ns(source) &&
+               u64(st.st_size) == sizeof(h) + u64(h.meshlets) * sizeof(Meshlet);
+  if (!valid) {
+    close(fd);
+    errno = 0;
+    return false;
+  }
+  file = {fd, h.meshlets, h.triangles};
+  return true;
+}
+
+// Splits the triangles of parsed OBJ data into meshlets and writes them to
+// path. Meshlets are filled greedily in file order, which keeps their
+// triangles close together for the usual OBJ exporters and scanners, and go
+// out as soon as they're full. Like the mesh cache, the file is written under
+// a temporary name and renamed into place.
+static void write_meshlet_file(const char *path, const struct stat &source, const ObjData &data) {
+  TRACE_SCOPE("write_meshlet_file");
+  u32 vertex_count = data.position_count;
+  const f32x3 *vertices = reinterpret_cast<const f32x3 *>(data.positions);
+  auto for_each_triangle = [&](const auto &triangle) {
+    for (u32 i = 0; i < data.face_count; i++) {
+      const u32 *t = &data.faces[i * 3];
+      triangle(t[0], t[1], t[2]);
+    }
+  };
+
+  f32x3 *normals = g_tmp_arena.alloc_array<f32x3>(vertex_count);
+  memset(normals, 0, vertex_count * sizeof(f32x3));
+  for_each_triangle([&](u32 a, u32 b, u32 d) {
+    f32x3 n = cross(vertices[b] - vertices[a], vertices[d] - vertices[a]);
+    for (u32 v : {a, b, d}) {
+      normals[v] = {normals[v].x + n.x, normals[v].y + n.y, normals[v].z + n.z};
+    }
+  });
+
+  char tmp_path[4096];
+  int n = snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, int(getpid()));
+  FILE *f = n < int(sizeof(tmp_path)) ? fopen(tmp_path, "w") : nullptr;
+  if (!f) {
+    panic("unable to open '%s.%d.tmp'", path, int(getpid()));
+  }
+
+  constexpr f32 far = std::numeric_limits<f32>::max();
+  MeshletFileHeader h = {};
+  h.min = {far, far, far};
+  h.max = {-far, -far, -far};
+  fwrite(&h, sizeof(h), 1, f);
+
+  // The meshlet each vertex was last added to, and its index there.
+  u32 *owners = g_tmp_arena.alloc_array<u32>(vertex_count);
+  u8 *locals = g_tmp_arena.alloc_array<u8>(vertex_count);
+  memset(owners, 0xFF, vertex_count * sizeof(u32));
+  Meshlet m = {};
+  m.min = h.min;
+  m.max = h.max;
+  auto flush = [&] {
+    m.cone = bound_normals(m.triangle_count, [&](u32 i) {
+      const u8 *t = m.triangles[i];
+      f32x3 a = m.positions[t[0]];
+      return cross(m.positions[t[1]] - a, m.positions[t[2]] - a);
+    });
+    fwrite(&m, sizeof(m), 1, f);
+    h.meshlets++;
+    h.triangles += m.triangle_count;
+    h.min = {min(h.min.x, m.min.x), min(h.min.y, m.min.y), min(h.min.z, m.min.z)};
+    h.max = {max(h.max.x, m.max.x), max(h.max.y, m.max.y), max(h.max.z, m.max.z)};
+    m = {};
+    m.min = {far, far, far};
+    m.max = {-far, -far, -far};
+  };
+  for_each_triangle([&](u32 a, u32 b, u32 d) {
+    u32 corners[3] = {a, b, d};
+    u32 added = 0;
+    for (u32 v : corners) {
+      added += owners[v] != h.meshlets;
+    }
+    if (m.vertex_count + added > MESHLET_MAX_VERTICES || m.triangle_count == MESHLET_MAX_TRIANGLES) {
+      flush();
+    }
+    for (u32 k = 0; k < 3; k++) {
+      u32 v = corners[k];
+      if (owners[v] != h.meshlets) {
+        owners[v] = h.meshlets;
+        locals[v] = m.vertex_count;
+        f32x3 p = vertices[v];
+        m.positions[m.vertex_count] = p;
+        m.normals[m.vertex_count] = normals[v];
+        m.vertex_count++;
+        m.min = {min(m.min.x, p.x), min(m.min.y, p.y), min(m.min.z, p.z)};
+        m.max = {max(m.max.x, p.x), max(m.max.y, p.y), max(m.max.z, p.z)};
+      }
+      m.triangles[m.triangle_count][k] = locals[v];
+    }
+    m.triangle_count++;
+  });
+  if (m.triangle_count) {
+    flush();
+  }
+
+  memcpy(h.magic, MeshletFileHeader::MAGIC, sizeof(h.magic));
+  h.version = MeshletFileHeader::VERSION;
+  h.source_size = source.st_size;
+  h.source_mtime_ns = mtime_ns(source);
+  h.vertices = vertex_count;
+  bool ok = fseek(f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, f) == 1 && !ferror(f);
+  ok = fclose(f) == 0 && ok;
+  if (!ok || rename(tmp_path, path) != 0) {
+    unlink(tmp_path);
+    panic("unable to write '%s'", path);
+  }
+}
+
+// A mesh to draw: in memory with its levels of detail when its indices fit
+// in 16 bits, or else streamed from its meshlets.
+struct Mesh {
+  MeshLods lods;
+  MeshletFile meshlets;
+};
+
+// Loads the mesh in an OBJ file through its cache at "<path>.mesh", or opens
+// its meshlets at "<path>.meshlets" if it's too big for 16-bit indices. Either
+// one is (re)built from the OBJ when it's missing or stale.
+static Mesh load_mesh(const char *path, WorkerPool &pool, Arena &arena) {
+  TRACE_SCOPE("load_mesh");
+  struct stat source;
+  if (stat(path, &source) != 0) {
+    panic("unable to stat '%s'", path);
+  }
+
+  char cache_path[4096];
+  snprintf(cache_path, sizeof(cache_path), "%s.mesh", path);
+  char meshlet_path[4096];
+  snprintf(meshlet_path, sizeof(meshlet_path), "%s.meshlets", path);
+
+  Mesh mesh = {};
+  if (map_mesh_cache(cache_path, source, mesh.lods) ||
+      open_meshlet_file(meshlet_path, source, mesh.meshlets)) {
+    return mesh;
+  }
+  ObjData data = parse_obj_file(path, pool);
+  if (fits_in_obj(data)) {
+    Obj obj = copy_obj(data, arena);
+    g_tmp_arena.reset();
+    compute_vertex_normals(obj, arena);
+    sort_faces_for_clusters(obj);
+    obj.clusters = compute_face_clusters(obj, arena);
+    mesh.lods = build_lods(obj, arena);
+    write_mesh_cache(cache_path, source, mesh.lods);
+    return mesh;
+  }
+  write_meshlet_file(meshlet_path, source, data);
+  g_tmp_arena.reset();
+  if (!open_meshlet_file(meshlet_path, source, mesh.meshlets)) {
+    panic("unable to open '%s'", meshlet_path);
+  }
+  return mesh;
+}
+
+// Unmaps or closes whatever mesh was loaded from. What load_mesh took from
+// its arena is for the caller to reset.
+static void release_mesh(Mesh &mesh) {
+  unmap_mesh_lods(mesh.lods);
+  if (mesh.meshlets.fd >= 0) {
+    close(mesh.meshlets.fd);
+  }
+  mesh.meshlets = {};
+}
+
+struct Pixel {
+  u8 b, g, r;
+};
+
+static bool operator==(Pixel a, Pixel b) {
+  return a.b == b.b && a.g == b.g && a.r == b.r;
+}
+
+enum class TgaEncoding {
+  // Type 2, uncompressed true color.
+  Raw,
+  // Type 10, run-length encoded true color.
+  Rle,
+  // Type 11, run-length encoded grayscale.
+  RleGray,
+};
+
+enum class OutputMode {
+  // Encode into buffers, then copy them into the file with writev.
+  Write,
+  // Size the file up front and resolve rows straight into a shared mapping
+  // of it. Always uncompressed, since the size has to be known first.
+  Mmap,
+};
+
+// What to wait for before a saved image counts as written.
+enum class OutputSync {
+  // Nothing; the kernel writes the page cache back whenever it likes.
+  None,
+  // msync the mapping, for Mmap only.
+  Msync,
+  // fdatasync the file.
+  Fdatasync,
+};
+
+static u8 luma(Pixel p) {
+  return (p.r * 77 + p.g * 150 + p.b * 29) >> 8;
+}
+
+// Largest possible size of a run-length encoded row of n values of type T.
+// Runs are never longer than the raw bytes they replace, so only the headers
+// of raw packets, one per 128 values at most, add to the size.
+template<typename T>
+static u32 max_rle_size(u32 n) {
+  return n * sizeof(T) + (n + 127) / 128;
+}
+
+// Shortest run worth a packet of its own. A run packet of one-byte values is
+// as long as the run itself at 2, and the raw packet it interrupts needs a
+// second header, so single bytes only get run packets from 3 on.
+template<typename T>
+static constexpr u32 MIN_RLE_RUN = sizeof(T) == 1 ? 3 : 2;
+
+// Whether a run of at least MIN_RLE_RUN equal values starts at row[i].
+template<typename T>
+static bool starts_rle_run(const T *row, u32 i, u32 n) {
+  if (i + MIN_RLE_RUN<T> > n) {
+    return false;
+  }
+  for (u32 k = 1; k < MIN_RLE_RUN<T>; k++) {
+    if (!(row[i + k] == row[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Run-length encodes a row as TGA packets, which never span rows. Returns the
+// number of bytes written to out, at most max_rle_size<T>(n).
+template<typename T>
+static u32 encode_rle_row(const T *row, u32 n, u8 *out) {
+  u8 *start = out;
+  for (u32 i = 0; i < n;) {
+    u32 run = 1;
+    while (i + run < n && run < 128 && row[i + run] == row[i]) {
+      run++;
+    }
+    if (run >= MIN_RLE_RUN<T>) {
+      *out++ = 0x80 | (run - 1);
+      memcpy(out, &row[i], sizeof(T));
+      out += sizeof(T);
+      i += run;
+      continue;
+    }
+
+    // A raw packet runs until the next run worth a packet.
+    u32 j = i + 1;
+    while (j < n && j - i < 128 && !starts_rle_run(row, j, n)) {
+      j++;
+    }
+    *out++ = j - i - 1;
+    memcpy(out, &row[i], (j - i) * sizeof(T));
+    out += (j - i) * sizeof(T);
+    i = j;
+  }
+  return out - start;
+}
+
+// Decodes TGA packets from in into n values at out, for checking
+// encode_rle_row. Returns the number of bytes read.
+template<typename T>
+static u32 decode_rle_row(const u8 *in, u32 n, T *out) {
+  const u8 *start = in;
+  for (u32 i = 0; i < n;) {
+    u32 count = (*in & 0x7F) + 1;
+    bool run = *in++ & 0x80;
+    for (u32 j = 0; j < count && i < n; j++, i++) {
+      memcpy(&out[i], in, sizeof(T));
+      in += run ? 0 : sizeof(T);
+    }
+    in += run ? sizeof(T) : 0;
+  }
+  return in - start;
+}
+
+// Encodes rows built to be hard on the run-length encoder, such as
+// "a b b" repeated, which stays within max_rle_size only because 2-runs of
+// single bytes go in raw packets, and checks the size and the round trip.
+template<typename T>
+static void test_rle_rows(const char *type, T (*value)(u32)) {
+  constexpr u32 N = 1000;
+  constexpr u32 GUARD = 64;
+  // Letters repeat along the row, shifted to new values every repetition.
+  const char *patterns[] = {"abb", "ab", "aabb", "aab", "abbb", "a", "same", "random"};
+  T row[N], decoded[N];
+  u8 out[N * sizeof(T) + N + GUARD];
+  for (const char *pattern : patterns) {
+    u32 length = strlen(pattern);
+    u32 seed = 1;
+    for (u32 i = 0; i < N; i++) {
+      seed = seed * 1664525 + 1013904223;
+      if (strcmp(pattern, "random") == 0) {
+        row[i] = value(seed >> 30);
+      } else if (strcmp(pattern, "same") == 0) {
+        row[i] = value(0);
+      } else {
+        row[i] = value(pattern[i % length] - 'a' + (i / length) % 2 * 2);
+      }
+    }
+    u32 bound = max_rle_size<T>(N);
+    memset(out, 0xCD, sizeof(out));
+    u32 n = encode_rle_row(row, N, out);
+    if (n > bound || out[bound] != 0xCD) {
+      panic("rle %s '%s': encoded %u bytes, more than the bound of %u", type, pattern, n, bound);
+    }
+    if (decode_rle_row(out, N, decoded) != n || memcmp(row, decoded, sizeof(row)) != 0) {
+      panic("rle %s '%s': round trip doesn't match", type, pattern);
+    }
+  }
+}
+
+// Checks the parts of the pipeline that can be checked without a reference
+// image.
+static void test() {
+  test_rle_rows<u8>("gray", [](u32 v) { return u8(v * 37); });
+  test_rle_rows<Pixel>("bgr", [](u32 v) { return Pixel{u8(v * 37), u8(v * 11), u8(v)}; });
+  printf("test: ok\n");
+}
+
+// An encoded TGA file, as the buffers to write out in order.
+struct TgaFile {
+  iovec *iov;
+  u32 count;
+
+  u64 size() const {
+    u64 n = 0;
+    for (u32 i = 0; i < count; i++) {
+      n += iov[i].iov_len;
+    }
+    return n;
+  }
+};
+
+// Writes all of iov to fd, in as few writev calls as IOV_MAX allows.
+static void write_iovecs(int fd, iovec *iov, u32 count, const char *path) {
+  TRACE_SCOPE("write_iovecs");
+  while (count) {
+    ssize_t n = writev(fd, iov, min(count, u32(IOV_MAX)));
+    if (n < 0) {
+      if (errno == EINTR) {
+        errno = 0;
+        continue;
+      }
+      panic("unable to write '%s'", path);
+    }
+    for (; count && size_t(n) >= iov->iov_len; iov++, count--) {
+      n -= iov->iov_len;
+    }
+    if (count) {
+      iov->iov_base = static_cast<u8 *>(iov->iov_base) + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+// Side length of the square blocks that Texture stores texels in. A 4x4 block
+// of 32-bit texels is one 64-byte cache line, and texels within it are in
+// Morton order, so the 2x2 footprint of a bilinear sample touches one cache
+// line, or two or four where it straddles blocks.
+constexpr u32 TEXEL_BLOCK_SIZE = 4;
+constexpr u32 MAX_MIP_LEVELS = 16;
+
+// One level of a mip chain, as BGRA texels in blocks of TEXEL_BLOCK_SIZE,
+// row-major from the bottom left. Levels are padded to whole blocks.
+struct TextureLevel {
+  u32 *texels;
+  u32 width;
+  u32 height;
+  u32 blocks_x;
+
+  u32 offset(u32 x, u32 y) const {
+    u32 block = (y / TEXEL_BLOCK_SIZE) * blocks_x + x / TEXEL_BLOCK_SIZE;
+    u32 morton = (x & 1) | (y & 1) << 1 | (x & 2) << 1 | (y & 2) << 2;
+    return block * TEXEL_BLOCK_SIZE * TEXEL_BLOCK_SIZE + morton;
+  }
+};
+
+// A texture and its mip chain, down to 1x1.
+struct Texture {
+  TextureLevel levels[MAX_MIP_LEVELS];
+  u32 level_count;
+};
+
+enum class TextureFilter {
+  // Bilinear within the nearest mip level.
+  Bilinear,
+  // Bilinear within the two nearest mip levels, blended.
+  Trilinear,
+};
+
+// Stores a w x h image of row-major texels as a texture level.
+static TextureLevel make_texture_level(const u32 *texels, u32 w, u32 h, Arena &arena) {
+  TextureLevel level;
+  level.width = w;
+  level.height = h;
+  level.blocks_x = (w + TEXEL_BLOCK_SIZE - 1) / TEXEL_BLOCK_SIZE;
+  u32 blocks_y = (h + TEXEL_BLOCK_SIZE - 1) / TEXEL_BLOCK_SIZE;
+  u32 count = level.blocks_x * blocks_y * TEXEL_BLOCK_SIZE * TEXEL_BLOCK_SIZE;
+  level.texels = reinterpret_cast<u32 *>(arena.aligned_alloc(count * sizeof(u32), 64));
+  memset(level.texels, 0, count * sizeof(u32));
+  for (u32 y = 0; y < h; y++) {
+    for (u32 x = 0; x < w; x++) {
+      level.texels[level.offset(x, y)] = texels[y * w + x];
+    }
+  }
+  return level;
+}
+
+// Averages 2x2 squares of a w x h image of row-major texels into out, which is
+// half the size, rounded down but at least 1. Odd edges repeat their last
+// row or column.
+static void downsample_texels(const u32 *texels, u32 w, u32 h, u32 *out, WorkerPool &pool) {
+  constexpr u32 ROWS_PER_TASK = 64;
+  u32 out_w = max(w / 2, 1u);
+  u32 out_h = max(h / 2, 1u);
+  pool.parallel_for((out_h + ROWS_PER_TASK - 1) / ROWS_PER_TASK, [&](u32 task) {
+    u32 end = min(out_h, (task + 1) * ROWS_PER_TASK);
+    for (u32 y = task * ROWS_PER_TASK; y < end; y++) {
+      const u32 *row0 = &texels[min(2 * y, h - 1) * w];
+      const u32 *row1 = &texels[min(2 * y + 1, h - 1) * w];
+      for (u32 x = 0; x < out_w; x++) {
+        u32 x0 = min(2 * x, w - 1);
+        u32 x1 = min(2 * x + 1, w - 1);
+        u32 texel = 0;
+        for (u32 shift = 0; shift < 32; shift += 8) {
+          u32 sum = ((row0[x0] >> shift) & 0xFF) + ((row0[x1] >> shift) & 0xFF) +
+                    ((row1[x0] >> shift) & 0xFF) + ((row1[x1] >> shift) & 0xFF);
+          texel |= ((sum + 2) / 4) << shift;
+        }
+        out[y * out_w + x] = texel;
+      }
+    }
+  });
+}
+
+// Decodes a TGA file, uncompressed or run-length encoded, in 8-bit grayscale
+// or 24 or 32-bit true color, into row-major BGRA texels from g_tmp_arena,
+// bottom row first.
+static u32 *decode_tga(const char *path, u32 &width, u32 &height) {
+  MemoryMappedFile file = mmap_read_only(path);
+  const u8 *s = static_cast<const u8 *>(file.addr);
+  const u8 *end = s + file.size;
+  if (file.size < 18) {
+    panic("'%s' is too short to be a TGA file", path);
+  }
+  u8 type = s[2];
+  width = s[12] | s[13] << 8;
+  height = s[14] | s[15] << 8;
+  u32 bytes_per_pixel = s[16] / 8;
+  bool top_down = s[17] & 0x20;
+  bool rle = type == 10 || type == 11;
+  bool gray = type == 3 || type == 11;
+  if (s[1] != 0 || !(type == 2 || type == 3 || type == 10 || type == 11) ||
+      bytes_per_pixel != (gray ? 1 : bytes_per_pixel == 4 ? 4 : 3) || s[16] % 8) {
+    panic("'%s' is not an 8-bit grayscale or 24 or 32-bit true color TGA file", path);
+  }
+  if (!width || !height) {
+    panic("'%s' is empty", path);
+  }
+  const u8 *p = s + 18 + s[0];
+
+  u32 count = width * height;
+  u32 *texels = g_tmp_arena.alloc_array<u32>(count);
+  auto read_texel = [&]() {
+    if (u32(end - p) < bytes_per_pixel) {
+      panic("'%s' is truncated", path);
+    }
+    u32 texel = gray ? p[0] * 0x010101u | 0xFF000000u
+                     : p[0] | p[1] << 8 | p[2] << 16 | (bytes_per_pixel == 4 ? u32(p[3]) << 24 : 0xFF000000u);
+    p += bytes_per_pixel;
+    return texel;
+  };
+  for (u32 i = 0; i < count;) {
+    u32 n = 1;
+    bool run = false;
+    if (rle) {
+      if (p == end) {
+        panic("'%s' is truncated", path);
+      }
+      run = *p & 0x80;
+      n = min((*p++ & 0x7F) + 1u, count - i);
+    }
+    u32 texel = run ? read_texel() : 0;
+    for (u32 j = 0; j < n; j++) {
+      u32 y = (i + j) / width;
+      u32 x = (i + j) % width;
+      texels[(top_down ? height - 1 - y : y) * width + x] = run ? texel : read_texel();
+    }
+    i += n;
+  }
+  munmap(file.addr, file.size);
+  return texels;
+}
+
+// Loads a TGA file as a texture with a full mip chain, into arena.
+static Texture load_texture(const char *path, WorkerPool &pool, Arena &arena) {
+  u32 w, h;
+  u32 *texels = decode_tga(path, w, h);
+  Texture texture = {};
+  for (;;) {
+    texture.levels[texture.level_count++] = make_texture_level(texels, w, h, arena);
+    if ((w == 1 && h == 1) || texture.level_count == MAX_MIP_LEVELS) {
+      break;
+    }
+    u32 *next = g_tmp_arena.alloc_array<u32>(max(w / 2, 1u) * max(h / 2, 1u));
+    downsample_texels(texels, w, h, next, pool);
+    texels = next;
+    w = max(w / 2, 1u);
+    h = max(h / 2, 1u);
+  }
+  g_tmp_arena.reset();
+  return texture;
+}
+
+// Scales filtered color channels by I, clamping to what a pixel can hold.
+static Pixel modulate(f32 b, f32 g, f32 r, f32 I) {
+  auto channel = [I](f32 c) { return u8(min(max(c * I, 0.0f), 255.0f)); };
+  return {channel(b), channel(g), channel(r)};
+}
+
+// Bilinearly filters level at texture coordinates (u, v), which wrap around.
+// Writes the blue, green and red channels to bgr.
+static void sample_bilinear(const TextureLevel &level, f32 u, f32 v, f32 *bgr) {
+  f32 x = (u - floorf(u)) * f32(level.width) - 0.5f;
+  f32 y = (v - floorf(v)) * f32(level.height) - 0.5f;
+  f32 fx = floorf(x);
+  f32 fy = floorf(y);
+  i32 x0 = i32(fx);
+  i32 y0 = i32(fy);
+  fx = x - fx;
+  fy = y - fy;
+  // x0 is in [-1, width - 1], and the neighbor of the last column is the first.
+  u32 x1 = x0 + 1 == i32(level.width) ? 0 : x0 + 1;
+  u32 y1 = y0 + 1 == i32(level.height) ? 0 : y0 + 1;
+  x0 = x0 < 0 ? level.width - 1 : x0;
+  y0 = y0 < 0 ? level.height - 1 : y0;
+  u32 t00 = level.texels[level.offset(x0, y0)];
+  u32 t10 = level.texels[level.offset(x1, y0)];
+  u32 t01 = level.texels[level.offset(x0, y1)];
+  u32 t11 = level.texels[level.offset(x1, y1)];
+  for (u32 c = 0; c < 3; c++) {
+    u32 shift = c * 8;
+    f32 c00 = (t00 >> shift) & 0xFF;
+    f32 c10 = (t10 >> shift) & 0xFF;
+    f32 c01 = (t01 >> shift) & 0xFF;
+    f32 c11 = (t11 >> shift) & 0xFF;
+    f32 bottom = c00 + (c10 - c00) * fx;
+    f32 top = c01 + (c11 - c01) * fx;
+    bgr[c] = bottom + (top - bottom) * fy;
+  }
+}
+
+#if __x86_64__
+// TextureLevel::offset of 8 texels at once.
+__attribute__((target("avx2")))
+static __m256i texel_offsets_avx2(const TextureLevel &level, __m256i x, __m256i y) {
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i two = _mm256_set1_epi32(2);
+  __m256i block = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srli_epi32(y, 2), _mm256_set1_epi32(level.blocks_x)),
+                                   _mm256_srli_epi32(x, 2));
+  __m256i morton = _mm256_or_si256(_mm256_and_si256(x, one), _mm256_slli_epi32(_mm256_and_si256(y, one), 1));
+  morton = _mm256_or_si256(morton, _mm256_slli_epi32(_mm256_and_si256(x, two), 1));
+  morton = _mm256_or_si256(morton, _mm256_slli_epi32(_mm256_and_si256(y, two), 2));
+  return _mm256_or_si256(_mm256_slli_epi32(block, 4), morton);
+}
+
+// Bilinearly filters level at 8 texture coordinates at once, like
+// sample_bilinear.
+__attribute__((target("avx2")))
+static void sample_bilinear_avx2(const TextureLevel &level, __m256 u, __m256 v, __m256 *bgr) {
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i byte = _mm256_set1_epi32(0xFF);
+  __m256i width = _mm256_set1_epi32(level.width);
+  __m256i height = _mm256_set1_epi32(level.height);
+  __m256 x = _mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(u, _mm256_floor_ps(u)), _mm256_cvtepi32_ps(width)),
+                           _mm256_set1_ps(0.5f));
+  __m256 y = _mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(v, _mm256_floor_ps(v)), _mm256_cvtepi32_ps(height)),
+                           _mm256_set1_ps(0.5f));
+  __m256 fx = _mm256_floor_ps(x);
+  __m256 fy = _mm256_floor_ps(y);
+  __m256i x0 = _mm256_cvttps_epi32(fx);
+  __m256i y0 = _mm256_cvttps_epi32(fy);
+  fx = _mm256_sub_ps(x, fx);
+  fy = _mm256_sub_ps(y, fy);
+  __m256i x1 = _mm256_add_epi32(x0, one);
+  __m256i y1 = _mm256_add_epi32(y0, one);
+  x1 = _mm256_andnot_si256(_mm256_cmpeq_epi32(x1, width), x1);
+  y1 = _mm256_andnot_si256(_mm256_cmpeq_epi32(y1, height), y1);
+  // Coordinates of -1 wrap around to the last row or column.
+  __m256 last_x = _mm256_castsi256_ps(_mm256_sub_epi32(width, one));
+  __m256 last_y = _mm256_castsi256_ps(_mm256_sub_epi32(height, one));
+  x0 = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(x0), last_x, _mm256_castsi256_ps(x0)));
+  y0 = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(y0), last_y, _mm256_castsi256_ps(y0)));
+
+  const int *texels = reinterpret_cast<const int *>(level.texels);
+  __m256i t00 = _mm256_i32gather_epi32(texels, texel_offsets_avx2(level, x0, y0), 4);
+  __m256i t10 = _mm256_i32gather_epi32(texels, texel_offsets_avx2(level, x1, y0), 4);
+  __m256i t01 = _mm256_i32gather_epi32(texels, texel_offsets_avx2(level, x0, y1), 4);
+  __m256i t11 = _mm256_i32gather_epi32(texels, texel_offsets_avx2(level, x1, y1), 4);
+  for (u32 c = 0; c < 3; c++) {
+    __m128i shift = _mm_cvtsi32_si128(c * 8);
+    __m256 c00 = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srl_epi32(t00, shift), byte));
+    __m256 c10 = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srl_epi32(t10, shift), byte));
+    __m256 c01 = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srl_epi32(t01, shift), byte));
+    __m256 c11 = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srl_epi32(t11, shift), byte));
+    __m256 bottom = _mm256_add_ps(c00, _mm256_mul_ps(_mm256_sub_ps(c10, c00), fx));
+    __m256 top = _mm256_add_ps(c01, _mm256_mul_ps(_mm256_sub_ps(c11, c01), fx));
+    bgr[c] = _mm256_add_ps(bottom, _mm256_mul_ps(_mm256_sub_ps(top, bottom), fy));
+  }
+}
+#endif
+
+// Screen-space rectangle, [x0, x1) x [y0, y1).
+struct Rect {
+  i32 x0, y0, x1, y1;
+};
+
+// Pixels or tiles [x_min, x_max] x [y_min, y_max], both ends included. Empty
+// when x_min > x_max or y_min > y_max.
+struct Bounds {
+  i32 x_min, y_min, x_max, y_max;
+
+  bool empty() const {
+    return x_min > x_max || y_min > y_max;
+  }
+};
+
+// Side length of a square tile, in pixels. Rows are padded to a multiple of
+// this, and a tile row is then a whole number of cache lines in both the pixel
+// and depth buffers, so threads working on different tiles never share one.
+constexpr u32 TILE_SIZE = 64;
+
+// The three edge functions of a triangle, E[i](x, y) = a[i] * x + b[i] * y +
+// c[i], oriented so that a pixel is covered when all of them are >= 0. Edge i
+// is the one opposite vertex i.
+struct EdgeFunctions {
+  f32 a[3];
+  f32 b[3];
+  f32 c[3];
+  // Twice the triangle's area; the three edge functions always sum to this.
+  f32 area;
+
+  // Returns false if the triangle is too thin to cover any pixels.
+  static bool setup(f32x3 v0, f32x3 v1, f32x3 v2, EdgeFunctions &e) {
+    f32 area = (v2.x - v0.x) * (v1.y - v0.y) - (v1.x - v0.x) * (v2.y - v0.y);
+    if (fabsf(area) < 1.0f) {
+      return false;
+    }
+    f32 sign = area < 0.0f ? -1.0f : 1.0f;
+    e.area = fabsf(area);
+    f32x3 from[3] = {v1, v2, v0};
+    f32x3 to[3] = {v2, v0, v1};
+    for (u32 i = 0; i < 3; i++) {
+      e.a[i] = (to[i].y - from[i].y) * sign;
+      e.b[i] = (from[i].x - to[i].x) * sign;
+      e.c[i] = -(e.a[i] * from[i].x + e.b[i] * from[i].y);
+    }
+    return true;
+  }
+
+  f32 at(u32 i, f32 x, f32 y) const {
+    return a[i] * x + b[i] * y + c[i];
+  }
+};
+
+// Sub-pixel precision of fixed-point rasterization: positions are snapped to
+// 1/16 of a pixel, as 28.4 fixed point.
+constexpr i32 SUBPIXEL_BITS = 4;
+constexpr f32 SUBPIXEL_SCALE = 1 << SUBPIXEL_BITS;
+
+static f32x3 snap_to_subpixel(f32x3 v) {
+  return {rintf(v.x * SUBPIXEL_SCALE) / SUBPIXEL_SCALE, rintf(v.y * SUBPIXEL_SCALE) / SUBPIXEL_SCALE, v.z};
+}
+
+// Edge functions of a triangle with vertices snapped to the sub-pixel grid,
+// evaluated exactly in integers. A pixel is inside when all three are
+// non-negative. Pixels exactly on an edge belong to the triangle only if the
+// edge is a top or left edge, which c accounts for, so a pixel on an edge
+// shared by two triangles is drawn by exactly one of them.
+struct FixedEdgeFunctions {
+  // Change per pixel in x and y, in units of 1/256 pixel squared.
+  i32 a[3];
+  i32 b[3];
+  i64 c[3];
+  // Twice the triangle's area, in the same units.
+  i64 area;
+
+  // The vertices must already be snapped. Returns false if the triangle has
+  // no area.
+  static bool setup(f32x3 v0, f32x3 v1, f32x3 v2, FixedEdgeFunctions &e) {
+    i64 x[3] = {i64(v0.x * SUBPIXEL_SCALE), i64(v1.x * SUBPIXEL_SCALE), i64(v2.x * SUBPIXEL_SCALE)};
+    i64 y[3] = {i64(v0.y * SUBPIXEL_SCALE), i64(v1.y * SUBPIXEL_SCALE), i64(v2.y * SUBPIXEL_SCALE)};
+    i64 area = (x[2] - x[0]) * (y[1] - y[0]) - (x[1] - x[0]) * (y[2] - y[0]);
+    if (area == 0) {
+      return false;
+    }
+    i64 sign = area < 0 ? -1 : 1;
+    e.area = area * sign;
+    for (u32 i = 0; i < 3; i++) {
+      // Edge i runs between the two vertices other than vertex i.
+      u32 from = (i + 1) % 3;
+      u32 to = (i + 2) % 3;
+      i64 a = (y[to] - y[from]) * sign;
+      i64 b = (x[from] - x[to]) * sign;
+      // Screen y points up, so a top edge is horizontal with the triangle
+      // below it, and a left edge has the triangle to its right.
+      bool top_left = a > 0 || (a == 0 && b < 0);
+      e.a[i] = a << SUBPIXEL_BITS;
+      e.b[i] = b << SUBPIXEL_BITS;
+      e.c[i] = -(a * x[from] + b * y[from]) - (top_left ? 0 : 1);
+    }
+    return true;
+  }
+
+  // The same edge functions in floating point and in pixels, for
+  // interpolating across the triangle.
+  EdgeFunctions to_float() const {
+    constexpr f32 scale = 1.0f / (SUBPIXEL_SCALE * SUBPIXEL_SCALE);
+    EdgeFunctions e;
+    for (u32 i = 0; i < 3; i++) {
+      e.a[i] = a[i] * scale;
+      e.b[i] = b[i] * scale;
+      e.c[i] = c[i] * scale;
+    }
+    e.area = area * scale;
+    return e;
+  }
+
+  // Finds the values of the edge functions at the corner of bounds, small
+  // enough to step across it in 32 bits. Edges that bounds is entirely
+  // inside of become 0 everywhere. Returns false if bounds is entirely
+  // outside of an edge.
+  bool relative_to(Bounds bounds, i32 (&c0)[3], i32 (&a0)[3], i32 (&b0)[3]) const {
+    i64 dx = bounds.x_max - bounds.x_min;
+    i64 dy = bounds.y_max - bounds.y_min;
+    for (u32 i = 0; i < 3; i++) {
+      i64 e = a[i] * i64(bounds.x_min) + b[i] * i64(bounds.y_min) + c[i];
+      i64 step_x = a[i] * dx;
+      i64 step_y = b[i] * dy;
+      i64 emin = e + min(step_x, i64(0)) + min(step_y, i64(0));
+      i64 emax = e + max(step_x, i64(0)) + max(step_y, i64(0));
+      if (emax < 0) {
+        return false;
+      }
+      bool inside = emin >= 0;
+      c0[i] = inside ? 0 : i32(e);
+      a0[i] = inside ? 0 : a[i];
+      b0[i] = inside ? 0 : b[i];
+    }
+    return true;
+  }
+};
+
+// A value interpolated linearly across a triangle, f(x, y) = a * x + b * y + c.
+struct Plane {
+  f32 a, b, c;
+
+  // The plane through (v.x, v.y, f[i]) for each vertex v of the triangle e
+  // was set up from. Slopes come from the edge functions; the constant is
+  // taken relative to v0 so it stays small.
+  static Plane setup(const EdgeFunctions &e, f32x3 v0, f32 f0, f32 f1, f32 f2) {
+    f32 inv_area = 1.0f / e.area;
+    f32 a = (e.a[0] * f0 + e.a[1] * f1 + e.a[2] * f2) * inv_area;
+    f32 b = (e.b[0] * f0 + e.b[1] * f1 + e.b[2] * f2) * inv_area;
+    return {a, b, f0 - a * v0.x - b * v0.y};
+  }
+
+  f32 at(f32 x, f32 y) const {
+    return a * x + b * y + c;
+  }
+};
+
+// Most values a triangle can interpolate besides depth and 1/w.
+constexpr u32 MAX_VARYINGS = 4;
+
+// Where Triangle::varyings keeps each value. Textured triangles have all
+// three; smooth shaded ones only the intensity.
+enum Varying : u32 {
+  VARYING_INTENSITY,
+  VARYING_U,
+  VARYING_V,
+};
+
+static TextureFilter g_texture_filter = TextureFilter::Trilinear;
+
+// A face after lighting, in screen coordinates.
+struct Triangle {
+  f32x3 a, b, c;
+  // 1/w at each corner, for perspective-correct interpolation.
+  f32 inv_w[3];
+  // Values at each corner to interpolate across the triangle, laid out as
+  // in Varying. Without any, the triangle is flat shaded with color.
+  f32 varyings[3][MAX_VARYINGS];
+  u32 varying_count;
+  Pixel color;
+};
+
+// Everything a triangle interpolates, as planes in screen space set up once
+// per triangle. Varyings are interpolated divided by w, and multiplied by
+// the interpolated w per pixel, which makes them perspective correct.
+struct Interpolants {
+  Plane z;
+  Plane inv_w;
+  Plane varyings[MAX_VARYINGS];
+  u32 varying_count;
+  Pixel color;
+  // The texture to modulate the intensity with, if any, and the mip levels to
+  // sample: level, blended with the next one by level_blend.
+  const Texture *texture;
+  u32 level;
+  f32 level_blend;
+
+  static Interpolants setup(const EdgeFunctions &e, const Triangle &t, const Texture *texture) {
+    Interpolants p;
+    p.z = Plane::setup(e, t.a, t.a.z, t.b.z, t.c.z);
+    p.inv_w = Plane::setup(e, t.a, t.inv_w[0], t.inv_w[1], t.inv_w[2]);
+    for (u32 k = 0; k < t.varying_count; k++) {
+      f32 f0 = t.varyings[0][k] * t.inv_w[0];
+      f32 f1 = t.varyings[1][k] * t.inv_w[1];
+      f32 f2 = t.varyings[2][k] * t.inv_w[2];
+      p.varyings[k] = Plane::setup(e, t.a, f0, f1, f2);
+    }
+    p.varying_count = t.varying_count;
+    p.color = t.color;
+    p.texture = t.varying_count > VARYING_V ? texture : nullptr;
+    if (p.texture) {
+      select_mip_level(t, e, p);
+    }
+    return p;
+  }
+
+  // Picks the mip levels from how many texels the triangle covers per pixel,
+  // once for the whole triangle. That's exact for the affine mappings an
+  // orthographic projection gives, and keeps minified triangles sampling
+  // from levels small enough to stay in cache.
+  static void select_mip_level(const Triangle &t, const EdgeFunctions &e, Interpolants &p) {
+    const TextureLevel &base = p.texture->levels[0];
+    f32 du1 = (t.varyings[1][VARYING_U] - t.varyings[0][VARYING_U]) * f32(base.width);
+    f32 dv1 = (t.varyings[1][VARYING_V] - t.varyings[0][VARYING_V]) * f32(base.height);
+    f32 du2 = (t.varyings[2][VARYING_U] - t.varyings[0][VARYING_U]) * f32(base.width);
+    f32 dv2 = (t.varyings[2][VARYING_V] - t.varyings[0][VARYING_V]) * f32(base.height);
+    // Both areas are doubled, which cancels out.
+    f32 texel_area = fabsf(du1 * dv2 - du2 * dv1);
+    f32 lod = texel_area > e.area ? 0.5f * log2f(texel_area / e.area) : 0.0f;
+    lod = min(lod, f32(p.texture->level_count - 1));
+    if (g_texture_filter == TextureFilter::Bilinear) {
+      p.level = u32(lod + 0.5f);
+      p.level_blend = 0.0f;
+    } else {
+      p.level = u32(lod);
+      p.level_blend = lod - f32(p.level);
+    }
+  }
+};
+
+// Computes coverage of the pixels in bounds (at most 64 wide), one
+// u64 per row with bit i set if pixel bounds.x_min + i is covered. The edge
+// functions are evaluated once at the corner of bounds and then stepped
+// incrementally, 8 pixels at a time where the CPU allows.
+using CoverageKernel = void (*)(const EdgeFunctions &e, Bounds bounds, u64 *rows);
+
+static void coverage_scalar(const EdgeFunctions &e, Bounds bounds, u64 *rows) {
+  f32 row[3];
+  for (u32 i = 0; i < 3; i++) {
+    row[i] = e.at(i, bounds.x_min, bounds.y_min);
+  }
+  for (i32 y = bounds.y_min; y <= bounds.y_max; y++) {
+    f32 w[3] = {row[0], row[1], row[2]};
+    u64 mask = 0;
+    for (i32 x = 0; x <= bounds.x_max - bounds.x_min; x++) {
+      if (w[0] >= 0.0f && w[1] >= 0.0f && w[2] >= 0.0f) {
+        mask |= u64(1) << x;
+      }
+      for (u32 i = 0; i < 3; i++) {
+        w[i] += e.a[i];
+      }
+    }
+    rows[y - bounds.y_min] = mask;
+    for (u32 i = 0; i < 3; i++) {
+      row[i] += e.b[i];
+    }
+  }
+}
+
+// The same, for fixed-point edge functions. All of these compute exactly the
+// same coverage.
+using FixedCoverageKernel = void (*)(const FixedEdgeFunctions &e, Bounds bounds, u64 *rows);
+
+static void fixed_coverage_scalar(const FixedEdgeFunctions &e, Bounds bounds, u64 *rows) {
+  i32 row[3], a[3], b[3];
+  if (!e.relative_to(bounds, row, a, b)) {
+    memset(rows, 0, (bounds.y_max - bounds.y_min + 1) * sizeof(u64));
+    return;
+  }
+  for (i32 y = bounds.y_min; y <= bounds.y_max; y++) {
+    i32 w[3] = {row[0], row[1], row[2]};
+    u64 mask = 0;
+    for (i32 x = 0; x <= bounds.x_max - bounds.x_min; x++) {
+      if ((w[0] | w[1] | w[2]) >= 0) {
+        mask |= u64(1) << x;
+      }
+      for (u32 i = 0; i < 3; i++) {
+        w[i] += a[i];
+      }
+    }
+    rows[y - bounds.y_min] = mask;
+    for (u32 i = 0; i < 3; i++) {
+      row[i] += b[i];
+    }
+  }
+}
+
+// Depth tests and shades the fragments of row y of a tile whose bits are set
+// in mask, where bit i is pixel x0 + i, against the tile's row of the depth
+// buffer and framebuffer. The row is stored as 8-pixel spans, span s of it
+// at zrow + s * span_stride and prow + s * span_stride. Fragments all pass if
+// visible is set. Returns the mask of fragments that were written. Every
+// attribute is evaluated as its value at x0 plus its slope times i, 8 pixels
+// at a time where the CPU allows, so each varying costs the same per pixel.
+using ShadeRowKernel = u64 (*)(const Interpolants &p, i32 x0, i32 y, u64 mask, bool visible, f32 *zrow,
+                               u32 *prow, u32 span_stride);
+
+// A pixel as the framebuffer stores it, in the low 24 bits of a u32.
+static u32 pack_pixel(Pixel p) {
+  return p.b | p.g << 8 | p.r << 16;
+}
+
+static Pixel shade_textured_fragment(const Interpolants &p, const f32 *varyings) {
+  f32 bgr[3];
+  sample_bilinear(p.texture->levels[p.level], varyings[VARYING_U], varyings[VARYING_V], bgr);
+  if (p.level_blend > 0.0f) {
+    f32 next[3];
+    sample_bilinear(p.texture->levels[p.level + 1], varyings[VARYING_U], varyings[VARYING_V], next);
+    for (u32 c = 0; c < 3; c++) {
+      bgr[c] += (next[c] - bgr[c]) * p.level_blend;
+    }
+  }
+  return modulate(bgr[0], bgr[1], bgr[2], varyings[VARYING_INTENSITY]);
+}
+
+static Pixel shade_fragment(const Interpolants &p, const f32 *varyings) {
+  if (p.texture) {
+    return shade_textured_fragment(p, varyings);
+  }
+  if (!p.varying_count) {
+    return p.color;
+  }
+  u8 I = min(max(varyings[VARYING_INTENSITY] * 255.0f, 0.0f), 255.0f);
+  return {I, I, I};
+}
+
+EXACT_MATH
+static u64 shade_row_scalar(const Interpolants &p, i32 x0, i32 y, u64 mask, bool visible, f32 *zrow,
+                            u32 *prow, u32 span_stride) {
+  f32 z_row = p.z.at(x0, y);
+  f32 inv_w_row = p.inv_w.at(x0, y);
+  f32 varying_rows[MAX_VARYINGS];
+  for (u32 k = 0; k < p.varying_count; k++) {
+    varying_rows[k] = p.varyings[k].at(x0, y);
+  }
+  u64 written = 0;
+  for (; mask; mask &= mask - 1) {
+    u32 i = __builtin_ctzll(mask);
+    u32 at = i / 8 * span_stride + i % 8;
+    f32 z = z_row + p.z.a * f32(i);
+    if (!visible && !(z < zrow[at])) {
+      continue;
+    }
+    f32 varyings[MAX_VARYINGS];
+    if (p.varying_count) {
+      f32 w = 1.0f / (inv_w_row + p.inv_w.a * f32(i));
+      for (u32 k = 0; k < p.varying_count; k++) {
+        varyings[k] = (varying_rows[k] + p.varyings[k].a * f32(i)) * w;
+      }
+    }
+    zrow[at] = z;
+    prow[at] = pack_pixel(shade_fragment(p, varyings));
+    written |= u64(1) << i;
+  }
+  return written;
+}
+
+static u64 span_mask(Bounds bounds) {
+  u32 n = bounds.x_max - bounds.x_min + 1;
+  assert(n <= 64);
+  return n == 64 ? ~u64(0) : (u64(1) << n) - 1;
+}
+
+#if defined(__x86_64__)
+static void coverage_sse(const EdgeFunctions &e, Bounds bounds, u64 *rows) {
+  u32 spans = (bounds.x_max - bounds.x_min + 8) / 8;
+  u64 valid = span_mask(bounds);
+  __m128 lane = _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f);
+  __m128 zero = _mm_setzero_ps();
+  __m128 row[3], step_x[3], step_y[3];
+  for (u32 i = 0; i < 3; i++) {
+    __m128 a = _mm_set1_ps(e.a[i]);
+    row[i] = _mm_add_ps(_mm_set1_ps(e.at(i, bounds.x_min, bounds.y_min)), _mm_mul_ps(a, lane));
+    step_x[i] = _mm_mul_ps(a, _mm_set1_ps(4.0f));
+    step_y[i] = _mm_set1_ps(e.b[i]);
+  }
+  for (i32 y = bounds.y_min; y <= bounds.y_max; y++) {
+    __m128 w0 = row[0], w1 = row[1], w2 = row[2];
+    u64 mask = 0;
+    for (u32 s = 0; s < spans * 2; s++) {
+      __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(w0, zero), _mm_cmpge_ps(w1, zero)),
+                                 _mm_cmpge_ps(w2, zero));
+      mask |= u64(_mm_movemask_ps(inside)) << (s * 4);
+      w0 = _mm_add_ps(w0, step_x[0]);
+      w1 = _mm_add_ps(w1, step_x[1]);
+      w2 = _mm_add_ps(w2, step_x[2]);
+    }
+    rows[y - bounds.y_min] = mask & valid;
+    for (u32 i = 0; i < 3; i++) {
+      row[i] = _mm_add_ps(row[i], step_y[i]);
+    }
+  }
+}
+
+__attribute__((target("avx2")))
+static void coverage_avx2(const EdgeFunctions &e, Bounds bounds, u64 *rows) {
+  u32 spans = (bounds.x_max - bounds.x_min + 8) / 8;
+  u64 valid = span_mask(bounds);
+  __m256 lane = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+  __m256 zero = _mm256_setzero_ps();
+  __m256 row[3], step_x[3], step_y[3];
+  for (u32 i = 0; i < 3; i++) {
+    __m256 a = _mm256_set1_ps(e.a[i]);
+    row[i] = _mm256_add_ps(_mm256_set1_ps(e.at(i, bounds.x_min, bounds.y_min)), _mm256_mul_ps(a, lane));
+    step_x[i] = _mm256_mul_ps(a, _mm256_set1_ps(8.0f));
+    step_y[i] = _mm256_set1_ps(e.b[i]);
+  }
+  for (i32 y = bounds.y_min; y <= bounds.y_max; y++) {
+    __m256 w0 = row[0], w1 = row[1], w2 = row[2];
+    u64 mask = 0;
+    for (u32 s = 0; s < spans; s++) {
+      __m256 inside = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(w0, zero, _CMP_GE_OQ),
+                                                  _mm256_cmp_ps(w1, zero, _CMP_GE_OQ)),
+                                    _mm256_cmp_ps(w2, zero, _CMP_GE_OQ));
+      mask |= u64(_mm256_movemask_ps(inside)) << (s * 8);
+      w0 = _mm256_add_ps(w0, step_x[0]);
+      w1 = _mm256_add_ps(w1, step_x[1]);
+      w2 = _mm256_add_ps(w2, step_x[2]);
+    }
+    rows[y - bounds.y_min] = mask & valid;
+    for (u32 i = 0; i < 3; i++) {
+      row[i] = _mm256_add_ps(row[i], step_y[i]);
+    }
+  }
+}
+
+static void fixed_coverage_sse(const FixedEdgeFunctions &e, Bounds bounds, u64 *rows) {
+  i32 c[3], a[3], b[3];
+  if (!e.relative_to(bounds, c, a, b)) {
+    memset(rows, 0, (bounds.y_max - bounds.y_min + 1) * sizeof(u64));
+    return;
+  }
+  u32 spans = (bounds.x_max - bounds.x_min + 8) / 8;
+  u64 valid = span_mask(bounds);
+  __m128i row[3], step_x[3], step_y[3];
+  for (u32 i = 0; i < 3; i++) {
+    // a * lane, without SSE4.1's mullo.
+    __m128i offsets = _mm_setr_epi32(0, a[i], 2 * a[i], 3 * a[i]);
+    row[i] = _mm_add_epi32(_mm_set1_epi32(c[i]), offsets);
+    step_x[i] = _mm_set1_epi32(4 * a[i]);
+    step_y[i] = _mm_set1_epi32(b[i]);
+  }
+  for (i32 y = bounds.y_min; y <= bounds.y_max; y++) {
+    __m128i w0 = row[0], w1 = row[1], w2 = row[2];
+    u64 mask = 0;
+    for (u32 s = 0; s < spans * 2; s++) {
+      // Inside if no sign bit is set.
+      __m128i any = _mm_or_si128(_mm_or_si128(w0, w1), w2);
+      mask |= u64(~_mm_movemask_ps(_mm_castsi128_ps(any)) & 0xF) << (s * 4);
+      w0 = _mm_add_epi32(w0, step_x[0]);
+      w1 = _mm_add_epi32(w1, step_x[1]);
+      w2 = _mm_add_epi32(w2, step_x[2]);
+    }
+    rows[y - bounds.y_min] = mask & valid;
+    for (u32 i = 0; i < 3; i++) {
+      row[i] = _mm_add_epi32(row[i], step_y[i]);
+    }
+  }
+}
+
+__attribute__((target("avx2")))
+static void fixed_coverage_avx2(const FixedEdgeFunctions &e, Bounds bounds, u64 *rows) {
+  i32 c[3], a[3], b[3];
+  if (!e.relative_to(bounds, c, a, b)) {
+    memset(rows, 0, (bounds.y_max - bounds.y_min + 1) * sizeof(u64));
+    return;
+  }
+  u32 spans = (bounds.x_max - bounds.x_min + 8) / 8;
+  u64 valid = span_mask(bounds);
+  __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i row[3], step_x[3], step_y[3];
+  for (u32 i = 0; i < 3; i++) {
+    __m256i step = _mm256_set1_epi32(a[i]);
+    row[i] = _mm256_add_epi32(_mm256_set1_epi32(c[i]), _mm256_mullo_epi32(step, lane));
+    step_x[i] = _mm256_slli_epi32(step, 3);
+    step_y[i] = _mm256_set1_epi32(b[i]);
+  }
+  for (i32 y = bounds.y_min; y <= bounds.y_max; y++) {
+    __m256i w0 = row[0], w1 = row[1], w2 = row[2];
+    u64 mask = 0;
+    for (u32 s = 0; s < spans; s++) {
+      // Inside if no sign bit is set.
+      __m256i any = _mm256_or_si256(_mm256_or_si256(w0, w1), w2);
+      mask |= u64(~_mm256_movemask_ps(_mm256_castsi256_ps(any)) & 0xFF) << (s * 8);
+      w0 = _mm256_add_epi32(w0, step_x[0]);
+      w1 = _mm256_add_epi32(w1, step_x[1]);
+      w2 = _mm256_add_epi32(w2, step_x[2]);
+    }
+    rows[y - bounds.y_min] = mask & valid;
+    for (u32 i = 0; i < 3; i++) {
+      row[i] = _mm256_add_epi32(row[i], step_y[i]);
+    }
+  }
+}
+
+__attribute__((target("avx2"))) EXACT_MATH
+static u64 shade_row_avx2(const Interpolants &p, i32 x0, i32 y, u64 mask, bool visible, f32 *zrow,
+                          u32 *prow, u32 span_stride) {
+  const __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  __m256 z_row = _mm256_set1_ps(p.z.at(x0, y));
+  __m256 z_a = _mm256_set1_ps(p.z.a);
+  __m256 inv_w_row = _mm256_set1_ps(p.inv_w.at(x0, y));
+  __m256 inv_w_a = _mm256_set1_ps(p.inv_w.a);
+  __m256 varying_rows[MAX_VARYINGS], varying_a[MAX_VARYINGS];
+  for (u32 k = 0; k < p.varying_count; k++) {
+    varying_rows[k] = _mm256_set1_ps(p.varyings[k].at(x0, y));
+    varying_a[k] = _mm256_set1_ps(p.varyings[k].a);
+  }
+
+  u64 written = 0;
+  __m256 index = _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f);
+  for (u32 s = 0; s < TILE_SIZE / 8; s++, index = _mm256_add_ps(index, _mm256_set1_ps(8.0f))) {
+    u32 bits = (mask >> (s * 8)) & 0xFF;
+    if (!bits) {
+      continue;
+    }
+    __m256i covered = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(bits), lane_bits), lane_bits);
+    // Spans start on 32-byte boundaries in both layouts.
+    f32 *zspan = &zrow[s * span_stride];
+    u32 *pspan = &prow[s * span_stride];
+    __m256 z = _mm256_add_ps(z_row, _mm256_mul_ps(z_a, index));
+    __m256 pass = _mm256_castsi256_ps(covered);
+    if (!visible) {
+      pass = _mm256_and_ps(pass, _mm256_cmp_ps(z, _mm256_load_ps(zspan), _CMP_LT_OQ));
+    }
+    u32 passed = _mm256_movemask_ps(pass);
+    if (!passed) {
+      continue;
+    }
+    _mm256_maskstore_ps(zspan, _mm256_castps_si256(pass), z);
+    written |= u64(passed) << (s * 8);
+
+    // Every pixel's color, packed like pack_pixel, shaded like shade_fragment
+    // does it but without calling out of AVX2 code.
+    __m256i colors;
+    __m256 v[MAX_VARYINGS];
+    if (p.varying_count) {
+      __m256 w = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_add_ps(inv_w_row, _mm256_mul_ps(inv_w_a, index)));
+      for (u32 k = 0; k < p.varying_count; k++) {
+        v[k] = _mm256_mul_ps(_mm256_add_ps(varying_rows[k], _mm256_mul_ps(varying_a[k], index)), w);
+      }
+    }
+    if (p.texture) {
+      __m256 bgr[3];
+      sample_bilinear_avx2(p.texture->levels[p.level], v[VARYING_U], v[VARYING_V], bgr);
+      if (p.level_blend > 0.0f) {
+        __m256 next[3];
+        __m256 blend = _mm256_set1_ps(p.level_blend);
+        sample_bilinear_avx2(p.texture->levels[p.level + 1], v[VARYING_U], v[VARYING_V], next);
+        for (u32 c = 0; c < 3; c++) {
+          bgr[c] = _mm256_add_ps(bgr[c], _mm256_mul_ps(_mm256_sub_ps(next[c], bgr[c]), blend));
+        }
+      }
+      colors = _mm256_setzero_si256();
+      for (u32 c = 0; c < 3; c++) {
+        __m256 scaled = _mm256_mul_ps(bgr[c], v[VARYING_INTENSITY]);
+        scaled = _mm256_min_ps(_mm256_max_ps(scaled, _mm256_setzero_ps()), _mm256_set1_ps(255.0f));
+        colors = _mm256_or_si256(colors, _mm256_slli_epi32(_mm256_cvttps_epi32(scaled), c * 8));
+      }
+    } else if (p.varying_count) {
+      __m256 scaled = _mm256_mul_ps(v[VARYING_INTENSITY], _mm256_set1_ps(255.0f));
+      scaled = _mm256_min_ps(_mm256_max_ps(scaled, _mm256_setzero_ps()), _mm256_set1_ps(255.0f));
+      colors = _mm256_mullo_epi32(_mm256_cvttps_epi32(scaled), _mm256_set1_epi32(0x010101));
+    } else {
+      colors = _mm256_set1_epi32(pack_pixel(p.color));
+    }
+    _mm256_maskstore_epi32(reinterpret_cast<int *>(pspan), _mm256_castps_si256(pass), colors);
+  }
+  return written;
+}
+#endif
+
+// Whether to rasterize with FixedEdgeFunctions instead of EdgeFunctions.
+static bool g_fixed_point = true;
+// Whether to interpolate lighting from vertex normals instead of shading
+// each face with its own normal.
+static bool g_smooth_shading = true;
+// Which level of detail of a mesh to draw, or LOD_AUTO to pick one by how
+// large the mesh is on screen.
+constexpr u32 LOD_AUTO = UINT32_MAX;
+static u32 g_lod = 0;
+
+// Side length of a hierarchical-Z block, in pixels. A tile row mask holds one
+// block per byte.
+constexpr u32 HIZ_BLOCK_SIZE = 8;
+constexpr u32 HIZ_BLOCKS = TILE_SIZE / HIZ_BLOCK_SIZE;
+
+// Conservative depth bounds of a tile and of the 8x8 blocks within it. Every
+// depth stored in a block lies within [zmin, zmax] of that block; smaller
+// depths are closer.
+struct alignas(64) TileDepth {
+  f32 zmin;
+  f32 zmax;
+  f32 block_zmin[HIZ_BLOCKS][HIZ_BLOCKS];
+  f32 block_zmax[HIZ_BLOCKS][HIZ_BLOCKS];
+};
+
+// Bits of a clip-space position's outcode, set for each plane it's outside.
+// Visible positions have -w <= x, y, z <= w.
+enum : u16 {
+  CLIP_LEFT = 1 << 0,
+  CLIP_RIGHT = 1 << 1,
+  CLIP_BOTTOM = 1 << 2,
+  CLIP_TOP = 1 << 3,
+  CLIP_NEAR = 1 << 4,
+  CLIP_FAR = 1 << 5,
+  GUARD_LEFT = 1 << 6,
+  GUARD_RIGHT = 1 << 7,
+  GUARD_BOTTOM = 1 << 8,
+  GUARD_TOP = 1 << 9,
+
+  // A face is invisible if all its corners are outside one of these.
+  CLIP_FRUSTUM = CLIP_LEFT | CLIP_RIGHT | CLIP_BOTTOM | CLIP_TOP | CLIP_NEAR | CLIP_FAR,
+  // A face has to be clipped if any of its corners are outside one of these.
+  CLIP_NEEDED = CLIP_NEAR | CLIP_FAR | GUARD_LEFT | GUARD_RIGHT | GUARD_BOTTOM | GUARD_TOP,
+};
+
+// Triangles only need clipping once they reach this many pixels past the
+// edge of the screen; the rasterizer clamps anything closer to the screen.
+// Beyond it, screen coordinates get large enough to lose precision.
+constexpr f32 GUARD_BAND = 4096.0f;
+
+// Maps clip space to the screen.
+struct Viewport {
+  f32 scale_x, scale_y;
+  // The guard band as a multiple of w, so x is inside it when
+  // -guard_x * w <= x <= guard_x * w.
+  f32 guard_x, guard_y;
+  // Whether to snap screen positions to the sub-pixel grid.
+  bool snap;
+
+  f32x3 to_screen(f32x4 c) const {
+    f32x3 p = {(c.x / c.w + 1.0f) * scale_x, (c.y / c.w + 1.0f) * scale_y, c.z / c.w};
+    return snap ? snap_to_subpixel(p) : p;
+  }
+
+  u16 outcode(f32x4 c) const {
+    u16 code = 0;
+    code |= c.x < -c.w ? CLIP_LEFT : 0;
+    code |= c.x > c.w ? CLIP_RIGHT : 0;
+    code |= c.y < -c.w ? CLIP_BOTTOM : 0;
+    code |= c.y > c.w ? CLIP_TOP : 0;
+    code |= c.z < -c.w ? CLIP_NEAR : 0;
+    code |= c.z > c.w ? CLIP_FAR : 0;
+    code |= c.x < -guard_x * c.w ? GUARD_LEFT : 0;
+    code |= c.x > guard_x * c.w ? GUARD_RIGHT : 0;
+    code |= c.y < -guard_y * c.w ? GUARD_BOTTOM : 0;
+    code |= c.y > guard_y * c.w ? GUARD_TOP : 0;
+    return code;
+  }
+};
+
+enum class FramebufferLayout {
+  // Rows one after another, each padded to a whole number of tiles.
+  Linear,
+  // Each tile in one piece, as 8x8 blocks in row-major order that are
+  // row-major inside. A tile's rows of 8 pixels are then aligned 32-byte spans
+  // and its blocks whole cache lines.
+  Tiled,
+};
+
+static FramebufferLayout g_framebuffer_layout = FramebufferLayout::Tiled;
+
+// Vertex positions in screen coordinates, as a structure of arrays so they
+// can be transformed 8 at a time, with their outcodes.
+struct ScreenVertices {
+  f32 *x;
+  f32 *y;
+  f32 *z;
+  f32 *inv_w;
+  u16 *outcodes;
+
+  f32x3 operator[](u32 i) const {
+    return {x[i], y[i], z[i]};
+  }
+};
+
+// Transforms vertices [begin, end) to clip space and then to the screen.
+using TransformKernel = void (*)(const f32x3 *v, u32 begin, u32 end, const Mat4 &m, Viewport viewport,
+                                 ScreenVertices out);
+
+static void transform_vertices_scalar(const f32x3 *v, u32 begin, u32 end, const Mat4 &m,
+                                      Viewport viewport, ScreenVertices out) {
+  for (u32 i = begin; i < end; i++) {
+    f32x4 c = m * v[i];
+    f32x3 p = viewport.to_screen(c);
+    out.x[i] = p.x;
+    out.y[i] = p.y;
+    out.z[i] = p.z;
+    out.inv_w[i] = 1.0f / c.w;
+    out.outcodes[i] = viewport.outcode(c);
+  }
+}
+
+// The direction the default spotlight shines in, down the view direction.
+static constexpr f32x3 SPOTLIGHT = {0.0f, 0.0f, -1.0f};
+
+// Computes the intensity of faces [begin, end) lit by a spotlight shining in
+// the unit direction light from their world space normals, or 0 for faces
+// that point away from it.
+using ShadeFacesKernel = void (*)(const Obj &obj, u32 begin, u32 end, f32x3 light, f32 *intensities);
+
+EXACT_MATH
+static void shade_faces_scalar(const Obj &obj, u32 begin, u32 end, f32x3 light, f32 *intensities) {
+  for (u32 i = begin; i < end; i++) {
+    u16x3 f = obj.faces[i];
+    f32x3 a = obj.vertices[f.x];
+    f32x3 ab = obj.vertices[f.y] - a;
+    f32x3 ac = obj.vertices[f.z] - a;
+    // Points into the back of the face, so I = dot(n / |n|, light).
+    f32x3 n = cross(ac, ab);
+    f32 length_squared = dot(n, n);
+    f32 d = dot(n, light);
+    bool lit = d > 0.0f && length_squared > 0.0f;
+    intensities[i] = lit ? d * (1.0f / sqrtf(length_squared)) : 0.0f;
+  }
+}
+
+#if __x86_64__
+// Transforms 8 vertices at a time, and the rest like the scalar version.
+__attribute__((target("avx2"))) EXACT_MATH
+static void transform_vertices_avx2(const f32x3 *v, u32 begin, u32 end, const Mat4 &m,
+                                   Viewport viewport, ScreenVertices out) {
+  const __m256i index = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 scale_x = _mm256_set1_ps(viewport.scale_x);
+  const __m256 scale_y = _mm256_set1_ps(viewport.scale_y);
+  const __m256 guard_x = _mm256_set1_ps(viewport.guard_x);
+  const __m256 guard_y = _mm256_set1_ps(viewport.guard_y);
+  const __m256 sign = _mm256_set1_ps(-0.0f);
+  const __m256 subpixel = _mm256_set1_ps(SUBPIXEL_SCALE);
+  u32 i = begin;
+  for (; i + 8 <= end; i += 8) {
+    const f32 *p = &v[i].x;
+    __m256 x = _mm256_i32gather_ps(p + 0, index, 4);
+    __m256 y = _mm256_i32gather_ps(p + 1, index, 4);
+    __m256 z = _mm256_i32gather_ps(p + 2, index, 4);
+    __m256 c[4];
+    for (u32 r = 0; r < 4; r++) {
+      c[r] = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(m.m[r][0]), x),
+                           _mm256_mul_ps(_mm256_set1_ps(m.m[r][1]), y));
+      c[r] = _mm256_add_ps(c[r], _mm256_mul_ps(_mm256_set1_ps(m.m[r][2]), z));
+      c[r] = _mm256_add_ps(c[r], _mm256_set1_ps(m.m[r][3]));
+    }
+    __m256 w = c[3];
+    __m256 sx = _mm256_mul_ps(_mm256_add_ps(_mm256_div_ps(c[0], w), one), scale_x);
+    __m256 sy = _mm256_mul_ps(_mm256_add_ps(_mm256_div_ps(c[1], w), one), scale_y);
+    if (viewport.snap) {
+      constexpr int nearest = _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC;
+      sx = _mm256_div_ps(_mm256_round_ps(_mm256_mul_ps(sx, subpixel), nearest), subpixel);
+      sy = _mm256_div_ps(_mm256_round_ps(_mm256_mul_ps(sy, subpixel), nearest), subpixel);
+    }
+    _mm256_storeu_ps(&out.x[i], sx);
+    _mm256_storeu_ps(&out.y[i], sy);
+    _mm256_storeu_ps(&out.z[i], _mm256_div_ps(c[2], w));
+    _mm256_storeu_ps(&out.inv_w[i], _mm256_div_ps(one, w));
+
+    __m256 negative_w = _mm256_xor_ps(w, sign);
+    __m256 gx = _mm256_mul_ps(guard_x, w);
+    __m256 gy = _mm256_mul_ps(guard_y, w);
+    __m256 outside[] = {
+      _mm256_cmp_ps(c[0], negative_w, _CMP_LT_OQ),
+      _mm256_cmp_ps(c[0], w, _CMP_GT_OQ),
+      _mm256_cmp_ps(c[1], negative_w, _CMP_LT_OQ),
+      _mm256_cmp_ps(c[1], w, _CMP_GT_OQ),
+      _mm256_cmp_ps(c[2], negative_w, _CMP_LT_OQ),
+      _mm256_cmp_ps(c[2], w, _CMP_GT_OQ),
+      _mm256_cmp_ps(c[0], _mm256_xor_ps(gx, sign), _CMP_LT_OQ),
+      _mm256_cmp_ps(c[0], gx, _CMP_GT_OQ),
+      _mm256_cmp_ps(c[1], _mm256_xor_ps(gy, sign), _CMP_LT_OQ),
+      _mm256_cmp_ps(c[1], gy, _CMP_GT_OQ),
+    };
+    __m256i codes = _mm256_setzero_si256();
+    for (u32 bit = 0; bit < sizeof(outside) / sizeof(outside[0]); bit++) {
+      __m256i mask = _mm256_and_si256(_mm256_castps_si256(outside[bit]), _mm256_set1_epi32(1 << bit));
+      codes = _mm256_or_si256(codes, mask);
+    }
+    // Narrow to 16 bits; packus works within 128-bit lanes, so put the
+    // results back in order afterwards.
+    __m256i packed = _mm256_packus_epi32(codes, codes);
+    packed = _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(&out.outcodes[i]), _mm256_castsi256_si128(packed));
+  }
+  transform_vertices_scalar(v, i, end, m, viewport, out);
+}
+
+// Shades 8 faces at a time, and the rest like the scalar version. Each
+// operation is the scalar version's, in the same order, so the intensities
+// are the same.
+__attribute__((target("avx2"))) EXACT_MATH
+static void shade_faces_avx2(const Obj &obj, u32 begin, u32 end, f32x3 light, f32 *intensities) {
+  const f32 *vertices = &obj.vertices.data[0].x;
+  const __m256 lx = _mm256_set1_ps(light.x);
+  const __m256 ly = _mm256_set1_ps(light.y);
+  const __m256 lz = _mm256_set1_ps(light.z);
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 zero = _mm256_setzero_ps();
+  u32 i = begin;
+  for (; i + 8 <= end; i += 8) {
+    // Offsets of each corner's x in vertices.
+    alignas(32) i32 corners[3][8];
+    for (u32 j = 0; j < 8; j++) {
+      u16x3 f = obj.faces.data[i + j];
+      corners[0][j] = f.x * 3;
+      corners[1][j] = f.y * 3;
+      corners[2][j] = f.z * 3;
+    }
+    __m256 p[3][3];
+    for (u32 c = 0; c < 3; c++) {
+      __m256i index = _mm256_load_si256(reinterpret_cast<const __m256i *>(corners[c]));
+      for (u32 k = 0; k < 3; k++) {
+        p[c][k] = _mm256_i32gather_ps(vertices + k, index, 4);
+      }
+    }
+    __m256 ab[3], ac[3];
+    for (u32 k = 0; k < 3; k++) {
+      ab[k] = _mm256_sub_ps(p[1][k], p[0][k]);
+      ac[k] = _mm256_sub_ps(p[2][k], p[0][k]);
+    }
+    // n = cross(ac, ab)
+    __m256 nx = _mm256_sub_ps(_mm256_mul_ps(ac[1], ab[2]), _mm256_mul_ps(ac[2], ab[1]));
+    __m256 ny = _mm256_sub_ps(_mm256_mul_ps(ac[2], ab[0]), _mm256_mul_ps(ac[0], ab[2]));
+    __m256 nz = _mm256_sub_ps(_mm256_mul_ps(ac[0], ab[1]), _mm256_mul_ps(ac[1], ab[0]));
+    __m256 length_squared = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, nx), _mm256_mul_ps(ny, ny)),
+                                          _mm256_mul_ps(nz, nz));
+    __m256 r = _mm256_div_ps(one, _mm256_sqrt_ps(length_squared));
+    // Degenerate faces come out as NaN, which max turns into 0 along with
+    // the faces that point away.
+    __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, lx), _mm256_mul_ps(ny, ly)),
+                             _mm256_mul_ps(nz, lz));
+    __m256 I = _mm256_mul_ps(d, r);
+    _mm256_storeu_ps(&intensities[i], _mm256_max_ps(I, zero));
+  }
+  shade_faces_scalar(obj, i, end, light, intensities);
+}
+#endif
+
+// The kernels for one instruction set.
+struct RasterKernels {
+  const char *name;
+  CoverageKernel coverage;
+  FixedCoverageKernel fixed_coverage;
+  ShadeRowKernel shade_row;
+  TransformKernel transform;
+  ShadeFacesKernel shade_faces;
+  bool (*supported)();
+};
+
+static const RasterKernels g_raster_kernels[] = {
+#if defined(__x86_64__)
+  {"avx2", coverage_avx2, fixed_coverage_avx2, shade_row_avx2, transform_vertices_avx2, shade_faces_avx2,
+   [] { return bool(__builtin_cpu_supports("avx2")); }},
+  {"sse", coverage_sse, fixed_coverage_sse, shade_row_scalar, transform_vertices_scalar, shade_faces_scalar,
+   [] { return true; }},
+#endif
+  {"scalar", coverage_scalar, fixed_coverage_scalar, shade_row_scalar, transform_vertices_scalar,
+   shade_faces_scalar, [] { return true; }},
+};
+
+// Picks the named kernels, or the fastest ones the CPU supports if name is null.
+static const RasterKernels *select_raster_kernels(const char *name) {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+#endif
+  for (const RasterKernels &k : g_raster_kernels) {
+    if (name ? strcmp(name, k.name) == 0 : k.supported()) {
+      return k.supported() ? &k : nullptr;
+    }
+  }
+  return nullptr;
+}
+
+static const RasterKernels *g_kernels = &g_raster_kernels[sizeof(g_raster_kernels) / sizeof(g_raster_kernels[0]) - 1];
+
+struct Image {
+  // Packed like pack_pixel, and laid out like zbuffer.
+  u32 *pixels;
+  f32 *zbuffer;
+  TileDepth *tile_depth;
+  u32 width;
+  u32 height;
+  // Pixels per padded row.
+  u32 stride;
+  FramebufferLayout layout;
+
+  static constexpr u32 stride_for(u32 width) {
+    return (width + TILE_SIZE - 1) / TILE_SIZE * TILE_SIZE;
+  }
+
+  static Image allocate(u32 width, u32 height, Arena &arena) {
+    Image image = {nullptr, nullptr, nullptr, width, height, stride_for(width), g_framebuffer_layout};
+    u64 count = image.pixel_count();
+    image.pixels = reinterpret_cast<u32 *>(arena.aligned_alloc(count * sizeof(u32), 64));
+    image.zbuffer = reinterpret_cast<f32 *>(arena.aligned_alloc(count * sizeof(f32), 64));
+    image.tile_depth = arena.alloc_array<TileDepth>(image.tiles_x() * image.tiles_y());
+    image.clear();
+    return image;
+  }
+
+  // Number of pixels stored, including padding to whole tiles.
+  u64 pixel_count() const {
+    return u64(tiles_x()) * tiles_y() * TILE_SIZE * TILE_SIZE;
+  }
+
+  // Where pixel (x, y) is in pixels and zbuffer. For x a multiple of 8, it's
+  // the start of a span of 8 pixels, and the next span in the row is
+  // span_stride() further on.
+  u64 index(u32 x, u32 y) const {
+    if (layout == FramebufferLayout::Linear) {
+      return u64(y) * stride + x;
+    }
+    u64 tile = u64(y / TILE_SIZE) * tiles_x() + x / TILE_SIZE;
+    u32 block = (y % TILE_SIZE / 8) * (TILE_SIZE / 8) + x % TILE_SIZE / 8;
+    return tile * TILE_SIZE * TILE_SIZE + block * 64 + y % 8 * 8 + x % 8;
+  }
+
+  u32 span_stride() const {
+    return layout == FramebufferLayout::Linear ? 8 : 64;
+  }
+
+  void clear() {
+    TRACE_SCOPE("clear");
+    constexpr f32 far = std::numeric_limits<f32>::max();
+    u64 count = pixel_count();
+    memset(pixels, 0, count * sizeof(pixels[0]));
+    for (u64 i = 0; i < count; i++) {
+      zbuffer[i] = far;
+    }
+    for (u32 i = 0; i < tiles_x() * tiles_y(); i++) {
+      TileDepth &d = tile_depth[i];
+      d.zmin = far;
+      d.zmax = far;
+      for (u32 j = 0; j < HIZ_BLOCKS; j++) {
+        for (u32 k = 0; k < HIZ_BLOCKS; k++) {
+          d.block_zmin[j][k] = far;
+          d.block_zmax[j][k] = far;
+        }
+      }
+    }
+  }
+
+  u32 tiles_x() const {
+    return (width + TILE_SIZE - 1) / TILE_SIZE;
+  }
+
+  u32 tiles_y() const {
+    return (height + TILE_SIZE - 1) / TILE_SIZE;
+  }
+
+  Rect tile_rect(u32 tile) const {
+    i32 x0 = tile % tiles_x() * TILE_SIZE;
+    i32 y0 = tile / tiles_x() * TILE_SIZE;
+    i32 x1 = min(x0 + i32(TILE_SIZE), i32(width));
+    i32 y1 = min(y0 + i32(TILE_SIZE), i32(height));
+    return {x0, y0, x1, y1};
+  }
+
+  Pixel at(u32 x, u32 y) const {
+    assert(x < width);
+    assert(y < height);
+    u32 p = pixels[index(x, y)];
+    return {u8(p), u8(p >> 8), u8(p >> 16)};
+  }
+
+  Viewport viewport() const {
+    f32 scale_x = f32(width / 2);
+    f32 scale_y = f32(height / 2);
+    return {scale_x, scale_y, 1.0f + GUARD_BAND / scale_x, 1.0f + GUARD_BAND / scale_y, g_fixed_point};
+  }
+
+  // The pixels within r that a bounding box from min to max touches, empty
+  // if they don't overlap.
+  static Bounds pixel_bounds(f32 min_x, f32 max_x, f32 min_y, f32 max_y, Rect r) {
+    i32 x_min = min(max(min_x, f32(r.x0)), f32(r.x1));
+    i32 y_min = min(max(min_y, f32(r.y0)), f32(r.y1));
+    i32 x_max = floorf(max(min(max_x, f32(r.x1 - 1)), f32(r.x0 - 1)));
+    i32 y_max = floorf(max(min(max_y, f32(r.y1 - 1)), f32(r.y0 - 1)));
+    return {x_min, y_min, x_max, y_max};
+  }
+
+  static Bounds pixel_bounds(f32x3 a, f32x3 b, f32x3 c, Rect r) {
+    f32 min_x = min(min(a.x, b.x), c.x);
+    f32 max_x = max(max(a.x, b.x), c.x);
+    f32 min_y = min(min(a.y, b.y), c.y);
+    f32 max_y = max(max(a.y, b.y), c.y);
+    return pixel_bounds(min_x, max_x, min_y, max_y, r);
+  }
+
+  // Draws the part of triangle t that lies within tile, keeping only the
+  // fragments closer than what is already there, and textured with texture
+  // if t has texture coordinates. Uses the tile's depth bounds to skip the
+  // triangle, or 8x8 blocks of it, without touching the depth buffer when it
+  // is known to be hidden, and to skip depth tests in rows of blocks it is
+  // known to be in front of. Returns the number of fragments that were depth
+  // tested.
+  u32 draw_triangle(const Triangle &t, const Texture *texture, u32 tile) {
+    f32x3 a = t.a, b = t.b, c = t.c;
+    Rect r = tile_rect(tile);
+    TileDepth &depth = tile_depth[tile];
+    f32 tri_zmin = min(min(a.z, b.z), c.z);
+    f32 tri_zmax = max(max(a.z, b.z), c.z);
+    if (tri_zmin >= depth.zmax) {
+      return 0;
+    }
+
+    EdgeFunctions e;
+    FixedEdgeFunctions fixed;
+    if (g_fixed_point) {
+      if (!FixedEdgeFunctions::setup(a, b, c, fixed)) {
+        return 0;
+      }
+      e = fixed.to_float();
+    } else if (!EdgeFunctions::setup(a, b, c, e)) {
+      return 0;
+    }
+    Bounds bounds = pixel_bounds(a, b, c, r);
+    if (bounds.empty()) {
+      return 0;
+    }
+
+    // Coverage, one row per tile row with bit i for tile column i.
+    u64 rows[TILE_SIZE] = {};
+    u32 shift = bounds.x_min - r.x0;
+    if (g_fixed_point) {
+      g_kernels->fixed_coverage(fixed, bounds, &rows[bounds.y_min - r.y0]);
+    } else {
+      g_kernels->coverage(e, bounds, &rows[bounds.y_min - r.y0]);
+    }
+
+    u32 bx0 = (bounds.x_min - r.x0) / HIZ_BLOCK_SIZE;
+    u32 bx1 = (bounds.x_max - r.x0) / HIZ_BLOCK_SIZE;
+    u32 by0 = (bounds.y_min - r.y0) / HIZ_BLOCK_SIZE;
+    u32 by1 = (bounds.y_max - r.y0) / HIZ_BLOCK_SIZE;
+    // Block rows where the whole triangle is closer than every block it
+    // covers, so every fragment passes.
+    u32 visible_rows = 0;
+    for (u32 by = by0; by <= by1; by++) {
+      u64 hidden = 0;
+      bool visible = true;
+      for (u32 bx = bx0; bx <= bx1; bx++) {
+        if (tri_zmin >= depth.block_zmax[by][bx]) {
+          hidden |= u64(0xFF) << (bx * HIZ_BLOCK_SIZE);
+        }
+        visible &= tri_zmax < depth.block_zmin[by][bx];
+      }
+      visible_rows |= visible ? 1 << by : 0;
+      for (u32 i = 0; i < HIZ_BLOCK_SIZE; i++) {
+        u64 &row = rows[by * HIZ_BLOCK_SIZE + i];
+        row = (row << shift) & ~hidden;
+      }
+    }
+
+    Interpolants p = Interpolants::setup(e, t, texture);
+    u64 written_blocks = 0;
+    u32 fragments = 0;
+    for (i32 y = bounds.y_min; y <= bounds.y_max; y++) {
+      u64 mask = rows[y - r.y0];
+      if (!mask) {
+        continue;
+      }
+      fragments += __builtin_popcountll(mask);
+      u64 row = index(r.x0, y);
+      bool visible = (visible_rows >> ((y - r.y0) / HIZ_BLOCK_SIZE)) & 1;
+      u64 written = g_kernels->shade_row(p, r.x0, y, mask, visible, &zbuffer[row], &pixels[row], span_stride());
+      u8 blocks = 0;
+      for (u32 bx = 0; bx < HIZ_BLOCKS; bx++) {
+        blocks |= ((written >> (bx * HIZ_BLOCK_SIZE)) & 0xFF) ? 1 << bx : 0;
+      }
+      written_blocks |= u64(blocks) << ((y - r.y0) / HIZ_BLOCK_SIZE * HIZ_BLOCKS);
+    }
+    if (written_blocks) {
+      update_tile_depth(tile, written_blocks, tri_zmin);
+    }
+    return fragments;
+  }
+
+  // Recomputes the depth bounds of the blocks in tile that have just been
+  // drawn to with depths no less than zmin.
+  void update_tile_depth(u32 tile, u64 blocks, f32 zmin) {
+    Rect r = tile_rect(tile);
+    TileDepth &depth = tile_depth[tile];
+    for (; blocks; blocks &= blocks - 1) {
+      u32 block = __builtin_ctzll(blocks);
+      u32 bx = block % HIZ_BLOCKS;
+      u32 by = block / HIZ_BLOCKS;
+      i32 x0 = r.x0 + bx * HIZ_BLOCK_SIZE;
+      i32 y0 = r.y0 + by * HIZ_BLOCK_SIZE;
+      i32 x1 = min(x0 + i32(HIZ_BLOCK_SIZE), r.x1);
+      i32 y1 = min(y0 + i32(HIZ_BLOCK_SIZE), r.y1);
+      f32 zmax = std::numeric_limits<f32>::lowest();
+      for (i32 y = y0; y < y1; y++) {
+        const f32 *span = &zbuffer[index(x0, y)];
+        for (i32 x = x0; x < x1; x++) {
+          zmax = max(zmax, span[x - x0]);
+        }
+      }
+      depth.block_zmin[by][bx] = min(depth.block_zmin[by][bx], zmin);
+      depth.block_zmax[by][bx] = zmax;
+    }
+
+    // Blocks outside the image never get drawn to, so leave them out.
+    u32 bx_end = (r.x1 - r.x0 + HIZ_BLOCK_SIZE - 1) / HIZ_BLOCK_SIZE;
+    u32 by_end = (r.y1 - r.y0 + HIZ_BLOCK_SIZE - 1) / HIZ_BLOCK_SIZE;
+    f32 zmax = depth.block_zmax[0][0];
+    for (u32 by = 0; by < by_end; by++) {
+      for (u32 bx = 0; bx < bx_end; bx++) {
+        zmax = max(zmax, depth.block_zmax[by][bx]);
+      }
+    }
+    depth.zmin = min(depth.zmin, zmin);
+    depth.zmax = zmax;
+  }
+
+  // Converts row y from the framebuffer's layout to linear BGR.
+  void resolve_row(u32 y, Pixel *out) const {
+    for (u32 x = 0; x < width; x += 8) {
+      const u32 *span = &pixels[index(x, y)];
+      u32 n = min(width - x, 8u);
+      for (u32 i = 0; i < n; i++) {
+        out[x + i] = {u8(span[i]), u8(span[i] >> 8), u8(span[i] >> 16)};
+      }
+    }
+  }
+
+  static constexpr u32 TGA_HEADER_SIZE = 18;
+
+  void encode_tga_header(TgaEncoding encoding, u8 *header) const {
+    bool raw = encoding == TgaEncoding::Raw;
+    bool gray = encoding == TgaEncoding::RleGray;
+    u8 bytes_per_pixel = gray ? 1 : sizeof(Pixel);
+    memset(header, 0, TGA_HEADER_SIZE);
+    header[2] = raw ? 2 : gray ? 11 : 10;
+    header[12] = width & 0xFF;
+    header[13] = (width & 0xFF00) >> 8;
+    header[14] = height & 0xFF;
+    header[15] = (height & 0xFF00) >> 8;
+    header[16] = bytes_per_pixel * 8;
+  }
+
+  // Encodes the image as a TGA file, as a header and one buffer per row.
+  // Rows are resolved to linear BGR, and run-length encoded if asked, in
+  // parallel into buffers from arena.
+  TgaFile encode_tga(TgaEncoding encoding, WorkerPool &pool, Arena &arena) {
+    TRACE_SCOPE("encode_tga");
+    assert(width <= UINT16_MAX);
+    assert(height <= UINT16_MAX);
+
+    bool raw = encoding == TgaEncoding::Raw;
+    bool gray = encoding == TgaEncoding::RleGray;
+    u8 *header = arena.alloc_array<u8>(TGA_HEADER_SIZE);
+    encode_tga_header(encoding, header);
+
+    constexpr u32 ROWS_PER_TASK = 16;
+    iovec *iov = arena.alloc_array<iovec>(height + 1);
+    iov[0] = {header, TGA_HEADER_SIZE};
+    Pixel *resolved = arena.alloc_array<Pixel>(u64(height) * width);
+    u32 row_size = gray ? max_rle_size<u8>(width) : max_rle_size<Pixel>(width);
+    u8 *buffers = raw ? nullptr : arena.alloc_array<u8>(u64(height) * row_size);
+    u8 *luma_rows = gray ? arena.alloc_array<u8>(u64(height) * width) : nullptr;
+    pool.parallel_for((height + ROWS_PER_TASK - 1) / ROWS_PER_TASK, [&](u32 task) {
+      TRACE_SCOPE("encode rows");
+      u32 end = min(height, (task + 1) * ROWS_PER_TASK);
+      for (u32 y = task * ROWS_PER_TASK; y < end; y++) {
+        Pixel *row = &resolved[u64(y) * width];
+        resolve_row(y, row);
+        if (raw) {
+          iov[y + 1] = {row, width * sizeof(Pixel)};
+          continue;
+        }
+        u8 *out = &buffers[u64(y) * row_size];
+        u32 n;
+        if (gray) {
+          u8 *l = &luma_rows[u64(y) * width];
+          for (u32 x = 0; x < width; x++) {
+            l[x] = luma(row[x]);
+          }
+          n = encode_rle_row(l, width, out);
+        } else {
+          n = encode_rle_row(row, width, out);
+        }
+        assert(n <= row_size);
+        iov[y + 1] = {out, n};
+      }
+    });
+
+    return {iov, height + 1};
+  }
+
+  // Writes the image as a TGA file, with a single vectored write.
+  void save_as_tga_file(const char *path, TgaEncoding encoding, OutputSync sync, WorkerPool &pool, Arena &arena) {
+    assert(sync != OutputSync::Msync);
+    TgaFile file = encode_tga(encoding, pool, arena);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      panic("unable to open '%s'", path);
+    }
+    write_iovecs(fd, file.iov, file.count, path);
+    if (sync == OutputSync::Fdatasync && fdatasync(fd) != 0) {
+      panic("unable to sync '%s'", path);
+    }
+    close(fd);
+  }
+
+  // Writes the image as an uncompressed TGA file by sizing the file first and
+  // resolving rows in parallel straight into a shared mapping of it, so the
+  // pixels land in the page cache without a resolved copy or a write.
+  void save_as_mapped_tga_file(const char *path, OutputSync sync, WorkerPool &pool) {
+    TRACE_SCOPE("save_as_mapped_tga_file");
+    u64 size = TGA_HEADER_SIZE + u64(width) * height * sizeof(Pixel);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      panic("unable to open '%s'", path);
+    }
+    // Allocating the blocks up front spares each page a trip through the
+    // filesystem on its first write fault, and a SIGBUS if the disk fills.
+    if (int error = posix_fallocate(fd, 0, size); error != 0) {
+      errno = error;
+      panic("unable to allocate '%s'", path);
+    }
+    void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+      panic("unable to mmap '%s'", path);
+    }
+
+    u8 *file = static_cast<u8 *>(addr);
+    encode_tga_header(TgaEncoding::Raw, file);
+    Pixel *rows = reinterpret_cast<Pixel *>(file + TGA_HEADER_SIZE);
+    constexpr u32 ROWS_PER_TASK = 16;
+    pool.parallel_for((height + ROWS_PER_TASK - 1) / ROWS_PER_TASK, [&](u32 task) {
+      TRACE_SCOPE("resolve rows");
+      u32 end = min(height, (task + 1) * ROWS_PER_TASK);
+      for (u32 y = task * ROWS_PER_TASK; y < end; y++) {
+        resolve_row(y, &rows[u64(y) * width]);
+      }
+    });
+
+    if (sync == OutputSync::Msync && msync(addr, size, MS_SYNC) != 0) {
+      panic("unable to msync '%s'", path);
+    }
+    if (munmap(addr, size) != 0) {
+      panic("unable to munmap '%s'", path);
+    }
+    if (sync == OutputSync::Fdatasync && fdatasync(fd) != 0) {
+      panic("unable to sync '%s'", path);
+    }
+    close(fd);
+  }
+
+  void save(const char *path, TgaEncoding encoding, OutputMode mode, OutputSync sync, WorkerPool &pool,
+            Arena &arena) {
+    if (mode == OutputMode::Mmap) {
+      assert(encoding == TgaEncoding::Raw);
+      save_as_mapped_tga_file(path, sync, pool);
+    } else {
+      save_as_tga_file(path, encoding, sync, pool, arena);
+    }
+  }
+};
+
+// Transforms every vertex of obj once, in parallel.
+static ScreenVertices transform_vertices(const Image &image, const Obj &obj, const Mat4 &view_projection,
+                                         WorkerPool &pool, Arena &arena) {
+  TRACE_SCOPE("transform_vertices");
+  constexpr u32 VERTICES_PER_TASK = 16384;
+  u32 count = obj.vertices.count;
+  ScreenVertices out;
+  out.x = reinterpret_cast<f32 *>(arena.aligned_alloc(count * sizeof(f32), 64));
+  out.y = reinterpret_cast<f32 *>(arena.aligned_alloc(count * sizeof(f32), 64));
+  out.z = reinterpret_cast<f32 *>(arena.aligned_alloc(count * sizeof(f32), 64));
+  out.inv_w = reinterpret_cast<f32 *>(arena.aligned_alloc(count * sizeof(f32), 64));
+  out.outcodes = reinterpret_cast<u16 *>(arena.aligned_alloc(count * sizeof(u16), 64));
+  Viewport viewport = image.viewport();
+  pool.parallel_for((count + VERTICES_PER_TASK - 1) / VERTICES_PER_TASK, [&](u32 task) {
+    TRACE_SCOPE("transform task");
+    u32 begin = task * VERTICES_PER_TASK;
+    u32 end = min(count, begin + VERTICES_PER_TASK);
+    g_kernels->transform(obj.vertices.data, begin, end, view_projection, viewport, out);
+  });
+  return out;
+}
+
+// Computes the intensity at each of the normals of obj lit by a spotlight
+// shining in the unit direction light, in parallel.
+static void shade_normals(const Obj &obj, f32x3 light, WorkerPool &pool, f32 *intensities) {
+  TRACE_SCOPE("shade_normals");
+  constexpr u32 NORMALS_PER_TASK = 16384;
+  u32 count = obj.normals.count;
+  pool.parallel_for((count + NORMALS_PER_TASK - 1) / NORMALS_PER_TASK, [&](u32 task) {
+    u32 begin = task * NORMALS_PER_TASK;
+    u32 end = min(count, begin + NORMALS_PER_TASK);
+    for (u32 i = begin; i < end; i++) {
+      f32x3 n = obj.normals.data[i];
+      f32 length_squared = dot(n, n);
+      // Normals point out of the front of faces, so I = dot(n / |n|, -light).
+      f32 d = -dot(n, light);
+      bool lit = d > 0.0f && length_squared > 0.0f;
+      intensities[i] = lit ? d * (1.0f / sqrtf(length_squared)) : 0.0f;
+    }
+  });
+}
+
+// A polygon vertex in clip space, with the varyings of the triangle at it.
+struct ClipVertex {
+  f32x4 position;
+  f32 varyings[MAX_VARYINGS];
+};
+
+// Clips the convex polygon v[0, n) to the side of plane where dot(plane, v) >= 0,
+// interpolating the first varying_count varyings along with the positions.
+// Returns the number of vertices written to out, at most n + 1.
+static u32 clip_polygon(const ClipVertex *v, u32 n, f32x4 plane, u32 varying_count, ClipVertex *out) {
+  u32 count = 0;
+  for (u32 i = 0; i < n; i++) {
+    const ClipVertex &a = v[i];
+    const ClipVertex &b = v[i + 1 < n ? i + 1 : 0];
+    f32 da = dot(plane, a.position);
+    f32 db = dot(plane, b.position);
+    if (da >= 0.0f) {
+      out[count++] = a;
+    }
+    if ((da >= 0.0f) != (db >= 0.0f)) {
+      f32 t = da / (da - db);
+      ClipVertex &c = out[count++];
+      c.position = lerp(a.position, b.position, t);
+      for (u32 k = 0; k < varying_count; k++) {
+        c.varyings[k] = a.varyings[k] + (b.varyings[k] - a.varyings[k]) * t;
+      }
+    }
+  }
+  return count;
+}
+
+// Clipping against all six planes of CLIP_NEEDED turns a triangle into a
+// polygon of at most 9 vertices, which is a fan of at most 7 triangles.
+constexpr u32 MAX_CLIPPED_TRIANGLES = 7;
+
+// Clips face f to the near and far planes and whichever sides of the guard
+// band its corners are outside of. Writes the pieces to out, in screen
+// coordinates and shaded like shaded, and returns how many there are.
+static u32 clip_face(const Obj &obj, u16x3 f, u16 outcodes, const Mat4 &m, Viewport viewport,
+                     const Triangle &shaded, Triangle *out) {
+  const struct {
+    u16 bit;
+    f32x4 plane;
+  } planes[] = {
+    {CLIP_NEAR, {0.0f, 0.0f, 1.0f, 1.0f}},
+    {CLIP_FAR, {0.0f, 0.0f, -1.0f, 1.0f}},
+    {GUARD_LEFT, {1.0f, 0.0f, 0.0f, viewport.guard_x}},
+    {GUARD_RIGHT, {-1.0f, 0.0f, 0.0f, viewport.guard_x}},
+    {GUARD_BOTTOM, {0.0f, 1.0f, 0.0f, viewport.guard_y}},
+    {GUARD_TOP, {0.0f, -1.0f, 0.0f, viewport.guard_y}},
+  };
+
+  ClipVertex polygons[2][MAX_CLIPPED_TRIANGLES + 2];
+  ClipVertex *v = polygons[0];
+  ClipVertex *scratch = polygons[1];
+  u16 corners[3] = {f.x, f.y, f.z};
+  for (u32 i = 0; i < 3; i++) {
+    v[i].position = m * obj.vertices[corners[i]];
+    memcpy(v[i].varyings, shaded.varyings[i], sizeof(v[i].varyings));
+  }
+  u32 n = 3;
+  for (const auto &p : planes) {
+    if (outcodes & p.bit) {
+      n = clip_polygon(v, n, p.plane, shaded.varying_count, scratch);
+      ClipVertex *t = v;
+      v = scratch;
+      scratch = t;
+    }
+  }
+  if (n < 3) {
+    return 0;
+  }
+
+  for (u32 i = 2; i < n; i++) {
+    Triangle &t = out[i - 2];
+    const ClipVertex *fan[3] = {&v[0], &v[i - 1], &v[i]};
+    t = shaded;
+    t.a = viewport.to_screen(fan[0]->position);
+    t.b = viewport.to_screen(fan[1]->position);
+    t.c = viewport.to_screen(fan[2]->position);
+    for (u32 j = 0; j < 3; j++) {
+      t.inv_w[j] = 1.0f / fan[j]->position.w;
+      memcpy(t.varyings[j], fan[j]->varyings, sizeof(t.varyings[j]));
+    }
+  }
+  return n - 2;
+}
+
+// Lights the corners of face i of obj, setting the color and varyings of t.
+// Smooth shading interpolates the intensities of the corners' normals, or
+// uses the face's own where a corner has none. Textured faces also get their
+// corners' texture coordinates, and always interpolate the intensity.
+static void shade_triangle(const Obj &obj, u32 i, const f32 *face_intensities,
+                           const f32 *normal_intensities, bool textured, Triangle &t) {
+  f32 I = face_intensities[i];
+  u8 p = I * 255.0f;
+  t.color = {p, p, p};
+  t.varying_count = 0;
+  if (normal_intensities) {
+    u16x3 n = obj.face_normals[i];
+    u16 corners[3] = {n.x, n.y, n.z};
+    for (u32 j = 0; j < 3; j++) {
+      t.varyings[j][VARYING_INTENSITY] = corners[j] == NO_INDEX ? I : normal_intensities[corners[j]];
+    }
+    t.varying_count = VARYING_INTENSITY + 1;
+  }
+  if (textured) {
+    u16x3 uv = obj.face_texcoords[i];
+    u16 corners[3] = {uv.x, uv.y, uv.z};
+    for (u32 j = 0; j < 3; j++) {
+      if (!normal_intensities) {
+        t.varyings[j][VARYING_INTENSITY] = I;
+      }
+      f32x2 texcoord = corners[j] == NO_INDEX ? f32x2{0.0f, 0.0f} : obj.texcoords[corners[j]];
+      t.varyings[j][VARYING_U] = texcoord.x;
+      t.varyings[j][VARYING_V] = texcoord.y;
+    }
+    t.varying_count = VARYING_V + 1;
+  }
+}
+
+// Faces are front facing when they wind counterclockwise on the screen. The
+// test is exact for positions snapped to the sub-pixel grid, so it agrees
+// with FixedEdgeFunctions about which triangles have no area.
+static bool is_front_facing(f32x3 a, f32x3 b, f32x3 c) {
+  return (f64(b.x) - a.x) * (f64(c.y) - a.y) - (f64(b.y) - a.y) * (f64(c.x) - a.x) > 0.0;
+}
+
+// Faces binned into per-tile lists, ready to rasterize. Each tile's list
+// preserves face order, so the result is identical to drawing the faces one
+// after another.
+struct Bins {
+  // Shaded triangles in screen coordinates. The first obj.faces.count are
+  // indexed like obj.faces, and the pieces of clipped faces come after them.
+  // Only the ones listed in some tile are initialized.
+  Triangle *triangles;
+  // Tile t draws triangles[tile_triangles[i]] for i in [tile_starts[t], tile_starts[t + 1]).
+  u32 *tile_starts;
+  u32 *tile_triangles;
+  // Triangles that touch the screen, after culling and clipping.
+  u32 triangle_count;
+  // Faces entirely outside the view volume.
+  u32 rejected_faces;
+  // Faces that wind the wrong way on the screen.
+  u32 culled_faces;
+  // Faces that had to be clipped.
+  u32 clipped_faces;
+  // Clusters of faces, and those of them that were entirely outside the view
+  // volume, or entirely back facing. Their faces count as rejected or culled.
+  u32 clusters;
+  u32 rejected_clusters;
+  u32 culled_clusters;
+  // What textured triangles sample.
+  const Texture *texture;
+};
+
+// Tests the bounds of clusters of faces against a view, so whole clusters can
+// be skipped before any work on their faces.
+struct ClusterCuller {
+  // The planes of the view volume in model space, each with the length of
+  // its normal; points inside have dot(plane.xyz, p) + plane.w >= 0.
+  f32x4 planes[6];
+  f32 plane_lengths[6];
+  // The unit direction faces have to point along to wind counterclockwise on
+  // the screen, or zero if the projection isn't orthographic, when it
+  // depends on where the face is.
+  f32x3 front;
+
+  static ClusterCuller start(const Mat4 &view_projection, const Viewport &viewport) {
+    const f32 (&m)[4][4] = view_projection.m;
+    ClusterCuller c;
+    for (u32 k = 0; k < 3; k++) {
+      for (u32 side = 0; side < 2; side++) {
+        f32 s = side ? -1.0f : 1.0f;
+        f32x4 &p = c.planes[2 * k + side];
+        p = {m[3][0] + s * m[k][0], m[3][1] + s * m[k][1], m[3][2] + s * m[k][2], m[3][3] + s * m[k][3]};
+        c.plane_lengths[2 * k + side] = f32x3{p.x, p.y, p.z}.magnitude();
+      }
+    }
+    c.front = {0.0f, 0.0f, 0.0f};
+    if (m[3][0] == 0.0f && m[3][1] == 0.0f && m[3][2] == 0.0f) {
+      // Screen area is scale_x * scale_y * dot(cross(row x, row y), normal).
+      f32x3 front = cross({m[0][0], m[0][1], m[0][2]}, {m[1][0], m[1][1], m[1][2]});
+      f32 length = front.magnitude();
+      if (length > 0.0f) {
+        c.front = front * ((viewport.scale_x * viewport.scale_y < 0.0f ? -1.0f : 1.0f) / length);
+      }
+    }
+    return c;
+  }
+
+  // Whether a sphere is entirely outside one of the planes.
+  bool outside(f32x3 center, f32 radius) const {
+    for (u32 i = 0; i < 6; i++) {
+      const f32x4 &p = planes[i];
+      if (p.x * center.x + p.y * center.y + p.z * center.z + p.w < -radius * plane_lengths[i]) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Whether every face with a normal in cone faces away.
+  bool back_facing(const NormalCone &cone) const {
+    return dot(cone.axis, front) < -cone.cutoff;
+  }
+};
+
+// Transforms the vertices of obj to screen coordinates, then shades its faces
+// lit by a spotlight shining in the unit direction light in model space,
+// textured with texture if it's given and obj has texture coordinates, and
+// bins them into per-tile lists in parallel over chunks of faces. On the
+// way, faces outside the view are rejected, back faces are culled, and faces
+// that cross the near or far plane or the guard band are clipped. When obj
+// has clusters, those that are entirely outside or back facing are skipped
+// first.
+static Bins bin_obj(Image &image, const Obj &obj, const Texture *texture, const Mat4 &view_projection,
+                    f32x3 light, WorkerPool &pool, Arena &arena) {
+  TRACE_SCOPE("bin_obj");
+  constexpr u32 FACES_PER_CHUNK = 4096;
+  static_assert(FACES_PER_CHUNK % FACES_PER_CLUSTER == 0, "chunks are made of whole clusters");
+
+  u32 face_count = obj.faces.count;
+  u32 chunk_count = (face_count + FACES_PER_CHUNK - 1) / FACES_PER_CHUNK;
+  u32 tile_count = image.tiles_x() * image.tiles_y();
+  Rect screen = {0, 0, i32(image.width), i32(image.height)};
+  Viewport viewport = image.viewport();
+
+  Bins bins = {};
+  bool textured = texture && obj.face_texcoords.count;
+  bins.texture = textured ? texture : nullptr;
+  bins.tile_starts = arena.alloc_array<u32>(tile_count + 1);
+  // Tiles covered by each triangle; empty if culled.
+  Bounds *tile_ranges = arena.alloc_array<Bounds>(face_count);
+  // counts[chunk * tile_count + tile] is first the number of triangles from
+  // chunk that touch tile, and then where the chunk writes them in
+  // tile_triangles.
+  u32 *counts = arena.alloc_array<u32>(chunk_count * tile_count);
+  struct ChunkStats {
+    u32 triangles;
+    u32 rejected_faces;
+    u32 culled_faces;
+    u32 clipped_faces;
+    u32 rejected_clusters;
+    u32 culled_clusters;
+  };
+  ChunkStats *chunk_stats = arena.alloc_array<ChunkStats>(chunk_count);
+  // The faces of each chunk that need clipping, starting at its first face.
+  u32 *clipped_faces = arena.alloc_array<u32>(face_count);
+
+  ScreenVertices vertices = transform_vertices(image, obj, view_projection, pool, arena);
+  f32 *intensities = arena.alloc_array<f32>(face_count);
+  f32 *normal_intensities = nullptr;
+  if (g_smooth_shading && obj.face_normals.count) {
+    normal_intensities = arena.alloc_array<f32>(obj.normals.count);
+    shade_normals(obj, light, pool, normal_intensities);
+  }
+  // Allocated last, so that room for clipped triangles can be added in place.
+  bins.triangles = arena.alloc_array<Triangle>(face_count);
+  bool clustered = obj.clusters.count != 0;
+  ClusterCuller culler = ClusterCuller::start(view_projection, viewport);
+
+  // Sets tile_ranges[i] and counts the tiles that triangles[i] touches.
+  // Returns false if it's entirely off the screen.
+  auto bin_triangle = [&](u32 i, Bounds &tiles, u32 *chunk_counts) {
+    const Triangle &t = bins.triangles[i];
+    Bounds bounds = Image::pixel_bounds(t.a, t.b, t.c, screen);
+    if (bounds.empty()) {
+      return false;
+    }
+    tiles = {
+      bounds.x_min / i32(TILE_SIZE), bounds.y_min / i32(TILE_SIZE),
+      bounds.x_max / i32(TILE_SIZE), bounds.y_max / i32(TILE_SIZE),
+    };
+    for (i32 ty = tiles.y_min; ty <= tiles.y_max; ty++) {
+      for (i32 tx = tiles.x_min; tx <= tiles.x_max; tx++) {
+        chunk_counts[ty * image.tiles_x() + tx]++;
+      }
+    }
+    return true;
+  };
+
+  pool.parallel_for(chunk_count, [&](u32 chunk) {
+    TRACE_SCOPE("bin chunk");
+    u32 *chunk_counts = &counts[chunk * tile_count];
+    memset(chunk_counts, 0, tile_count * sizeof(u32));
+    ChunkStats &stats = chunk_stats[chunk];
+    stats = {};
+
+    u32 begin = chunk * FACES_PER_CHUNK;
+    u32 end = min(face_count, begin + FACES_PER_CHUNK);
+    for (u32 cluster_begin = begin; cluster_begin < end; cluster_begin += FACES_PER_CLUSTER) {
+      u32 cluster_end = min(end, cluster_begin + FACES_PER_CLUSTER);
+      if (clustered) {
+        const FaceCluster &cluster = obj.clusters[cluster_begin / FACES_PER_CLUSTER];
+        bool rejected = culler.outside(cluster.center, cluster.radius);
+        if (rejected || culler.back_facing(cluster.cone)) {
+          for (u32 i = cluster_begin; i < cluster_end; i++) {
+            tile_ranges[i] = {0, 0, -1, -1};
+          }
+          if (rejected) {
+            stats.rejected_clusters++;
+            stats.rejected_faces += cluster_end - cluster_begin;
+          } else {
+            stats.culled_clusters++;
+            stats.culled_faces += cluster_end - cluster_begin;
+          }
+          continue;
+        }
+      }
+
+      g_kernels->shade_faces(obj, cluster_begin, cluster_end, light, intensities);
+      for (u32 i = cluster_begin; i < cluster_end; i++) {
+        tile_ranges[i] = {0, 0, -1, -1};
+
+        u16x3 f = obj.faces[i];
+        u16 a = vertices.outcodes[f.x];
+        u16 b = vertices.outcodes[f.y];
+        u16 c = vertices.outcodes[f.z];
+        if (a & b & c & CLIP_FRUSTUM) {
+          stats.rejected_faces++;
+          continue;
+        }
+        if ((a | b | c) & CLIP_NEEDED) {
+          clipped_faces[begin + stats.clipped_faces++] = i;
+          continue;
+        }
+
+        Triangle &t = bins.triangles[i];
+        t.a = vertices[f.x];
+        t.b = vertices[f.y];
+        t.c = vertices[f.z];
+        if (!is_front_facing(t.a, t.b, t.c)) {
+          stats.culled_faces++;
+          continue;
+        }
+        t.inv_w[0] = vertices.inv_w[f.x];
+        t.inv_w[1] = vertices.inv_w[f.y];
+        t.inv_w[2] = vertices.inv_w[f.z];
+        shade_triangle(obj, i, intensities, normal_intensities, textured, t);
+        stats.triangles += bin_triangle(i, tile_ranges[i], chunk_counts);
+      }
+    }
+  });
+
+  // Each clipped face gets room for MAX_CLIPPED_TRIANGLES triangles, in order,
+  // after the unclipped ones. The room is added before anything else comes
+  // from arena, while bins.triangles can still grow in place.
+  u32 clipped = 0;
+  for (u32 chunk = 0; chunk < chunk_count; chunk++) {
+    clipped += chunk_stats[chunk].clipped_faces;
+  }
+  if (clipped) {
+    u32 capacity = face_count + clipped * MAX_CLIPPED_TRIANGLES;
+    bins.triangles = arena.realloc_array(bins.triangles, face_count, capacity);
+  }
+  u32 *clip_starts = arena.alloc_array<u32>(chunk_count + 1);
+  clip_starts[0] = 0;
+  for (u32 chunk = 0; chunk < chunk_count; chunk++) {
+    clip_starts[chunk + 1] = clip_starts[chunk] + chunk_stats[chunk].clipped_faces;
+  }
+  u32 clip_base = face_count;
+  Bounds *clipped_ranges = nullptr;
+  u8 *clipped_counts = nullptr;
+  if (clipped) {
+    clipped_ranges = arena.alloc_array<Bounds>(clipped * MAX_CLIPPED_TRIANGLES);
+    clipped_counts = arena.alloc_array<u8>(clipped);
+    pool.parallel_for(chunk_count, [&](u32 chunk) {
+      TRACE_SCOPE("clip chunk");
+      u32 *chunk_counts = &counts[chunk * tile_count];
+      u32 begin = chunk * FACES_PER_CHUNK;
+      for (u32 k = 0; k < chunk_stats[chunk].clipped_faces; k++) {
+        u32 i = clipped_faces[begin + k];
+        u32 slot = clip_starts[chunk] + k;
+        u32 first = clip_base + slot * MAX_CLIPPED_TRIANGLES;
+        u16x3 f = obj.faces[i];
+        u16 outcodes = vertices.outcodes[f.x] | vertices.outcodes[f.y] | vertices.outcodes[f.z];
+        Triangle shaded;
+        shade_triangle(obj, i, intensities, normal_intensities, textured, shaded);
+        u32 n = clip_face(obj, f, outcodes, view_projection, viewport, shaded, &bins.triangles[first]);
+        u32 kept = 0;
+        for (u32 j = 0; j < n; j++) {
+          const Triangle &t = bins.triangles[first + j];
+          if (!is_front_facing(t.a, t.b, t.c)) {
+            continue;
+          }
+          bins.triangles[first + kept] = t;
+          Bounds &tiles = clipped_ranges[slot * MAX_CLIPPED_TRIANGLES + kept];
+          if (bin_triangle(first + kept, tiles, chunk_counts)) {
+            kept++;
+          }
+        }
+        clipped_counts[slot] = kept;
+        chunk_stats[chunk].triangles += kept;
+      }
+    });
+  }
+
+  u32 total = 0;
+  for (u32 tile = 0; tile < tile_count; tile++) {
+    bins.tile_starts[tile] = total;
+    for (u32 chunk = 0; chunk < chunk_count; chunk++) {
+      u32 n = counts[chunk * tile_count + tile];
+      counts[chunk * tile_count + tile] = total;
+      total += n;
+    }
+  }
+  bins.tile_starts[tile_count] = total;
+  for (u32 chunk = 0; chunk < chunk_count; chunk++) {
+    bins.triangle_count += chunk_stats[chunk].triangles;
+    bins.rejected_faces += chunk_stats[chunk].rejected_faces;
+    bins.culled_faces += chunk_stats[chunk].culled_faces;
+    bins.clipped_faces += chunk_stats[chunk].clipped_faces;
+    bins.rejected_clusters += chunk_stats[chunk].rejected_clusters;
+    bins.culled_clusters += chunk_stats[chunk].culled_clusters;
+  }
+  bins.clusters = obj.clusters.count;
+
+  bins.tile_triangles = arena.alloc_array<u32>(total);
+  pool.parallel_for(chunk_count, [&](u32 chunk) {
+    TRACE_SCOPE("scatter chunk");
+    u32 *offsets = &counts[chunk * tile_count];
+    auto scatter = [&](u32 triangle, Bounds tiles) {
+      for (i32 ty = tiles.y_min; ty <= tiles.y_max; ty++) {
+        for (i32 tx = tiles.x_min; tx <= tiles.x_max; tx++) {
+          bins.tile_triangles[offsets[ty * image.tiles_x() + tx]++] = triangle;
+        }
+      }
+    };
+
+    u32 begin = chunk * FACES_PER_CHUNK;
+    u32 end = min(face_count, begin + FACES_PER_CHUNK);
+    u32 k = 0;
+    for (u32 i = begin; i < end; i++) {
+      if (k < chunk_stats[chunk].clipped_faces && clipped_faces[begin + k] == i) {
+        u32 slot = clip_starts[chunk] + k++;
+        for (u32 j = 0; j < clipped_counts[slot]; j++) {
+          u32 piece = slot * MAX_CLIPPED_TRIANGLES + j;
+          scatter(clip_base + piece, clipped_ranges[piece]);
+        }
+        continue;
+      }
+      scatter(i, tile_ranges[i]);
+    }
+  });
+
+  return bins;
+}
+
+// Rasterizes every tile's list on one thread. Returns the number of fragments
+// that were depth tested.
+static u64 draw_bins(Image &image, const Bins &bins, WorkerPool &pool, Arena &arena) {
+  TRACE_SCOPE("draw_bins");
+  u32 tile_count = image.tiles_x() * image.tiles_y();
+  u64 *tile_fragments = arena.alloc_array<u64>(tile_count);
+  pool.parallel_for(tile_count, [&](u32 tile) {
+    TRACE_SCOPE("raster tile");
+    u64 fragments = 0;
+    for (u32 i = bins.tile_starts[tile]; i < bins.tile_starts[tile + 1]; i++) {
+      const Triangle &t = bins.triangles[bins.tile_triangles[i]];
+      fragments += image.draw_triangle(t, bins.texture, tile);
+    }
+    tile_fragments[tile] = fragments;
+  });
+
+  u64 fragments = 0;
+  for (u32 tile = 0; tile < tile_count; tile++) {
+    fragments += tile_fragments[tile];
+  }
+  return fragments;
+}
+
+// Picks the level of lods to draw to image with view_projection: level g_lod,
+// or for LOD_AUTO, the simplest level whose error is at most LOD_PIXEL_ERROR
+// pixels on screen. Projections are orthographic, so one model unit covers the
+// same number of pixels everywhere.
+static const Obj &select_lod(const MeshLods &lods, const Image &image, const Mat4 &view_projection) {
+  constexpr f32 LOD_PIXEL_ERROR = 0.5f;
+  if (g_lod != LOD_AUTO) {
+    return lods.levels[min(g_lod, lods.count - 1)];
+  }
+  Viewport viewport = image.viewport();
+  const f32 (&m)[4][4] = view_projection.m;
+  f32x3 row_x = {m[0][0], m[0][1], m[0][2]};
+  f32x3 row_y = {m[1][0], m[1][1], m[1][2]};
+  f32 pixels_per_unit = max(row_x.magnitude() * viewport.scale_x, row_y.magnitude() * viewport.scale_y);
+  u32 level = 0;
+  while (level + 1 < lods.count && lods.errors[level + 1] * pixels_per_unit <= LOD_PIXEL_ERROR) {
+    level++;
+  }
+  return lods.levels[level];
+}
+
+// Draws obj with a sort-middle tiled pipeline: faces are shaded and binned into
+// per-tile lists in parallel, then every tile is rasterized by one thread.
+static void draw_obj(Image &image, const Obj &obj, const Texture *texture, const Mat4 &view_projection,
+                     f32x3 light, WorkerPool &pool, Arena &arena) {
+  Bins bins = bin_obj(image, obj, texture, view_projection, light, pool, arena);
+  draw_bins(image, bins, pool, arena);
+}
+
+// A fixed-capacity FIFO whose push blocks while it's full and whose pop blocks
+// while it's empty, for handing work from one thread to another. Once the
+// queue is closed, pop returns false after the last item.
+template<typename T, u32 N>
+struct BlockingQueue {
+  T items[N];
+  u32 head = 0;
+  u32 count = 0;
+  bool closed = false;
+  std::mutex mutex;
+  std::condition_variable not_empty;
+  std::condition_variable not_full;
+
+  void push(const T &item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_full.wait(lock, [this] { return count < N; });
+    items[(head + count) % N] = item;
+    count++;
+    not_empty.notify_one();
+  }
+
+  bool pop(T &item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    not_empty.wait(lock, [this] { return count > 0 || closed; });
+    if (count == 0) {
+      return false;
+    }
+    item = items[head];
+    head = (head + 1) % N;
+    count--;
+    not_full.notify_one();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    not_empty.notify_all();
+  }
+};
+
+// Meshlets read from a meshlet file at a time: as many as keep every index
+// into their vertices within 16 bits.
+constexpr u32 MESHLETS_PER_READ = NO_INDEX / MESHLET_MAX_VERTICES;
+
+// Gathers the meshlets that aren't entirely outside the view volume or back
+// facing into one Obj in arena, with the vertex normals as face normals.
+static Obj gather_meshlets(const Meshlet *meshlets, u32 count, const Viewport &viewport,
+                           const ClusterCuller &culler, const Mat4 &view_projection, Arena &arena) {
+  TRACE_SCOPE("gather_meshlets");
+  Obj obj;
+  obj.vertices = alloc_vector<f32x3>(count * MESHLET_MAX_VERTICES, arena);
+  obj.normals = alloc_vector<f32x3>(count * MESHLET_MAX_VERTICES, arena);
+  obj.faces = alloc_vector<u16x3>(count * MESHLET_MAX_TRIANGLES, arena);
+  u32 vertex_count = 0;
+  u32 face_count = 0;
+  for (u32 i = 0; i < count; i++) {
+    const Meshlet &m = meshlets[i];
+    u16 outside = CLIP_FRUSTUM;
+    for (u32 corner = 0; corner < 8; corner++) {
+      f32x3 p = {
+        corner & 1 ? m.max.x : m.min.x,
+        corner & 2 ? m.max.y : m.min.y,
+        corner & 4 ? m.max.z : m.min.z,
+      };
+      outside &= viewport.outcode(view_projection * p);
+    }
+    if (outside || culler.back_facing(m.cone)) {
+      continue;
+    }
+    memcpy(&obj.vertices.data[vertex_count], m.positions, m.vertex_count * sizeof(f32x3));
+    memcpy(&obj.normals.data[vertex_count], m.normals, m.vertex_count * sizeof(f32x3));
+    for (u32 t = 0; t < m.triangle_count; t++) {
+      const u8 *v = m.triangles[t];
+      obj.faces.data[face_count++] = {u16(vertex_count + v[0]), u16(vertex_count + v[1]),
+                                      u16(vertex_count + v[2])};
+    }
+    vertex_count += m.vertex_count;
+  }
+  obj.vertices.count = vertex_count;
+  obj.normals.count = vertex_count;
+  obj.faces.count = face_count;
+  obj.face_normals = obj.faces;
+  return obj;
+}
+
+// The hardware events bench counts around each stage.
+constexpr u32 PERF_CYCLES = 0;
+constexpr u32 PERF_INSTRUCTIONS = 1;
+constexpr u32 PERF_L1D_MISSES = 2;
+constexpr u32 PERF_LLC_MISSES = 3;
+constexpr u32 PERF_BRANCH_MISSES = 4;
+constexpr u32 PERF_COUNTERS = 5;
+
+static const char *const g_perf_counter_names[PERF_COUNTERS] = {
+  "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses",
+};
+
+struct PerfCounts {
+  u64 n[PERF_COUNTERS];
+};
+
+// Adds the counts from from to to into total.
+static void accumulate(PerfCounts &total, const PerfCounts &from, const PerfCounts &to) {
+  for (u32 i = 0; i < PERF_COUNTERS; i++) {
+    total.n[i] += to.n[i] - from.n[i];
+  }
+}
+
+// Counts hardware events in user space across the process through
+// perf_event_open. The counters are inherited by threads created after they're
+// opened, and reading one sums it over all of them, so they must be opened
+// before any worker threads start. Counters the kernel won't open, because of
+// perf_event_paranoid, a missing PMU in a VM or another OS, are left closed
+// and read as 0.
+struct PerfCounters {
+  int fds[PERF_COUNTERS] = {-1, -1, -1, -1, -1};
+  // errno from the first counter that couldn't be opened.
+  int error = 0;
+
+  static PerfCounters open() {
+    PerfCounters c;
+#if defined(__linux__)
+    constexpr u64 READ_MISS = PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+    const struct {
+      u32 type;
+      u64 config;
+    } events[PERF_COUNTERS] = {
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | READ_MISS},
+      {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | READ_MISS},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    };
+    for (u32 i = 0; i < PERF_COUNTERS; i++) {
+      perf_event_attr attr = {};
+      attr.size = sizeof(attr);
+      attr.type = events[i].type;
+      attr.config = events[i].config;
+      attr.inherit = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      // More events than the PMU has counters for take turns, so the counts
+      // are scaled up by how long each one was actually counting.
+      attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+      c.fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+      if (c.fds[i] < 0 && !c.error) {
+        c.error = errno;
+      }
+    }
+#else
+    c.error = ENOSYS;
+#endif
+    errno = 0;
+    return c;
+  }
+
+  bool is_open(u32 i) const {
+    return fds[i] >= 0;
+  }
+
+  bool any_open() const {
+    for (u32 i = 0; i < PERF_COUNTERS; i++) {
+      if (is_open(i)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  PerfCounts read() const {
+    PerfCounts counts = {};
+    for (u32 i = 0; i < PERF_COUNTERS; i++) {
+      u64 value[3];
+      if (is_open(i) && ::read(fds[i], value, sizeof(value)) == sizeof(value) && value[2]) {
+        counts.n[i] = u64(f64(value[0]) * value[1] / value[2]);
+      }
+    }
+    return counts;
+  }
+
+  void close() {
+    for (u32 i = 0; i < PERF_COUNTERS; i++) {
+      if (is_open(i)) {
+        ::close(fds[i]);
+        fds[i] = -1;
+      }
+    }
+  }
+};
+
+// Adds the counts of bins to total's.
+static void add_bin_counts(Bins &total, const Bins &bins) {
+  total.triangle_count += bins.triangle_count;
+  total.rejected_faces += bins.rejected_faces;
+  total.culled_faces += bins.culled_faces;
+  total.clipped_faces += bins.clipped_faces;
+  total.clusters += bins.clusters;
+  total.rejected_clusters += bins.rejected_clusters;
+  total.culled_clusters += bins.culled_clusters;
+}
+
+// What a streamed draw spent binning, gathering meshlets included, and
+// rasterizing, summed over its reads, for bench. Time spent waiting on reads
+// counts toward neither.
+struct StreamStats {
+  const PerfCounters *counters;
+  u64 bin_ns;
+  u64 raster_ns;
+  PerfCounts bin_counts;
+  PerfCounts raster_counts;
+  u64 fragments;
+  Bins bins;
+};
+
+// Draws the mesh in a meshlet file, reading it front to back on another
+// thread, MESHLETS_PER_READ meshlets at a time, while the meshlets read
+// before are drawn. Only two reads are in memory at once, however big the
+// mesh is. Meshlets are drawn in file order, so where triangles tie in
+// depth, the one first in the file wins, as it would in one draw_obj.
+static void draw_meshlets(Image &image, const MeshletFile &file, const Mat4 &view_projection, f32x3 light,
+                          WorkerPool &pool, Arena &arena, StreamStats *stats = nullptr) {
+  constexpr u32 BUFFER_COUNT = 2;
+  Meshlet *buffers[BUFFER_COUNT];
+  u32 counts[BUFFER_COUNT];
+  BlockingQueue<u32, BUFFER_COUNT> free_buffers, read_buffers;
+  for (u32 i = 0; i < BUFFER_COUNT; i++) {
+    buffers[i] = arena.alloc_array<Meshlet>(MESHLETS_PER_READ);
+    free_buffers.push(i);
+  }
+
+  std::thread reader([&] {
+    TRACE_THREAD_NAME("meshlet reader");
+    posix_fadvise(file.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    for (u32 first = 0; first < file.count; first += MESHLETS_PER_READ) {
+      u32 b = 0;
+      free_buffers.pop(b);
+      TRACE_SCOPE("read meshlets");
+      counts[b] = min(MESHLETS_PER_READ, file.count - first);
+      u8 *p = reinterpret_cast<u8 *>(buffers[b]);
+      u64 size = u64(counts[b]) * sizeof(Meshlet);
+      u64 offset = sizeof(MeshletFileHeader) + u64(first) * sizeof(Meshlet);
+      while (size) {
+        ssize_t n = pread(file.fd, p, size, offset);
+        if (n <= 0) {
+          panic("unable to read meshlets");
+        }
+        p += n;
+        size -= n;
+        offset += n;
+      }
+      read_buffers.push(b);
+    }
+    read_buffers.close();
+  });
+
+  Viewport viewport = image.viewport();
+  ClusterCuller culler = ClusterCuller::start(view_projection, viewport);
+  for (u32 b; read_buffers.pop(b);) {
+    u64 mark = arena.pos;
+    PerfCounts c0 = stats ? stats->counters->read() : PerfCounts{};
+    u64 t0 = now_ns();
+    Obj obj = gather_meshlets(buffers[b], counts[b], viewport, culler, view_projection, arena);
+    free_buffers.push(b);
+    Bins bins = bin_obj(image, obj, nullptr, view_projection, light, pool, arena);
+    u64 t1 = now_ns();
+    PerfCounts c1 = stats ? stats->counters->read() : PerfCounts{};
+    u64 t2 = now_ns();
+    u64 fragments = draw_bins(image, bins, pool, arena);
+    u64 t3 = now_ns();
+    if (stats) {
+      accumulate(stats->bin_counts, c0, c1);
+      accumulate(stats->raster_counts, c1, stats->counters->read());
+      stats->bin_ns += t1 - t0;
+      stats->raster_ns += t3 - t2;
+      stats->fragments += fragments;
+      add_bin_counts(stats->bins, bins);
+    }
+    arena.reset_to(mark);
+  }
+  reader.join();
+}
+
+// Draws mesh, at the level of detail select_lod picks if it's in memory.
+// Streamed meshes have no texture coordinates, so they're never textured.
+static void draw_mesh(Image &image, const Mesh &mesh, const Texture *texture, const Mat4 &view_projection,
+                      f32x3 light, WorkerPool &pool, Arena &arena) {
+  TRACE_SCOPE("draw_mesh");
+  if (mesh.meshlets.fd >= 0) {
+    draw_meshlets(image, mesh.meshlets, view_projection, light, pool, arena);
+  } else {
+    draw_obj(image, select_lod(mesh.lods, image, view_projection), texture, view_projection, light, pool, arena);
+  }
+}
+
+// Writes a UV sphere with the given number of rings, and twice as many
+// segments, as an OBJ file: 4 * rings * (rings - 1) triangles.
+static void write_sphere_obj(const char *path, u32 rings) {
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    panic("unable to open '%s'", path);
+  }
+  constexpr f32 pi = 3.14159265f;
+  constexpr f32 radius = 0.8f;
+  u32 segments = 2 * rings;
+  fprintf(f, "v 0 %f 0\n", radius);
+  for (u32 i = 1; i < rings; i++) {
+    f32 theta = pi * i / rings;
+    for (u32 j = 0; j < segments; j++) {
+      f32 phi = 2.0f * pi * j / segments;
+      fprintf(f, "v %f %f %f\n", radius * sinf(theta) * cosf(phi), radius * cosf(theta),
+              radius * sinf(theta) * sinf(phi));
+    }
+  }
+  fprintf(f, "v 0 %f 0\n", -radius);
+
+  // OBJ indices are 1-based: the top pole is 1, ring i (from 1) starts at
+  // 2 + (i - 1) * segments, and the bottom pole comes last.
+  auto at = [&](u32 ring, u32 segment) {
+    return 2 + (ring - 1) * segments + segment % segments;
+  };
+  u32 bottom = 2 + (rings - 1) * segments;
+  for (u32 j = 0; j < segments; j++) {
+    fprintf(f, "f 1 %u %u\n", at(1, j + 1), at(1, j));
+    fprintf(f, "f %u %u %u\n", bottom, at(rings - 1, j), at(rings - 1, j + 1));
+  }
+  for (u32 i = 1; i + 1 < rings; i++) {
+    for (u32 j = 0; j < segments; j++) {
+      fprintf(f, "f %u %u %u\n", at(i, j), at(i, j + 1), at(i + 1, j + 1));
+      fprintf(f, "f %u %u %u\n", at(i, j), at(i + 1, j + 1), at(i + 1, j));
+    }
+  }
+  if (fclose(f) != 0) {
+    panic("unable to write '%s'", path);
+  }
+}
+
+// Writes a stack of screen-filling quads, drawn back to front so that every
+// layer passes the depth test, as an OBJ file.
+static void write_quad_stack_obj(const char *path, u32 layers) {
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    panic("unable to open '%s'", path);
+  }
+  constexpr f32 s = 0.9f;
+  for (u32 i = 0; i < layers; i++) {
+    f32 z = -s + 2.0f * s * i / layers;
+    fprintf(f, "v %f %f %f\nv %f %f %f\nv %f %f %f\nv %f %f %f\n", -s, -s, z, s, -s, z, s, s, z,
+            -s, s, z);
+    u32 v = 1 + 4 * i;
+    fprintf(f, "f %u %u %u\nf %u %u %u\n", v, v + 1, v + 2, v, v + 2, v + 3);
+  }
+  if (fclose(f) != 0) {
+    panic("unable to write '%s'", path);
+  }
+}
+
+// Writes a size x size checkerboard, tinted by a gradient so that its mip
+// levels differ, as an uncompressed 24-bit TGA file.
+static void write_checker_tga(const char *path, u32 size) {
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    panic("unable to open '%s'", path);
+  }
+  u8 header[18] = {};
+  header[2] = 2;
+  header[12] = size & 0xFF;
+  header[13] = size >> 8;
+  header[14] = size & 0xFF;
+  header[15] = size >> 8;
+  header[16] = 24;
+  fwrite(header, sizeof(header), 1, f);
+  for (u32 y = 0; y < size; y++) {
+    for (u32 x = 0; x < size; x++) {
+      u32 c = ((x / 8) ^ (y / 8)) & 1 ? 255 : 96;
+      Pixel p = {u8(c * y / size), u8(c), u8(c * x / size)};
+      fwrite(&p, sizeof(p), 1, f);
+    }
+  }
+  if (fclose(f) != 0) {
+    panic("unable to write '%s'", path);
+  }
+}
+
+// Timings of one pipeline stage over all iterations of a benchmark case.
+struct BenchStage {
+  const char *name;
+  u64 *ns;
+  // Work done per iteration, for the rates; 0 if it doesn't apply.
+  u64 triangles;
+  u64 fragments;
+  // Events counted over all iterations.
+  PerfCounts counts;
+
+  // The q-th quantile of the timings, in milliseconds.
+  f64 quantile_ms(u32 iterations, f64 q) const {
+    u32 i = u32(q * iterations + 0.999999);
+    i = min(max(i, 1u), iterations) - 1;
+    return ns[i] / 1e6;
+  }
+};
+
+struct BenchMesh {
+  const char *name;
+  const char *path;
+  // Meshes with more vertices than 16-bit indices can address are streamed.
+  u64 vertices;
+  // Magnification of the camera, which pushes most of the mesh off screen
+  // when it's large.
+  f32 zoom;
+  // Whether to draw it with the benchmark's texture.
+  bool textured;
+};
+
+struct BenchOptions {
+  u32 iterations = 10;
+  const char *output = "bench.json";
+  TgaEncoding encoding = TgaEncoding::Rle;
+  const char *kernel = nullptr;
+  u32 thread_count = 0;
+};
+
+#ifndef SWR_GIT_REV
+#define SWR_GIT_REV "unknown"
+#endif
+
+// Writes a stage's counters, averaged over iterations, as JSON: the raw
+// counts, instructions per cycle, and misses per triangle and per pixel, where
+// a stage's pixels are its fragments. Counters that aren't open are null.
+static void write_stage_counters(FILE *json, const PerfCounters &counters, const BenchStage &stage,
+                                 u32 iterations) {
+  f64 mean[PERF_COUNTERS];
+  fprintf(json, ",\n         \"counters\": {");
+  for (u32 i = 0; i < PERF_COUNTERS; i++) {
+    mean[i] = f64(stage.counts.n[i]) / iterations;
+    if (counters.is_open(i)) {
+      fprintf(json, "\"%s\": %.0f, ", g_perf_counter_names[i], mean[i]);
+    } else {
+      fprintf(json, "\"%s\": null, ", g_perf_counter_names[i]);
+    }
+  }
+  if (counters.is_open(PERF_CYCLES) && counters.is_open(PERF_INSTRUCTIONS) && mean[PERF_CYCLES] > 0.0) {
+    fprintf(json, "\"ipc\": %.3f", mean[PERF_INSTRUCTIONS] / mean[PERF_CYCLES]);
+  } else {
+    fprintf(json, "\"ipc\": null");
+  }
+  const struct {
+    const char *name;
+    u64 count;
+  } units[] = {{"per_triangle", stage.triangles}, {"per_pixel", stage.fragments}};
+  for (auto [name, count] : units) {
+    if (!count) {
+      continue;
+    }
+    fprintf(json, ",\n          \"%s\": {", name);
+    const char *separator = "";
+    for (u32 i = PERF_L1D_MISSES; i < PERF_COUNTERS; i++) {
+      if (counters.is_open(i)) {
+        fprintf(json, "%s\"%s\": %.6f", separator, g_perf_counter_names[i], mean[i] / count);
+      } else {
+        fprintf(json, "%s\"%s\": null", separator, g_perf_counter_names[i]);
+      }
+      separator = ", ";
+    }
+    fprintf(json, "}");
+  }
+  fprintf(json, "}");
+}
+
+// Renders every mesh at every resolution for a number of iterations, timing
+// the load, transform, raster and encode stages separately, and counting
+// hardware events in them if counters are open. Prints a summary and writes
+// the results as JSON.
+static void bench(const BenchOptions &options, const PerfCounters &counters, WorkerPool &pool) {
+  Arena arena = Arena::reserve(u64(64) << 30, 0);
+
+  constexpr struct {
+    u32 width, height;
+  } resolutions[] = {{512, 512}, {1000, 1000}, {1920, 1080}, {3840, 2160}};
+
+  constexpr struct {
+    const char *name;
+    u32 rings;
+  } spheres[] = {
+    {"sphere-1k", 16}, {"sphere-10k", 50}, {"sphere-100k", 158}, {"sphere-1m", 500},
+    {"sphere-10m", 1581},
+  };
+  constexpr u32 QUAD_LAYERS = 64;
+  constexpr u32 TEXTURE_SIZE = 1024;
+
+  char texture_path[64];
+  snprintf(texture_path, sizeof(texture_path), "/tmp/swr4-bench-%d-texture.tga", getpid());
+  write_checker_tga(texture_path, TEXTURE_SIZE);
+  Texture texture = load_texture(texture_path, pool, arena);
+
+  BenchMesh meshes[5 + sizeof(spheres) / sizeof(spheres[0])];
+  char paths[sizeof(meshes) / sizeof(meshes[0])][64];
+  u32 mesh_count = 0;
+  meshes[mesh_count++] = {"head", "head.obj", 0, 1.0f, false};
+  meshes[mesh_count++] = {"head-zoom8", "head.obj", 0, 8.0f, false};
+  // Minified, and then magnified, so sampling reads small and large mip levels.
+  meshes[mesh_count++] = {"head-tex", "head.obj", 0, 1.0f, true};
+  meshes[mesh_count++] = {"head-tex-zoom8", "head.obj", 0, 8.0f, true};
+  for (auto &s : spheres) {
+    u64 vertices = 2 + u64(s.rings - 1) * 2 * s.rings;
+    char *path = paths[mesh_count];
+    snprintf(path, sizeof(paths[0]), "/tmp/swr4-bench-%d-%s.obj", getpid(), s.name);
+    write_sphere_obj(path, s.rings);
+    meshes[mesh_count++] = {s.name, path, vertices, 1.0f, false};
+  }
+  char *path = paths[mesh_count];
+  snprintf(path, sizeof(paths[0]), "/tmp/swr4-bench-%d-quads.obj", getpid());
+  write_quad_stack_obj(path, QUAD_LAYERS);
+  meshes[mesh_count++] = {"quad-stack", path, 4 * QUAD_LAYERS, 1.0f, false};
+
+  FILE *json = fopen(options.output, "w");
+  if (!json) {
+    panic("unable to open '%s'", options.output);
+  }
+  fprintf(json, "{\n  \"git_rev\": \"%s\",\n  \"kernel\": \"%s\",\n  \"threads\": %u,\n", SWR_GIT_REV,
+          options.kernel, options.thread_count);
+  fprintf(json, "  \"raster\": \"%s\",\n  \"shading\": \"%s\",\n", g_fixed_point ? "fixed" : "float",
+          g_smooth_shading ? "smooth" : "flat");
+  fprintf(json, "  \"texture_filter\": \"%s\",\n",
+          g_texture_filter == TextureFilter::Bilinear ? "bilinear" : "trilinear");
+  fprintf(json, "  \"framebuffer\": \"%s\",\n",
+          g_framebuffer_layout == FramebufferLayout::Linear ? "linear" : "tiled");
+  if (g_lod == LOD_AUTO) {
+    fprintf(json, "  \"lod\": \"auto\",\n");
+  } else {
+    fprintf(json, "  \"lod\": %u,\n", g_lod);
+  }
+  fprintf(json, "  \"perf_counters\": [");
+  bool counting = counters.any_open();
+  const char *separator = "";
+  for (u32 i = 0; i < PERF_COUNTERS; i++) {
+    if (counters.is_open(i)) {
+      fprintf(json, "%s\"%s\"", separator, g_perf_counter_names[i]);
+      separator = ", ";
+    }
+  }
+  fprintf(json, "],\n");
+  fprintf(json, "  \"iterations\": %u,\n  \"cases\": [", options.iterations);
+
+  if (!counting) {
+    printf("perf counters unavailable (%s), timing only\n", strerror(counters.error));
+  }
+  printf("%-12s %-10s %9s %11s %-9s %9s %9s %12s %12s", "mesh", "resolution", "triangles", "fragments",
+         "stage", "median ms", "p99 ms", "tris/s", "frags/s");
+  if (counting) {
+    // Misses are per pixel for stages that produce pixels, else per triangle.
+    printf(" %6s %4s %9s %9s %9s", "IPC", "per", "L1d miss", "LLC miss", "br miss");
+  }
+  printf("\n");
+  bool first_case = true;
+  for (u32 m = 0; m < mesh_count; m++) {
+    const BenchMesh &mesh = meshes[m];
+    // Meshes too big for 16-bit indices are drawn the way any draw of them is,
+    // streamed from a meshlet file, so their load stage builds that file.
+    bool streamed = mesh.vertices > NO_INDEX;
+    char meshlet_path[80];
+    snprintf(meshlet_path, sizeof(meshlet_path), "%s.meshlets", mesh.path);
+
+    // Parse the OBJ every iteration, into memory or a meshlet file that's
+    // thrown away, and keep one copy to render.
+    u64 mesh_start = arena.pos;
+    Obj obj = {};
+    Mesh stream = {};
+    u64 *load_ns = arena.alloc_array<u64>(options.iterations);
+    PerfCounts load_counts = {};
+    for (u32 i = 0; i < options.iterations; i++) {
+      if (streamed) {
+        release_mesh(stream);
+        unlink(meshlet_path);
+      }
+      PerfCounts c0 = counters.read();
+      u64 start = now_ns();
+      if (streamed) {
+        stream = load_mesh(mesh.path, pool, g_frame_arena);
+      } else {
+        load_obj(mesh.path, pool, g_frame_arena);
+      }
+      load_ns[i] = now_ns() - start;
+      accumulate(load_counts, c0, counters.read());
+      g_frame_arena.reset();
+    }
+    qsort(load_ns, options.iterations, sizeof(u64), compare_u64);
+    if (!streamed) {
+      obj = load_obj(mesh.path, pool, arena);
+    }
+    u32 triangles = streamed ? stream.meshlets.triangles : obj.faces.count;
+
+    // Levels of detail are only worth building when they'll be drawn.
+    MeshLods lods = {};
+    lods.levels[0] = obj;
+    lods.count = 1;
+    if (g_lod != 0 && !streamed) {
+      lods = build_lods(obj, arena);
+    }
+
+    Mat4 view_projection = Mat4::orthographic(mesh.zoom);
+    for (auto [width, height] : resolutions) {
+      u64 image_start = arena.pos;
+      Image image = Image::allocate(width, height, arena);
+      const Obj &lod = select_lod(lods, image, view_projection);
+      u32 lod_level = &lod - lods.levels;
+      u32 lod_triangles = streamed ? triangles : lod.faces.count;
+      u64 *ns = arena.alloc_array<u64>(3 * options.iterations);
+      BenchStage stages[] = {
+        {"load", load_ns, triangles, 0, load_counts},
+        {"transform", &ns[0 * options.iterations], lod_triangles, 0},
+        {"raster", &ns[1 * options.iterations], 0, 0},
+        {"encode", &ns[2 * options.iterations], 0, 0},
+      };
+      u64 bytes = 0;
+      Bins bins = {};
+      for (u32 i = 0; i < options.iterations; i++) {
+        // Counters are read outside the timed spans, so the reads don't count
+        // against the stages. Clearing is part of drawing a frame, so it
+        // counts as raster time.
+        u64 fragments;
+        if (streamed) {
+          PerfCounts c0 = counters.read();
+          u64 t0 = now_ns();
+          image.clear();
+          u64 t1 = now_ns();
+          accumulate(stages[2].counts, c0, counters.read());
+          StreamStats stats = {&counters};
+          draw_meshlets(image, stream.meshlets, view_projection, SPOTLIGHT, pool, g_frame_arena, &stats);
+          stages[1].ns[i] = stats.bin_ns;
+          stages[2].ns[i] = t1 - t0 + stats.raster_ns;
+          accumulate(stages[1].counts, {}, stats.bin_counts);
+          accumulate(stages[2].counts, {}, stats.raster_counts);
+          bins = stats.bins;
+          fragments = stats.fragments;
+        } else {
+          PerfCounts c0 = counters.read();
+          u64 t0 = now_ns();
+          bins = bin_obj(image, lod, mesh.textured ? &texture : nullptr, view_projection, SPOTLIGHT, pool,
+                         g_frame_arena);
+          u64 t1 = now_ns();
+          PerfCounts c1 = counters.read();
+          u64 t2 = now_ns();
+          image.clear();
+          fragments = draw_bins(image, bins, pool, g_frame_arena);
+          u64 t3 = now_ns();
+          accumulate(stages[2].counts, c1, counters.read());
+          accumulate(stages[1].counts, c0, c1);
+          stages[1].ns[i] = t1 - t0;
+          stages[2].ns[i] = t3 - t2;
+        }
+
+        PerfCounts c0 = counters.read();
+        u64 t0 = now_ns();
+        g_frame_arena.reset();
+        TgaFile file = image.encode_tga(options.encoding, pool, g_frame_arena);
+        u64 t1 = now_ns();
+        accumulate(stages[3].counts, c0, counters.read());
+        bytes = file.size();
+        g_frame_arena.reset();
+
+        stages[3].ns[i] = t1 - t0;
+        stages[2].triangles = bins.triangle_count;
+        stages[2].fragments = fragments;
+        stages[3].fragments = u64(width) * height;
+      }
+
+      fprintf(json, "%s\n    {\"mesh\": \"%s\", \"width\": %u, \"height\": %u, ", first_case ? "" : ",",
+              mesh.name, width, height);
+      fprintf(json, "\"streamed\": %s, ", streamed ? "true" : "false");
+      fprintf(json, "\"lod\": %u, \"triangles\": %u, \"drawn_triangles\": %lu, \"fragments\": %lu, ", lod_level,
+              lod_triangles, stages[2].triangles, stages[2].fragments);
+      fprintf(json, "\"encoded_bytes\": %lu,", bytes);
+      fprintf(json, "\n     \"rejected_faces\": %u, \"culled_faces\": %u, \"clipped_faces\": %u,",
+              bins.rejected_faces, bins.culled_faces, bins.clipped_faces);
+      fprintf(json, "\n     \"clusters\": %u, \"rejected_clusters\": %u, \"culled_clusters\": %u, ", bins.clusters,
+              bins.rejected_clusters, bins.culled_clusters);
+      fprintf(json, "\"culled_cluster_fraction\": %.4f,",
+              bins.clusters ? f64(bins.rejected_clusters + bins.culled_clusters) / bins.clusters : 0.0);
+      fprintf(json, "\n     \"stages\": {");
+      first_case = false;
+
+      char resolution[32];
+      snprintf(resolution, sizeof(resolution), "%ux%u", width, height);
+      for (u32 s = 0; s < sizeof(stages) / sizeof(stages[0]); s++) {
+        BenchStage &stage = stages[s];
+        if (s != 0) {
+          qsort(stage.ns, options.iterations, sizeof(u64), compare_u64);
+        }
+        f64 median = stage.quantile_ms(options.iterations, 0.5);
+        f64 p99 = stage.quantile_ms(options.iterations, 0.99);
+        f64 triangles_per_sec = stage.triangles / (median / 1e3);
+        f64 fragments_per_sec = stage.fragments / (median / 1e3);
+        printf("%-12s %-10s %9u %11lu %-9s %9.3f %9.3f %12.4g %12.4g", mesh.name, resolution,
+               lod_triangles, stages[2].fragments, stage.name, median, p99, triangles_per_sec,
+               fragments_per_sec);
+        if (counting) {
+          const u64 *n = stage.counts.n;
+          if (counters.is_open(PERF_CYCLES) && counters.is_open(PERF_INSTRUCTIONS) && n[PERF_CYCLES]) {
+            printf(" %6.2f", f64(n[PERF_INSTRUCTIONS]) / n[PERF_CYCLES]);
+          } else {
+            printf(" %6s", "-");
+          }
+          u64 units = (stage.fragments ? stage.fragments : stage.triangles) * options.iterations;
+          printf(" %4s", stage.fragments ? "px" : "tri");
+          for (u32 i = PERF_L1D_MISSES; i < PERF_COUNTERS; i++) {
+            if (counters.is_open(i) && units) {
+              printf(" %9.4f", f64(n[i]) / units);
+            } else {
+              printf(" %9s", "-");
+            }
+          }
+        }
+        printf("\n");
+        fprintf(json, "%s\n       \"%s\": {\"median_ms\": %.6f, \"p99_ms\": %.6f, ", s ? "," : "",
+                stage.name, median, p99);
+        fprintf(json, "\"triangles_per_sec\": %.1f, \"fragments_per_sec\": %.1f", triangles_per_sec,
+                fragments_per_sec);
+        if (counting) {
+          write_stage_counters(json, counters, stage, options.iterations);
+        }
+        fprintf(json, "}");
+      }
+      fprintf(json, "\n     }}");
+      arena.reset_to(image_start);
+    }
+    if (streamed) {
+      release_mesh(stream);
+      unlink(meshlet_path);
+    }
+    arena.reset_to(mesh_start);
+  }
+  fprintf(json, "\n  ]\n}\n");
+  if (fclose(json) != 0) {
+    panic("unable to write '%s'", options.output);
+  }
+
+  for (u32 m = 0; m < mesh_count; m++) {
+    if (meshes[m].path == paths[m]) {
+      unlink(meshes[m].path);
+    }
+  }
+  unlink(texture_path);
+}
+
+enum class VideoFormat {
+  // YUV4MPEG2, as 4:4:4 Y'CbCr in BT.601 limited range.
+  Y4m,
+  // Packed BGR, 3 bytes per pixel, with no header.
+  Bgr,
+};
+
+struct VideoOptions {
+  u32 frames = 120;
+  // "-" for stdout. Can be a named pipe.
+  const char *output = "-";
+  VideoFormat format = VideoFormat::Y4m;
+  // Turn the light around the head instead of the head in front of the
+  // camera and light.
+  bool rotate_light = false;
+  f32 zoom = 1.0f;
+  const char *texture_path = nullptr;
+  const char *mesh_path = "head.obj";
+};
+
+// Converts image to a frame of video in out, with the top row first, using
+// row as scratch space for a resolved row.
+static void convert_video_frame(const Image &image, VideoFormat format, Pixel *row, u8 *out) {
+  u64 plane = u64(image.width) * image.height;
+  for (u32 y = 0; y < image.height; y++) {
+    u64 offset = u64(image.height - 1 - y) * image.width;
+    if (format == VideoFormat::Bgr) {
+      image.resolve_row(y, reinterpret_cast<Pixel *>(&out[offset * sizeof(Pixel)]));
+      continue;
+    }
+    image.resolve_row(y, row);
+    u8 *luma = &out[offset];
+    u8 *cb = &out[plane + offset];
+    u8 *cr = &out[2 * plane + offset];
+    for (u32 x = 0; x < image.width; x++) {
+      i32 r = row[x].r;
+      i32 g = row[x].g;
+      i32 b = row[x].b;
+      luma[x] = u8(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+      cb[x] = u8(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+      cr[x] = u8(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+    }
+  }
+}
+
+// Converts image into frame and writes it to fd. Runs on its own thread, so
+// it uses no arena.
+static void write_video_frame(const Image &image, VideoFormat format, Pixel *row, u8 *frame, int fd,
+                              const char *path) {
+  TRACE_SCOPE("write_video_frame");
+  static char frame_header[] = "FRAME\n";
+  convert_video_frame(image, format, row, frame);
+  iovec iov[2];
+  u32 count = 0;
+  if (format == VideoFormat::Y4m) {
+    iov[count++] = {frame_header, sizeof(frame_header) - 1};
+  }
+  iov[count++] = {frame, u64(image.width) * image.height * 3};
+  write_iovecs(fd, iov, count, path);
+}
+
+// Renders frames of the head turning once around y, or of the light turning
+// once around the head, and streams them to options.output. Frames are drawn
+// into two images in turn, so each frame is converted and written on a writer
+// thread while the next one is drawn. The images are handed back and forth
+// through queues, like batch's.
+static void video(const VideoOptions &options, WorkerPool &pool) {
+  constexpr u32 WIDTH = 1000;
+  constexpr u32 HEIGHT = 1000;
+  constexpr f32 pi = 3.14159265f;
+
+  Mesh mesh = load_mesh(options.mesh_path, pool, g_arena);
+  Texture texture;
+  if (options.texture_path) {
+    texture = load_texture(options.texture_path, pool, g_arena);
+  }
+
+  Image images[2];
+  Pixel *rows[2];
+  u8 *frames[2];
+  for (u32 i = 0; i < 2; i++) {
+    images[i] = Image::allocate(WIDTH, HEIGHT, g_arena);
+    rows[i] = g_arena.alloc_array<Pixel>(WIDTH);
+    frames[i] = g_arena.alloc_array<u8>(u64(WIDTH) * HEIGHT * 3);
+  }
+
+  bool to_stdout = strcmp(options.output, "-") == 0;
+  const char *path = to_stdout ? "stdout" : options.output;
+  int fd = to_stdout ? STDOUT_FILENO : open(options.output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    panic("unable to open '%s'", options.output);
+  }
+  if (options.format == VideoFormat::Y4m) {
+    char header[64];
+    int n = snprintf(header, sizeof(header), "YUV4MPEG2 W%u H%u F30:1 Ip A1:1 C444\n", WIDTH, HEIGHT);
+    iovec iov = {header, size_t(n)};
+    write_iovecs(fd, &iov, 1, path);
+  }
+
+  BlockingQueue<u32, 2> free_images, drawn;
+  free_images.push(0);
+  free_images.push(1);
+  std::thread writer([&] {
+    TRACE_THREAD_NAME("video writer");
+    for (u32 slot; drawn.pop(slot);) {
+      write_video_frame(images[slot], options.format, rows[slot], frames[slot], fd, path);
+      free_images.push(slot);
+    }
+  });
+
+  for (u32 i = 0; i < options.frames; i++) {
+    f32 angle = 2.0f * pi * i / options.frames;
+    Mat4 view_projection = Mat4::orthographic(options.zoom);
+    f32x4 light;
+    if (options.rotate_light) {
+      light = Mat4::rotation_y(angle) * SPOTLIGHT;
+    } else {
+      // The light stays put relative to the camera, so in model space it
+      // turns the other way.
+      view_projection = view_projection * Mat4::rotation_y(angle);
+      light = Mat4::rotation_y(-angle) * SPOTLIGHT;
+    }
+
+    u32 slot = 0;
+    free_images.pop(slot);
+    Image &image = images[slot];
+    image.clear();
+    draw_mesh(image, mesh, options.texture_path ? &texture : nullptr, view_projection, {light.x, light.y, light.z},
+              pool, g_frame_arena);
+    g_frame_arena.reset();
+    drawn.push(slot);
+  }
+  drawn.close();
+  writer.join();
+  if (!to_stdout) {
+    close(fd);
+  }
+  release_mesh(mesh);
+}
+
+constexpr u32 MAX_BATCH_DEPTH = 16;
+
+struct BatchOptions {
+  const char *const *paths = nullptr;
+  u32 path_count = 0;
+  // Directory the images are written to, each named after its OBJ file.
+  const char *output_dir = ".";
+  TgaEncoding encoding = TgaEncoding::Rle;
+  OutputMode output_mode = OutputMode::Write;
+  OutputSync output_sync = OutputSync::None;
+  // Threads for parsing and for encoding. The draw stage uses the pool's.
+  u32 load_threads = 1;
+  u32 write_threads = 1;
+  // How many meshes can wait to be drawn, and images to be written.
+  u32 depth = 2;
+  f32 zoom = 1.0f;
+  const char *texture_path = nullptr;
+};
+
+// Times one stage of batch spends working, rather than waiting on a queue.
+struct BatchStage {
+  const char *name;
+  u32 threads;
+  u64 busy_ns;
+};
+
+// Renders each of options.paths to a TGA file as a three-stage pipeline:
+// while mesh i is drawn on pool, mesh i + 1 is loaded on a thread of its own
+// and image i - 1 is encoded and written on another. Each stage has its own
+// worker pool and arena, so they never contend for either. Meshes and images
+// are recycled through a fixed number of slots, which bounds how far the
+// loader can run ahead of drawing and drawing ahead of writing.
+static void batch(const BatchOptions &options, WorkerPool &pool) {
+  constexpr u32 WIDTH = 1000;
+  constexpr u32 HEIGHT = 1000;
+
+  struct MeshSlot {
+    u32 index;
+    Mesh mesh;
+    Arena arena;
+  };
+  struct FrameSlot {
+    u32 index;
+    Image image;
+  };
+
+  Texture texture;
+  if (options.texture_path) {
+    texture = load_texture(options.texture_path, pool, g_arena);
+  }
+
+  // One slot more than the queue depth, for the stage working on it.
+  u32 slot_count = options.depth + 1;
+  MeshSlot *meshes = g_arena.alloc_array<MeshSlot>(slot_count);
+  FrameSlot *frames = g_arena.alloc_array<FrameSlot>(slot_count);
+  BlockingQueue<u32, MAX_BATCH_DEPTH + 1> free_meshes, loaded, free_frames, drawn;
+  for (u32 i = 0; i < slot_count; i++) {
+    meshes[i] = {0, {}, Arena::reserve(u64(16) << 30, 0)};
+    frames[i] = {0, Image::allocate(WIDTH, HEIGHT, g_arena)};
+    free_meshes.push(i);
+    free_frames.push(i);
+  }
+
+  BatchStage load_stage = {"load", options.load_threads, 0};
+  BatchStage draw_stage = {"draw", pool.thread_count + 1, 0};
+  BatchStage write_stage = {"write", options.write_threads, 0};
+  u64 start = now_ns();
+
+  std::thread loader([&] {
+    TRACE_THREAD_NAME("batch loader");
+    WorkerPool load_pool;
+    load_pool.start(options.load_threads - 1, "load worker");
+    for (u32 i = 0; i < options.path_count; i++) {
+      u32 slot = 0;
+      free_meshes.pop(slot);
+      u64 t0 = now_ns();
+      MeshSlot &m = meshes[slot];
+      release_mesh(m.mesh);
+      m.arena.reset();
+      m.index = i;
+      m.mesh = load_mesh(options.paths[i], load_pool, m.arena);
+      load_stage.busy_ns += now_ns() - t0;
+      loaded.push(slot);
+    }
+    loaded.close();
+    load_pool.stop();
+  });
+
+  std::thread writer([&] {
+    TRACE_THREAD_NAME("batch writer");
+    WorkerPool write_pool;
+    write_pool.start(options.write_threads - 1, "write worker");
+    Arena arena = Arena::reserve(u64(16) << 30, 64 * 1024 * 1024);
+    for (u32 slot; drawn.pop(slot);) {
+      u64 t0 = now_ns();
+      FrameSlot &f = frames[slot];
+      const char *path = options.paths[f.index];
+      const char *name = strrchr(path, '/');
+      name = name ? name + 1 : path;
+      const char *extension = strrchr(name, '.');
+      int name_length = extension ? int(extension - name) : int(strlen(name));
+      char output_path[4096];
+      if (snprintf(output_path, sizeof(output_path), "%s/%.*s.tga", options.output_dir, name_length, name) >=
+          int(sizeof(output_path))) {
+        panic("output path for '%s' is too long", path);
+      }
+      f.image.save(output_path, options.encoding, options.output_mode, options.output_sync, write_pool, arena);
+      arena.reset();
+      write_stage.busy_ns += now_ns() - t0;
+      free_frames.push(slot);
+    }
+    write_pool.stop();
+  });
+
+  Mat4 view_projection = Mat4::orthographic(options.zoom);
+  for (u32 mesh_slot; loaded.pop(mesh_slot);) {
+    u32 frame_slot = 0;
+    free_frames.pop(frame_slot);
+    u64 t0 = now_ns();
+    MeshSlot &m = meshes[mesh_slot];
+    FrameSlot &f = frames[frame_slot];
+    f.index = m.index;
+    f.image.clear();
+    draw_mesh(f.image, m.mesh, options.texture_path ? &texture : nullptr, view_projection, SPOTLIGHT, pool,
+              g_frame_arena);
+    g_frame_arena.reset();
+    draw_stage.busy_ns += now_ns() - t0;
+    free_meshes.push(mesh_slot);
+    drawn.push(frame_slot);
+  }
+  drawn.close();
+  loader.join();
+  writer.join();
+  f64 total_ms = (now_ns() - start) / 1e6;
+
+  for (u32 i = 0; i < slot_count; i++) {
+    release_mesh(meshes[i].mesh);
+  }
+
+  printf("batch: %u meshes in %.1f ms, %.1f ms per mesh, queue depth %u\n", options.path_count, total_ms,
+         total_ms / max(options.path_count, 1u), options.depth);
+  const BatchStage stages[] = {load_stage, draw_stage, write_stage};
+  for (const BatchStage &s : stages) {
+    printf("  %-5s  %3u threads  busy %8.1f ms  (%3.0f%%)\n", s.name, s.threads, s.busy_ns / 1e6,
+           total_ms > 0.0 ? 100.0 * s.busy_ns / 1e6 / total_ms : 0.0);
+  }
+}
+
+static void usage(const char *argv0) {
+  printf("usage: %s [-j threads] [-k kernel] [-r fixed|float] [-s flat|smooth] [-f bilinear|trilinear]\n", argv0);
+  printf("             [-b linear|tiled] [-l auto|level] [-e raw|rle|rle-gray] [-z zoom] [-t texture.tga]\n");
+  printf("             [-m write|mmap] [-y none|msync|fdatasync] [-T trace.json] [mesh.obj]\n");
+  printf("       %s bench [-j threads] [-k kernel] [-r fixed|float] [-s flat|smooth] [-f bilinear|trilinear]\n", argv0);
+  printf("             [-b linear|tiled] [-l auto|level] [-e raw|rle|rle-gray] [-n iterations] [-o output.json]\n");
+  printf("             [-T trace.json]\n");
+  printf("       %s video [-j threads] [-k kernel] [-r fixed|float] [-s flat|smooth] [-f bilinear|trilinear]\n", argv0);
+  printf("             [-b linear|tiled] [-l auto|level] [-z zoom] [-t texture.tga] [-n frames] [-o output|-]\n");
+  printf("             [-c y4m|bgr] [-L] [-T trace.json] [mesh.obj]\n");
+  printf("       %s batch [-j threads] [-k kernel] [-r fixed|float] [-s flat|smooth] [-f bilinear|trilinear]\n", argv0);
+  printf("             [-b linear|tiled] [-l auto|level] [-e raw|rle|rle-gray] [-z zoom] [-t texture.tga]\n");
+  printf("             [-m write|mmap] [-y none|msync|fdatasync] [-p load,draw,write threads] [-q depth]\n");
+  printf("             [-o dir] [-T trace.json] mesh.obj...\n");
+  printf("       %s test\n", argv0);
+  printf("kernels:");
+  for (const RasterKernels &k : g_raster_kernels) {
+    printf(" %s", k.name);
+  }
+  printf("\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  bool benchmark = argc > 1 && strcmp(argv[1], "bench") == 0;
+  bool streaming = argc > 1 && strcmp(argv[1], "video") == 0;
+  bool batching = argc > 1 && strcmp(argv[1], "batch") == 0;
+  if (argc > 1 && strcmp(argv[1], "test") == 0) {
+    test();
+    return 0;
+  }
+  if (benchmark || streaming || batching) {
+    optind = 2;
+  }
+
+  BenchOptions options;
+  options.thread_count = std::thread::hardware_concurrency();
+  VideoOptions video_options;
+  BatchOptions batch_options;
+  f32 zoom = 1.0f;
+  const char *texture_path = nullptr;
+  OutputMode output_mode = OutputMode::Write;
+  OutputSync output_sync = OutputSync::None;
+  // Whether -e was given, rather than options.encoding being the default.
+  bool encoding_given = false;
+  const char *trace_path = nullptr;
+  const char *optstring = benchmark   ? "j:k:r:s:f:b:l:e:n:o:T:"
+                          : streaming ? "j:k:r:s:f:b:l:z:t:n:o:c:LT:"
+                          : batching  ? "j:k:r:s:f:b:l:e:z:t:p:q:o:m:y:T:"
+                                      : "j:k:r:s:f:b:l:e:z:t:m:y:T:";
+  for (int opt; (opt = getopt(argc, argv, optstring)) != -1;) {
+    switch (opt) {
+      case 'j':
+        options.thread_count = atoi(optarg);
+        break;
+      case 'k':
+        options.kernel = optarg;
+        break;
+      case 'r':
+        if (strcmp(optarg, "fixed") == 0) {
+          g_fixed_point = true;
+        } else if (strcmp(optarg, "float") == 0) {
+          g_fixed_point = false;
+        } else {
+          usage(argv[0]);
+        }
+        break;
+      case 's':
+        if (strcmp(optarg, "flat") == 0) {
+          g_smooth_shading = false;
+        } else if (strcmp(optarg, "smooth") == 0) {
+          g_smooth_shading = true;
+        } else {
+          usage(argv[0]);
+        }
+        break;
+      case 'f':
+        if (strcmp(optarg, "bilinear") == 0) {
+          g_texture_filter = TextureFilter::Bilinear;
+        } else if (strcmp(optarg, "trilinear") == 0) {
+          g_texture_filter = TextureFilter::Trilinear;
+        } else {
+          usage(argv[0]);
+        }
+        break;
+      case 'b':
+        if (strcmp(optarg, "linear") == 0) {
+          g_framebuffer_layout = FramebufferLayout::Linear;
+        } else if (strcmp(optarg, "tiled") == 0) {
+          g_framebuffer_layout = FramebufferLayout::Tiled;
+        } else {
+          usage(argv[0]);
+        }
+        break;
+      case 'l':
+        if (strcmp(optarg, "auto") == 0) {
+          g_lod = LOD_AUTO;
+        } else if (optarg[0] >= '0' && optarg[0] <= '9') {
+          g_lod = atoi(optarg);
+        } else {
+          usage(argv[0]);
+        }
+        break;
+      case 't':
+        texture_path = optarg;
+        break;
+      case 'e':
+        encoding_given = true;
+        if (strcmp(optarg, "raw") == 0) {
+          options.encoding = TgaEncoding::Raw;
+        } else if (strcmp(optarg, "rle") == 0) {
+          options.encoding = TgaEncoding::Rle;
+        } else if (strcmp(optarg, "rle-gray") == 0) {
+          options.encoding = TgaEncoding::RleGray;
+        } else {
+          usage(argv[0]);
+        }
+        break;
+      case 'm':
+        if (strcmp(optarg, "write") == 0) {
+          output_mode = OutputMode::Write;
+        } else if (strcmp(optarg, "mmap") == 0) {
+          output_mode = OutputMode::Mmap;
+        } else {
+          usage(argv[0]);
+        }
+        break;
+      case 'y':
+        if (strcmp(optarg, "none") == 0) {
+          output_sync = OutputSync::None;
+        } else if (strcmp(optarg, "msync") == 0) {
+          output_sync = OutputSync::Msync;
+        } else if (strcmp(optarg, "fdatasync") == 0) {
+          output_sync = OutputSync::Fdatasync;
+        } else {
+          usage(argv[0]);
+        }
+        break;
+      case 'z':
+        zoom = atof(optarg);
+        if (!(zoom > 0.0f)) {
+          usage(argv[0]);
+        }
+        break;
+      case 'n':
+        options.iterations = atoi(optarg);
+        if (options.iterations == 0) {
+          usage(argv[0]);
+        }
+        video_options.frames = options.iterations;
+        break;
+      case 'o':
+        options.output = optarg;
+        video_options.output = optarg;
+        batch_options.output_dir = optarg;
+        break;
+      case 'p': {
+        u32 load, draw, write;
+        if (sscanf(optarg, "%u,%u,%u", &load, &draw, &write) != 3 || !load || !draw || !write) {
+          usage(argv[0]);
+        }
+        batch_options.load_threads = load;
+        options.thread_count = draw;
+        batch_options.write_threads = write;
+        break;
+      }
+      case 'q':
+        batch_options.depth = atoi(optarg);
+        if (batch_options.depth < 1 || batch_options.depth > MAX_BATCH_DEPTH) {
+          usage(argv[0]);
+        }
+        break;
+      case 'c':
+        if (strcmp(optarg, "y4m") == 0) {
+          video_options.format = VideoFormat::Y4m;
+        } else if (strcmp(optarg, "bgr") == 0) {
+          video_options.format = VideoFormat::Bgr;
+        } else {
+          usage(argv[0]);
+        }
+        break;
+      case 'L':
+        video_options.rotate_light = true;
+        break;
+      case 'T':
+        trace_path = optarg;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  if (output_sync == OutputSync::Msync && output_mode != OutputMode::Mmap) {
+    usage(argv[0]);
+  }
+  // A mapped file is sized before anything is written to it, so it can't be
+  // run-length encoded.
+  if (output_mode == OutputMode::Mmap) {
+    if (encoding_given && options.encoding != TgaEncoding::Raw) {
+      usage(argv[0]);
+    }
+    options.encoding = TgaEncoding::Raw;
+  }
+
+  const RasterKernels *k = select_raster_kernels(options.kernel);
+  if (!k) {
+    panic("kernel '%s' is not supported on this CPU", options.kernel);
+  }
+  g_kernels = k;
+  options.kernel = k->name;
+  options.thread_count = max(options.thread_count, 1u);
+  if ((batching && optind >= argc) || (!batching && !benchmark && optind < argc - 1)) {
+    usage(argv[0]);
+  }
+  const char *mesh_path = optind < argc ? argv[optind] : "head.obj";
+  if (trace_path) {
+#if SWR_TRACE
+    start_tracing();
+    TRACE_THREAD_NAME("main");
+#else
+    panic("tracing is compiled out; build with -DSWR_TRACE=1, as make trace.out does");
+#endif
+  }
+
+  // Opened before the workers start, so the counters follow them.
+  PerfCounters counters;
+  if (benchmark) {
+    counters = PerfCounters::open();
+  }
+
+  WorkerPool pool;
+  pool.start(options.thread_count - 1);
+
+  if (benchmark) {
+    bench(options, counters, pool);
+    counters.close();
+  } else if (batching) {
+    batch_options.paths = &argv[optind];
+    batch_options.path_count = argc - optind;
+    batch_options.encoding = options.encoding;
+    batch_options.output_mode = output_mode;
+    batch_options.output_sync = output_sync;
+    batch_options.zoom = zoom;
+    batch_options.texture_path = texture_path;
+    batch(batch_options, pool);
+  } else if (streaming) {
+    video_options.mesh_path = mesh_path;
+    video_options.zoom = zoom;
+    video_options.texture_path = texture_path;
+    video(video_options, pool);
+  } else {
+    Image image = Image::allocate(1000, 1000, g_arena);
+    Mesh mesh = load_mesh(mesh_path, pool, g_arena);
+    Texture texture;
+    if (texture_path) {
+      texture = load_texture(texture_path, pool, g_arena);
+    }
+    Mat4 view_projection = Mat4::orthographic(zoom);
+    draw_mesh(image, mesh, texture_path ? &texture : nullptr, view_projection, SPOTLIGHT, pool, g_frame_arena);
+    g_frame_arena.reset();
+    release_mesh(mesh);
+
+    image.save("out.tga", options.encoding, output_mode, output_sync, pool, g_frame_arena);
+    g_frame_arena.reset();
+  }
+  pool.stop();
+
+#if SWR_TRACE
+  if (trace_path) {
+    write_trace(trace_path);
+  }
+#endif
 }
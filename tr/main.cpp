@@ -1,11 +1,23 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstdint>
+#include <cstring>
 #include <cassert>
+#include <cfloat>
+#include <cmath>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <new>
+#include <thread>
 #include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 using u8 = uint8_t;
 using u16 = uint16_t;
@@ -18,6 +30,11 @@ using i64 = int64_t;
 using f32 = float;
 using f64 = double;
 
+// Marks code that has to give the same results with every kernel. -ffast-math
+// lets GCC swap division for approximate reciprocals, in vector code even at
+// -O0, and round differently wherever it's inlined, so it's built without.
+#define EXACT_MATH __attribute__((optimize("no-unsafe-math-optimizations")))
+
 template<typename T, int N>
 struct SmallVector {
   int len = 0;
@@ -71,12 +88,30 @@ struct Pair {
   B y;
 };
 
+template<typename T>
+static T min(T a, T b) {
+  return a < b ? a : b;
+}
+
+template<typename T>
+static T max(T a, T b) {
+  return a > b ? a : b;
+}
+
+static u64 now_ns() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return u64(ts.tv_sec) * 1000000000 + u64(ts.tv_nsec);
+}
+
 static Pair<void*, size_t> mmap_file(const char* path) {
   int fd = open(path, O_RDONLY);
   assert(fd != -1);
 
   struct stat st;
-  assert(fstat(fd, &st) == 0);
+  int ok = fstat(fd, &st);
+  assert(ok == 0);
+  (void)ok;
   size_t size = static_cast<size_t>(st.st_size);
 
   void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
@@ -86,12 +121,51 @@ static Pair<void*, size_t> mmap_file(const char* path) {
   return {addr, size};
 }
 
-struct f32x3 { f32 x, y, z; };
-struct u16x3 { u16 x, y, z; };
+struct f32x3 {
+  f32 x, y, z;
+
+  f32 operator[](int axis) const {
+    return (&x)[axis];
+  }
+};
+
+struct u32x3 { u32 x, y, z; };
+
+static f32x3 operator+(f32x3 a, f32x3 b) {
+  return {a.x + b.x, a.y + b.y, a.z + b.z};
+}
+
+static f32x3 operator-(f32x3 a, f32x3 b) {
+  return {a.x - b.x, a.y - b.y, a.z - b.z};
+}
+
+static f32x3 operator*(f32x3 a, f32 s) {
+  return {a.x * s, a.y * s, a.z * s};
+}
+
+static f32x3 min(f32x3 a, f32x3 b) {
+  return {min(a.x, b.x), min(a.y, b.y), min(a.z, b.z)};
+}
+
+static f32x3 max(f32x3 a, f32x3 b) {
+  return {max(a.x, b.x), max(a.y, b.y), max(a.z, b.z)};
+}
+
+static f32 dot(f32x3 a, f32x3 b) {
+  return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+static f32x3 cross(f32x3 a, f32x3 b) {
+  return {a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x};
+}
+
+static f32x3 normalize(f32x3 a) {
+  return a * (1.0f / sqrtf(dot(a, a)));
+}
 
 struct Obj {
   Vector<f32x3> vertices;
-  Vector<u16x3> faces;
+  Vector<u32x3> faces;
 };
 
 struct Parser {
@@ -153,18 +227,18 @@ struct Parser {
   f32 parse_f32() {
     char* end;
     f32 x = strtof(&s[i], &end);
-    assert(end != s);
+    assert(end != &s[i]);
     i = end - s;
     return x;
   }
 
-  u16 parse_u16() {
+  u32 parse_u32() {
     char* end;
     unsigned long x = strtoul(&s[i], &end, 10);
-    assert(end != s);
-    assert(x <= UINT16_MAX);
+    assert(end != &s[i]);
+    assert(x <= UINT32_MAX);
     i = end - s;
-    return u16(x);
+    return u32(x);
   }
 };
 
@@ -176,17 +250,14 @@ static Obj load_obj(const char* path) {
   auto p = Parser{s, 0};
   for (;;) {
     f32 v[3];
-    u16 u[3];
+    u32 u[3];
     switch (p.bump()) {
       case '\0':
         goto done;
       case 'v':
         switch (p.bump()) {
           case 'n':
-            printf("vn ? ? ?\n");
-            break;
           case 't':
-            printf("vt ? ? ?\n");
             break;
           default:
             for (int i = 0; i < 3; i++) {
@@ -194,18 +265,19 @@ static Obj load_obj(const char* path) {
               v[i] = p.parse_f32();
             }
             obj.vertices.push({v[0], v[1], v[2]});
-            printf("v %f %f %f\n", v[0], v[1], v[2]);
             break;
         }
         break;
       case 'f':
         for (int i = 0; i < 3; i++) {
           p.skip_space();
-          u[i] = p.parse_u16();
+          // OBJ indices start at 1.
+          u[i] = p.parse_u32();
+          assert(u[i] >= 1);
+          u[i]--;
           p.skip_to_space();
         }
         obj.faces.push({u[0], u[1], u[2]});
-        printf("f %hu %hu %hu\n", u[0], u[1], u[2]);
         break;
     }
     p.skip_to_next_line();
@@ -227,13 +299,1487 @@ struct Image {
   static Image from_array(Pixel (&array)[H][W]) {
     return {&array[0][0], W, H};
   }
+
+  // Rows are stored bottom up, as in a TGA file.
+  Pixel& at(int x, int y) {
+    assert(x >= 0 && x < width);
+    assert(y >= 0 && y < height);
+    return pixels[y * width + x];
+  }
+
+  void save_as_tga_file(const char* path) {
+    u8 header[18] = {};
+    header[2] = 2;
+    header[12] = width & 0xFF;
+    header[13] = (width >> 8) & 0xFF;
+    header[14] = height & 0xFF;
+    header[15] = (height >> 8) & 0xFF;
+    header[16] = 24;
+
+    auto f = fopen(path, "wb");
+    assert(f);
+    fwrite(header, sizeof(header), 1, f);
+    fwrite(pixels, sizeof(Pixel), size_t(width) * height, f);
+    auto ok = !ferror(f);
+    ok = fclose(f) == 0 && ok;
+    assert(ok);
+    (void)ok;
+  }
+};
+
+struct Aabb {
+  f32x3 min = {FLT_MAX, FLT_MAX, FLT_MAX};
+  f32x3 max = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+
+  void grow(f32x3 p) {
+    min = ::min(min, p);
+    max = ::max(max, p);
+  }
+
+  void grow(const Aabb& b) {
+    min = ::min(min, b.min);
+    max = ::max(max, b.max);
+  }
+
+  // Half the surface area, which is all the SAH needs.
+  f32 half_area() const {
+    auto d = max - min;
+    return d.x < 0.0f ? 0.0f : d.x * d.y + d.y * d.z + d.z * d.x;
+  }
+};
+
+// A triangle as one corner and the two edges from it, which is what the
+// intersection test wants.
+struct Triangle {
+  f32x3 v0;
+  f32x3 e1;
+  f32x3 e2;
+};
+
+// A BVH node, 32 bytes so two of them share a cache line. The children of an
+// inner node are next to each other, so it only stores the first.
+struct BvhNode {
+  f32x3 min;
+  // First child for an inner node, or first triangle for a leaf.
+  u32 first;
+  f32x3 max;
+  // Number of triangles in a leaf, or 0 for an inner node.
+  u32 count;
 };
 
+static_assert(sizeof(BvhNode) == 32);
+
+// A bounding volume hierarchy over a mesh's triangles, flattened into an
+// array with the root first. Leaves index straight into triangles, which is
+// sorted so each leaf's are contiguous.
+struct Bvh {
+  BvhNode* nodes;
+  u32 node_count;
+  Triangle* triangles;
+  // Index of each of triangles in the Obj it came from.
+  u32* faces;
+  u32 triangle_count;
+};
+
+// Builds a Bvh with the surface area heuristic, evaluated at the boundaries
+// of BINS bins of triangle centroids along each axis. The two halves of
+// large nodes are built on separate threads.
+struct BvhBuilder {
+  static constexpr int BINS = 16;
+  // Leaves never get bigger than this, even when the SAH says to stop.
+  static constexpr u32 MAX_LEAF_SIZE = 8;
+  // Nodes this deep or deeper are split at the median instead of with the
+  // SAH, which takes at most 32 more levels to get down to leaves. Nothing
+  // is deeper than MAX_DEPTH then, so traversal stacks can be fixed size.
+  static constexpr int MEDIAN_DEPTH = 32;
+  static constexpr int MAX_DEPTH = MEDIAN_DEPTH + 32;
+  // Cost of visiting a node, relative to intersecting a triangle.
+  static constexpr f32 TRAVERSAL_COST = 1.0f;
+  // Nodes with fewer triangles than this aren't worth a thread.
+  static constexpr u32 MIN_PARALLEL_TRIANGLES = 4096;
+
+  Aabb* bounds;
+  f32x3* centroids;
+  u32* indices;
+  BvhNode* nodes;
+  std::atomic<u32> node_count;
+  // How deep in the tree new threads are still started.
+  int parallel_depth;
+
+  static Bvh build(const Obj& obj, int thread_count) {
+    auto n = u32(obj.faces.len);
+    BvhBuilder b;
+    b.bounds = static_cast<Aabb*>(malloc(n * sizeof(Aabb)));
+    b.centroids = static_cast<f32x3*>(malloc(n * sizeof(f32x3)));
+    b.indices = static_cast<u32*>(malloc(n * sizeof(u32)));
+    // A binary tree with at most one triangle per leaf has 2n - 1 nodes.
+    b.nodes = static_cast<BvhNode*>(aligned_alloc(64, max(2 * n, 2u) * sizeof(BvhNode)));
+    b.node_count = 1;
+    b.parallel_depth = 0;
+    while ((1 << b.parallel_depth) < thread_count) {
+      b.parallel_depth++;
+    }
+
+    for (u32 i = 0; i < n; i++) {
+      auto f = obj.faces[i];
+      Aabb box;
+      box.grow(obj.vertices[f.x]);
+      box.grow(obj.vertices[f.y]);
+      box.grow(obj.vertices[f.z]);
+      b.bounds[i] = box;
+      b.centroids[i] = (box.min + box.max) * 0.5f;
+      b.indices[i] = i;
+    }
+    b.build_node(0, 0, n, 0);
+
+    Bvh bvh;
+    bvh.nodes = b.nodes;
+    bvh.node_count = b.node_count;
+    bvh.triangle_count = n;
+    bvh.triangles = static_cast<Triangle*>(malloc(max(n, 1u) * sizeof(Triangle)));
+    bvh.faces = b.indices;
+    for (u32 i = 0; i < n; i++) {
+      auto f = obj.faces[b.indices[i]];
+      auto v0 = obj.vertices[f.x];
+      bvh.triangles[i] = {v0, obj.vertices[f.y] - v0, obj.vertices[f.z] - v0};
+    }
+    free(b.bounds);
+    free(b.centroids);
+    return bvh;
+  }
+
+  void build_node(u32 node, u32 first, u32 count, int depth) {
+    Aabb box, centroid_box;
+    for (u32 i = first; i < first + count; i++) {
+      box.grow(bounds[indices[i]]);
+      centroid_box.grow(centroids[indices[i]]);
+    }
+    auto& out = nodes[node];
+    out.min = box.min;
+    out.max = box.max;
+    out.first = first;
+    out.count = count;
+    if (count <= 1) {
+      return;
+    }
+    if (depth >= MEDIAN_DEPTH) {
+      if (count > MAX_LEAF_SIZE) {
+        split(node, first, count, first + count / 2, depth);
+      }
+      return;
+    }
+
+    struct Bin {
+      Aabb box;
+      u32 count = 0;
+    };
+
+    // Find the cheapest split over all three axes.
+    auto leaf_cost = f32(count) * box.half_area();
+    auto best_cost = FLT_MAX;
+    int best_axis = -1;
+    int best_split = 0;
+    for (int axis = 0; axis < 3; axis++) {
+      auto lo = centroid_box.min[axis];
+      auto extent = centroid_box.max[axis] - lo;
+      if (!(extent > 0.0f)) {
+        continue;
+      }
+      auto scale = BINS / extent;
+      Bin bins[BINS];
+      for (u32 i = first; i < first + count; i++) {
+        auto t = indices[i];
+        auto b = min(int((centroids[t][axis] - lo) * scale), BINS - 1);
+        bins[b].count++;
+        bins[b].box.grow(bounds[t]);
+      }
+      // Sweep from the right to get the cost of everything right of each
+      // boundary, then from the left to add the rest.
+      f32 right_cost[BINS];
+      Aabb right;
+      u32 right_count = 0;
+      for (int i = BINS - 1; i > 0; i--) {
+        right.grow(bins[i].box);
+        right_count += bins[i].count;
+        right_cost[i] = f32(right_count) * right.half_area();
+      }
+      Aabb left;
+      u32 left_count = 0;
+      for (int i = 0; i < BINS - 1; i++) {
+        left.grow(bins[i].box);
+        left_count += bins[i].count;
+        auto cost = f32(left_count) * left.half_area() + right_cost[i + 1];
+        if (left_count && left_count < count && cost < best_cost) {
+          best_cost = cost;
+          best_axis = axis;
+          best_split = i + 1;
+        }
+      }
+    }
+
+    if (count <= MAX_LEAF_SIZE && (best_axis < 0 || TRAVERSAL_COST * box.half_area() + best_cost >= leaf_cost)) {
+      return;
+    }
+    if (best_axis < 0) {
+      // The centroids all coincide, so no bin boundary separates them. Any
+      // split is as good as another.
+      split(node, first, count, first + count / 2, depth);
+      return;
+    }
+
+    // Partition the triangles about the chosen bin boundary.
+    auto lo = centroid_box.min[best_axis];
+    auto scale = BINS / (centroid_box.max[best_axis] - lo);
+    auto i = first;
+    auto j = first + count;
+    while (i < j) {
+      if (min(int((centroids[indices[i]][best_axis] - lo) * scale), BINS - 1) < best_split) {
+        i++;
+      } else {
+        j--;
+        auto t = indices[i];
+        indices[i] = indices[j];
+        indices[j] = t;
+      }
+    }
+    split(node, first, count, i, depth);
+  }
+
+  // Makes node an inner node whose children get the triangles before and
+  // from middle on, and builds them.
+  void split(u32 node, u32 first, u32 count, u32 middle, int depth) {
+    auto left_count = middle - first;
+    auto children = node_count.fetch_add(2);
+    nodes[node].first = children;
+    nodes[node].count = 0;
+    if (depth < parallel_depth && count >= MIN_PARALLEL_TRIANGLES) {
+      std::thread left([=, this] { build_node(children, first, left_count, depth + 1); });
+      build_node(children + 1, middle, count - left_count, depth + 1);
+      left.join();
+    } else {
+      build_node(children, first, left_count, depth + 1);
+      build_node(children + 1, middle, count - left_count, depth + 1);
+    }
+  }
+};
+
+struct Ray {
+  f32x3 origin;
+  f32x3 dir;
+  f32x3 inv_dir;
+
+  static Ray make(f32x3 origin, f32x3 dir) {
+    // Keep the reciprocal finite, since -ffast-math assumes there are no
+    // infinities.
+    auto inv = [](f32 d) { return 1.0f / (fabsf(d) < 1e-20f ? copysignf(1e-20f, d) : d); };
+    return {origin, dir, {inv(dir.x), inv(dir.y), inv(dir.z)}};
+  }
+};
+
+struct Hit {
+  f32 t;
+  u32 triangle;
+};
+
+// Distance along ray to where it enters node's box, or FLT_MAX if it misses
+// it or only gets there after t_max.
+static f32 intersect_box(const BvhNode& node, const Ray& ray, f32 t_max) {
+  auto t0 = (node.min - ray.origin);
+  auto t1 = (node.max - ray.origin);
+  f32 lo[3], hi[3];
+  for (int i = 0; i < 3; i++) {
+    auto a = t0[i] * ray.inv_dir[i];
+    auto b = t1[i] * ray.inv_dir[i];
+    lo[i] = min(a, b);
+    hi[i] = max(a, b);
+  }
+  auto enter = max(max(lo[0], lo[1]), max(lo[2], 0.0f));
+  auto exit = min(min(hi[0], hi[1]), min(hi[2], t_max));
+  return enter <= exit ? enter : FLT_MAX;
+}
+
+// Moller-Trumbore. Returns the distance along ray to triangle, or FLT_MAX if
+// it misses.
+static f32 intersect_triangle(const Triangle& tri, const Ray& ray) {
+  auto p = cross(ray.dir, tri.e2);
+  auto det = dot(tri.e1, p);
+  if (fabsf(det) < 1e-12f) {
+    return FLT_MAX;
+  }
+  auto inv_det = 1.0f / det;
+  auto s = ray.origin - tri.v0;
+  auto u = dot(s, p) * inv_det;
+  if (u < 0.0f || u > 1.0f) {
+    return FLT_MAX;
+  }
+  auto q = cross(s, tri.e1);
+  auto v = dot(ray.dir, q) * inv_det;
+  if (v < 0.0f || u + v > 1.0f) {
+    return FLT_MAX;
+  }
+  auto t = dot(tri.e2, q) * inv_det;
+  return t > 0.0f ? t : FLT_MAX;
+}
+
+// Finds the nearest triangle that ray hits before t_max, or with any_hit,
+// the first one found, which is all a shadow ray needs. Returns false if
+// there is none.
+static bool trace(const Bvh& bvh, const Ray& ray, f32 t_max, bool any_hit, Hit* hit) {
+  if (bvh.triangle_count == 0 || intersect_box(bvh.nodes[0], ray, t_max) == FLT_MAX) {
+    return false;
+  }
+  auto found = false;
+  // Inner nodes are less than MAX_DEPTH deep, and each pushes at most one.
+  u32 stack[BvhBuilder::MAX_DEPTH];
+  int top = 0;
+  u32 node = 0;
+  for (;;) {
+    auto& n = bvh.nodes[node];
+    if (n.count) {
+      for (u32 i = n.first; i < n.first + n.count; i++) {
+        auto t = intersect_triangle(bvh.triangles[i], ray);
+        if (t < t_max) {
+          t_max = t;
+          hit->t = t;
+          hit->triangle = i;
+          found = true;
+          if (any_hit) {
+            return true;
+          }
+        }
+      }
+    } else {
+      // Visit the nearer child first, and come back for the other.
+      auto a = n.first;
+      auto b = n.first + 1;
+      auto ta = intersect_box(bvh.nodes[a], ray, t_max);
+      auto tb = intersect_box(bvh.nodes[b], ray, t_max);
+      if (tb < ta) {
+        auto t = ta;
+        ta = tb;
+        tb = t;
+        a = b;
+        b = n.first;
+      }
+      if (ta != FLT_MAX) {
+        if (tb != FLT_MAX) {
+          assert(top < BvhBuilder::MAX_DEPTH);
+          stack[top++] = b;
+        }
+        node = a;
+        continue;
+      }
+    }
+    if (top == 0) {
+      return found;
+    }
+    node = stack[--top];
+  }
+}
+
+// A child of a Bvh8Node that's a leaf has this bit set, the number of
+// TriangleBlocks in it above BVH8_LEAF_BLOCKS_SHIFT, and the first one below.
+constexpr u32 BVH8_LEAF = 0x80000000;
+constexpr u32 BVH8_LEAF_BLOCKS_SHIFT = 24;
+constexpr u32 BVH8_LEAF_FIRST_MASK = (1u << BVH8_LEAF_BLOCKS_SHIFT) - 1;
+
+// A node of an 8-wide BVH, with the boxes of its children stored side by
+// side so a ray can be tested against all of them at once. Padded to four
+// cache lines.
+struct Bvh8Node {
+  f32 min_x[8];
+  f32 min_y[8];
+  f32 min_z[8];
+  f32 max_x[8];
+  f32 max_y[8];
+  f32 max_z[8];
+  // A node index, or a leaf as described by BVH8_LEAF.
+  u32 child[8];
+  // Number of children, which are the first of the 8 slots.
+  u32 count;
+  u32 padding[7];
+};
+
+static_assert(sizeof(Bvh8Node) == 256);
+
+// 8 triangles stored side by side like Triangle, so a ray can be tested
+// against all of them at once, or each can be tested against a packet of 8
+// rays. Leaves are padded out to whole blocks with degenerate triangles,
+// which nothing hits.
+struct TriangleBlock {
+  f32 v0_x[8];
+  f32 v0_y[8];
+  f32 v0_z[8];
+  f32 e1_x[8];
+  f32 e1_y[8];
+  f32 e1_z[8];
+  f32 e2_x[8];
+  f32 e2_y[8];
+  f32 e2_z[8];
+  // Index of each in Bvh::triangles.
+  u32 triangle[8];
+};
+
+// A Bvh collapsed to 8 children per node, which halves its depth or better
+// and lets each step of traversal test 8 boxes with SIMD.
+struct Bvh8 {
+  Bvh8Node* nodes;
+  u32 node_count;
+  TriangleBlock* blocks;
+  u32 block_count;
+
+  static Bvh8 collapse(const Bvh& bvh) {
+    // No more nodes than the binary tree has inner nodes, and no more blocks
+    // than its leaves fill.
+    u32 max_nodes = 1;
+    u32 max_blocks = 0;
+    for (u32 i = 0; i < bvh.node_count; i++) {
+      auto& n = bvh.nodes[i];
+      max_nodes += n.count == 0;
+      max_blocks += (n.count + 7) / 8;
+    }
+    Bvh8 b;
+    b.nodes = static_cast<Bvh8Node*>(aligned_alloc(64, max_nodes * sizeof(Bvh8Node)));
+    b.blocks = static_cast<TriangleBlock*>(aligned_alloc(64, max(max_blocks, 1u) * sizeof(TriangleBlock)));
+    b.node_count = 0;
+    b.block_count = 0;
+    if (bvh.triangle_count) {
+      b.collapse_node(bvh, 0);
+    }
+    return b;
+  }
+
+  // Finds the triangles under bvh node, which are contiguous since the
+  // builder partitions them in place. Returns their number.
+  static u32 subtree_triangles(const Bvh& bvh, u32 node, u32* first) {
+    auto& n = bvh.nodes[node];
+    if (n.count) {
+      *first = n.first;
+      return n.count;
+    }
+    u32 right_first;
+    return subtree_triangles(bvh, n.first, first) + subtree_triangles(bvh, n.first + 1, &right_first);
+  }
+
+  // Makes a node of up to 8 descendants of bvh node, by opening the inner
+  // child with the largest surface area until there are 8 or only leaves.
+  // Subtrees that fit in a block become a single leaf, since testing 8
+  // triangles costs no more than testing one.
+  u32 collapse_node(const Bvh& bvh, u32 node) {
+    struct Slot {
+      u32 node;
+      // The leaf's triangles, or 0 triangles for an inner node.
+      u32 first;
+      u32 count;
+    };
+    auto make_slot = [&](u32 node) {
+      Slot s = {node, 0, 0};
+      auto count = subtree_triangles(bvh, node, &s.first);
+      if (count <= 8 || bvh.nodes[node].count) {
+        s.count = count;
+      }
+      return s;
+    };
+    Slot slots[8];
+    int n = 0;
+    auto& root = bvh.nodes[node];
+    if (root.count) {
+      slots[n++] = make_slot(node);
+    } else {
+      slots[n++] = make_slot(root.first);
+      slots[n++] = make_slot(root.first + 1);
+    }
+    while (n < 8) {
+      auto best = -1;
+      auto best_area = -1.0f;
+      for (int i = 0; i < n; i++) {
+        auto& c = bvh.nodes[slots[i].node];
+        auto area = Aabb{c.min, c.max}.half_area();
+        if (slots[i].count == 0 && area > best_area) {
+          best = i;
+          best_area = area;
+        }
+      }
+      if (best < 0) {
+        break;
+      }
+      auto first = bvh.nodes[slots[best].node].first;
+      slots[best] = make_slot(first);
+      slots[n++] = make_slot(first + 1);
+    }
+
+    auto index = node_count++;
+    Bvh8Node out = {};
+    out.count = n;
+    for (int i = 0; i < n; i++) {
+      auto& s = slots[i];
+      auto& c = bvh.nodes[s.node];
+      out.min_x[i] = c.min.x;
+      out.min_y[i] = c.min.y;
+      out.min_z[i] = c.min.z;
+      out.max_x[i] = c.max.x;
+      out.max_y[i] = c.max.y;
+      out.max_z[i] = c.max.z;
+      out.child[i] = s.count ? add_leaf(bvh, s.first, s.count) : collapse_node(bvh, s.node);
+    }
+    nodes[index] = out;
+    return index;
+  }
+
+  u32 add_leaf(const Bvh& bvh, u32 first_triangle, u32 triangle_count) {
+    auto count = (triangle_count + 7) / 8;
+    assert(count < (1u << (31 - BVH8_LEAF_BLOCKS_SHIFT)));
+    assert(block_count <= BVH8_LEAF_FIRST_MASK);
+    auto first = block_count;
+    for (u32 b = 0; b < count; b++) {
+      auto& out = blocks[block_count++];
+      out = {};
+      for (u32 j = 0; j < 8; j++) {
+        auto i = b * 8 + j;
+        if (i >= triangle_count) {
+          // The padding is already zeroed, so it's degenerate.
+          out.triangle[j] = first_triangle;
+          continue;
+        }
+        auto& t = bvh.triangles[first_triangle + i];
+        out.v0_x[j] = t.v0.x;
+        out.v0_y[j] = t.v0.y;
+        out.v0_z[j] = t.v0.z;
+        out.e1_x[j] = t.e1.x;
+        out.e1_y[j] = t.e1.y;
+        out.e1_z[j] = t.e1.z;
+        out.e2_x[j] = t.e2.x;
+        out.e2_y[j] = t.e2.y;
+        out.e2_z[j] = t.e2.z;
+        out.triangle[j] = first_triangle + i;
+      }
+    }
+    return BVH8_LEAF | count << BVH8_LEAF_BLOCKS_SHIFT | first;
+  }
+};
+
+// 8 rays, one per SIMD lane.
+struct alignas(32) RayPacket {
+  f32 origin_x[8];
+  f32 origin_y[8];
+  f32 origin_z[8];
+  f32 dir_x[8];
+  f32 dir_y[8];
+  f32 dir_z[8];
+  f32 inv_dir_x[8];
+  f32 inv_dir_y[8];
+  f32 inv_dir_z[8];
+
+  void set(int lane, const Ray& ray) {
+    origin_x[lane] = ray.origin.x;
+    origin_y[lane] = ray.origin.y;
+    origin_z[lane] = ray.origin.z;
+    dir_x[lane] = ray.dir.x;
+    dir_y[lane] = ray.dir.y;
+    dir_z[lane] = ray.dir.z;
+    inv_dir_x[lane] = ray.inv_dir.x;
+    inv_dir_y[lane] = ray.inv_dir.y;
+    inv_dir_z[lane] = ray.inv_dir.z;
+  }
+};
+
+#if defined(__x86_64__)
+// The same test as intersect_triangle, for 8 pairs of rays and triangles,
+// any of which can be the same in every lane. Returns the distance to each
+// hit that's nearer than t_max, or t_max for each miss.
+__attribute__((target("avx2"))) EXACT_MATH
+static __m256 intersect_triangles_avx2(const __m256 v0[3], const __m256 e1[3], const __m256 e2[3],
+                                       const __m256 o[3], const __m256 d[3], __m256 t_max)
+{
+  auto zero = _mm256_setzero_ps();
+  auto one = _mm256_set1_ps(1.0f);
+  auto px = _mm256_sub_ps(_mm256_mul_ps(d[1], e2[2]), _mm256_mul_ps(d[2], e2[1]));
+  auto py = _mm256_sub_ps(_mm256_mul_ps(d[2], e2[0]), _mm256_mul_ps(d[0], e2[2]));
+  auto pz = _mm256_sub_ps(_mm256_mul_ps(d[0], e2[1]), _mm256_mul_ps(d[1], e2[0]));
+  auto det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1[0], px), _mm256_mul_ps(e1[1], py)),
+                           _mm256_mul_ps(e1[2], pz));
+  auto abs_det = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), det);
+  auto inv_det = _mm256_div_ps(one, det);
+  auto sx = _mm256_sub_ps(o[0], v0[0]);
+  auto sy = _mm256_sub_ps(o[1], v0[1]);
+  auto sz = _mm256_sub_ps(o[2], v0[2]);
+  auto u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)),
+                                       _mm256_mul_ps(sz, pz)), inv_det);
+  auto qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1[2]), _mm256_mul_ps(sz, e1[1]));
+  auto qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1[0]), _mm256_mul_ps(sx, e1[2]));
+  auto qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1[1]), _mm256_mul_ps(sy, e1[0]));
+  auto v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(d[0], qx), _mm256_mul_ps(d[1], qy)),
+                                       _mm256_mul_ps(d[2], qz)), inv_det);
+  auto t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2[0], qx), _mm256_mul_ps(e2[1], qy)),
+                                       _mm256_mul_ps(e2[2], qz)), inv_det);
+  auto hit = _mm256_cmp_ps(abs_det, _mm256_set1_ps(1e-12f), _CMP_GE_OQ);
+  hit = _mm256_and_ps(hit, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+  hit = _mm256_and_ps(hit, _mm256_cmp_ps(u, one, _CMP_LE_OQ));
+  hit = _mm256_and_ps(hit, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+  hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+  hit = _mm256_and_ps(hit, _mm256_cmp_ps(t, zero, _CMP_GT_OQ));
+  hit = _mm256_and_ps(hit, _mm256_cmp_ps(t, t_max, _CMP_LT_OQ));
+  return _mm256_blendv_ps(t_max, t, hit);
+}
+
+// The same test as intersect_box, for 8 pairs of rays and boxes. Returns the
+// entry distances, and sets *hit to a lane mask of the boxes that are hit.
+__attribute__((target("avx2")))
+static __m256 intersect_boxes_avx2(const __m256 lo[3], const __m256 hi[3], const __m256 o[3],
+                                   const __m256 inv_d[3], __m256 t_max, int* hit)
+{
+  __m256 enter = _mm256_setzero_ps();
+  __m256 exit = t_max;
+  for (int i = 0; i < 3; i++) {
+    auto a = _mm256_mul_ps(_mm256_sub_ps(lo[i], o[i]), inv_d[i]);
+    auto b = _mm256_mul_ps(_mm256_sub_ps(hi[i], o[i]), inv_d[i]);
+    enter = _mm256_max_ps(enter, _mm256_min_ps(a, b));
+    exit = _mm256_min_ps(exit, _mm256_max_ps(a, b));
+  }
+  *hit = _mm256_movemask_ps(_mm256_cmp_ps(enter, exit, _CMP_LE_OQ));
+  return enter;
+}
+
+__attribute__((target("avx2")))
+static f32 horizontal_min_avx2(__m256 v) {
+  auto m = _mm_min_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  m = _mm_min_ps(m, _mm_shuffle_ps(m, m, 0x4E));
+  m = _mm_min_ps(m, _mm_shuffle_ps(m, m, 0xB1));
+  return _mm_cvtss_f32(m);
+}
+
+__attribute__((target("avx2")))
+static f32 horizontal_max_avx2(__m256 v) {
+  auto m = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  m = _mm_max_ps(m, _mm_shuffle_ps(m, m, 0x4E));
+  m = _mm_max_ps(m, _mm_shuffle_ps(m, m, 0xB1));
+  return _mm_cvtss_f32(m);
+}
+#endif
+
+// Traversal stack for a Bvh8, which holds each entry's distance so entries
+// beyond the nearest hit so far can be skipped.
+struct Bvh8Stack {
+  // At most 7 siblings are left over at each level, and a collapsed tree is
+  // no deeper than the binary one.
+  static constexpr int SIZE = 7 * BvhBuilder::MAX_DEPTH + 1;
+
+  u32 refs[SIZE];
+  f32 dists[SIZE];
+  int top = 0;
+
+  // Pushes the n children in refs in order of distance, farthest first, so
+  // the nearest is popped first.
+  void push_sorted(u32* child, f32* dist, int n) {
+    for (int i = 1; i < n; i++) {
+      for (int j = i; j > 0 && dist[j] > dist[j - 1]; j--) {
+        auto d = dist[j];
+        dist[j] = dist[j - 1];
+        dist[j - 1] = d;
+        auto c = child[j];
+        child[j] = child[j - 1];
+        child[j - 1] = c;
+      }
+    }
+    assert(top + n <= SIZE);
+    for (int i = 0; i < n; i++) {
+      refs[top] = child[i];
+      dists[top] = dist[i];
+      top++;
+    }
+  }
+};
+
+#if defined(__x86_64__)
+// Like trace, for one ray through bvh8, testing 8 boxes or 8 triangles at a
+// time. Secondary rays go every which way, so they're traced one at a time.
+__attribute__((target("avx2")))
+static bool trace_avx2(const Bvh8& bvh8, const Ray& ray, f32 t_max, bool any_hit, Hit* hit) {
+  if (bvh8.node_count == 0) {
+    return false;
+  }
+  __m256 o[3] = {_mm256_set1_ps(ray.origin.x), _mm256_set1_ps(ray.origin.y), _mm256_set1_ps(ray.origin.z)};
+  __m256 d[3] = {_mm256_set1_ps(ray.dir.x), _mm256_set1_ps(ray.dir.y), _mm256_set1_ps(ray.dir.z)};
+  __m256 inv_d[3] = {
+    _mm256_set1_ps(ray.inv_dir.x), _mm256_set1_ps(ray.inv_dir.y), _mm256_set1_ps(ray.inv_dir.z),
+  };
+  auto found = false;
+  Bvh8Stack stack;
+  u32 root = 0;
+  f32 zero = 0.0f;
+  stack.push_sorted(&root, &zero, 1);
+  while (stack.top) {
+    stack.top--;
+    auto ref = stack.refs[stack.top];
+    if (stack.dists[stack.top] > t_max) {
+      continue;
+    }
+    if (ref & BVH8_LEAF) {
+      auto first = ref & BVH8_LEAF_FIRST_MASK;
+      auto count = (ref & ~BVH8_LEAF) >> BVH8_LEAF_BLOCKS_SHIFT;
+      for (u32 b = first; b < first + count; b++) {
+        auto& block = bvh8.blocks[b];
+        __m256 v0[3] = {_mm256_load_ps(block.v0_x), _mm256_load_ps(block.v0_y), _mm256_load_ps(block.v0_z)};
+        __m256 e1[3] = {_mm256_load_ps(block.e1_x), _mm256_load_ps(block.e1_y), _mm256_load_ps(block.e1_z)};
+        __m256 e2[3] = {_mm256_load_ps(block.e2_x), _mm256_load_ps(block.e2_y), _mm256_load_ps(block.e2_z)};
+        auto limit = _mm256_set1_ps(t_max);
+        auto t = intersect_triangles_avx2(v0, e1, e2, o, d, limit);
+        auto mask = _mm256_movemask_ps(_mm256_cmp_ps(t, limit, _CMP_LT_OQ));
+        if (mask) {
+          t_max = horizontal_min_avx2(t);
+          auto lane = __builtin_ctz(_mm256_movemask_ps(_mm256_cmp_ps(t, _mm256_set1_ps(t_max), _CMP_EQ_OQ)));
+          hit->t = t_max;
+          hit->triangle = block.triangle[lane];
+          found = true;
+          if (any_hit) {
+            return true;
+          }
+        }
+      }
+      continue;
+    }
+
+    auto& node = bvh8.nodes[ref];
+    __m256 lo[3] = {_mm256_load_ps(node.min_x), _mm256_load_ps(node.min_y), _mm256_load_ps(node.min_z)};
+    __m256 hi[3] = {_mm256_load_ps(node.max_x), _mm256_load_ps(node.max_y), _mm256_load_ps(node.max_z)};
+    int mask;
+    auto enter = intersect_boxes_avx2(lo, hi, o, inv_d, _mm256_set1_ps(t_max), &mask);
+    mask &= (1 << node.count) - 1;
+    alignas(32) f32 enters[8];
+    _mm256_store_ps(enters, enter);
+    u32 child[8];
+    f32 dist[8];
+    int n = 0;
+    for (; mask; mask &= mask - 1) {
+      auto i = __builtin_ctz(mask);
+      child[n] = node.child[i];
+      dist[n] = enters[i];
+      n++;
+    }
+    stack.push_sorted(child, dist, n);
+  }
+  return found;
+}
+
+// Finds the nearest hit for each ray of packet whose bit is set in active,
+// through bvh8. Each box of a node is tested against all 8 rays at once, and
+// the packet goes down every child that any of them hit, nearest first, so
+// it suits coherent rays like primary ones. Misses get triangle UINT32_MAX.
+__attribute__((target("avx2")))
+static void trace_packet_avx2(const Bvh8& bvh8, const RayPacket& packet, u32 active, Hit* hits) {
+  __m256 o[3] = {
+    _mm256_load_ps(packet.origin_x), _mm256_load_ps(packet.origin_y), _mm256_load_ps(packet.origin_z),
+  };
+  __m256 d[3] = {_mm256_load_ps(packet.dir_x), _mm256_load_ps(packet.dir_y), _mm256_load_ps(packet.dir_z)};
+  __m256 inv_d[3] = {
+    _mm256_load_ps(packet.inv_dir_x), _mm256_load_ps(packet.inv_dir_y), _mm256_load_ps(packet.inv_dir_z),
+  };
+  // Inactive lanes get a negative t_max, so they never hit anything.
+  auto lanes = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  auto is_active = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(active), lanes), lanes);
+  auto t_max = _mm256_blendv_ps(_mm256_set1_ps(-1.0f), _mm256_set1_ps(FLT_MAX), _mm256_castsi256_ps(is_active));
+  auto triangle = _mm256_set1_epi32(-1);
+  // The farthest any active ray still needs to look.
+  auto reach = active ? FLT_MAX : -1.0f;
+
+  Bvh8Stack stack;
+  if (bvh8.node_count) {
+    u32 root = 0;
+    f32 zero = 0.0f;
+    stack.push_sorted(&root, &zero, 1);
+  }
+  while (stack.top) {
+    stack.top--;
+    auto ref = stack.refs[stack.top];
+    if (stack.dists[stack.top] > reach) {
+      continue;
+    }
+    if (ref & BVH8_LEAF) {
+      auto first = ref & BVH8_LEAF_FIRST_MASK;
+      auto count = (ref & ~BVH8_LEAF) >> BVH8_LEAF_BLOCKS_SHIFT;
+      for (u32 b = first; b < first + count; b++) {
+        auto& block = bvh8.blocks[b];
+        for (int j = 0; j < 8; j++) {
+          __m256 v0[3] = {
+            _mm256_broadcast_ss(&block.v0_x[j]), _mm256_broadcast_ss(&block.v0_y[j]),
+            _mm256_broadcast_ss(&block.v0_z[j]),
+          };
+          __m256 e1[3] = {
+            _mm256_broadcast_ss(&block.e1_x[j]), _mm256_broadcast_ss(&block.e1_y[j]),
+            _mm256_broadcast_ss(&block.e1_z[j]),
+          };
+          __m256 e2[3] = {
+            _mm256_broadcast_ss(&block.e2_x[j]), _mm256_broadcast_ss(&block.e2_y[j]),
+            _mm256_broadcast_ss(&block.e2_z[j]),
+          };
+          auto t = intersect_triangles_avx2(v0, e1, e2, o, d, t_max);
+          auto nearer = _mm256_cmp_ps(t, t_max, _CMP_LT_OQ);
+          t_max = t;
+          triangle = _mm256_blendv_epi8(triangle, _mm256_set1_epi32(block.triangle[j]), _mm256_castps_si256(nearer));
+        }
+      }
+      reach = horizontal_max_avx2(t_max);
+      continue;
+    }
+
+    auto& node = bvh8.nodes[ref];
+    u32 child[8];
+    f32 dist[8];
+    int n = 0;
+    for (u32 i = 0; i < node.count; i++) {
+      __m256 lo[3] = {
+        _mm256_broadcast_ss(&node.min_x[i]), _mm256_broadcast_ss(&node.min_y[i]),
+        _mm256_broadcast_ss(&node.min_z[i]),
+      };
+      __m256 hi[3] = {
+        _mm256_broadcast_ss(&node.max_x[i]), _mm256_broadcast_ss(&node.max_y[i]),
+        _mm256_broadcast_ss(&node.max_z[i]),
+      };
+      int mask;
+      auto enter = intersect_boxes_avx2(lo, hi, o, inv_d, t_max, &mask);
+      if (mask) {
+        auto hit = _mm256_castsi256_ps(_mm256_setr_epi32(
+          mask & 1 ? -1 : 0, mask & 2 ? -1 : 0, mask & 4 ? -1 : 0, mask & 8 ? -1 : 0,
+          mask & 16 ? -1 : 0, mask & 32 ? -1 : 0, mask & 64 ? -1 : 0, mask & 128 ? -1 : 0));
+        child[n] = node.child[i];
+        dist[n] = horizontal_min_avx2(_mm256_blendv_ps(_mm256_set1_ps(FLT_MAX), enter, hit));
+        n++;
+      }
+    }
+    stack.push_sorted(child, dist, n);
+  }
+
+  alignas(32) f32 t[8];
+  alignas(32) u32 tri[8];
+  _mm256_store_ps(t, t_max);
+  _mm256_store_si256(reinterpret_cast<__m256i*>(tri), triangle);
+  for (int i = 0; i < 8; i++) {
+    hits[i] = {t[i], tri[i]};
+  }
+}
+#endif
+
+// The tasks one worker starts out with, [begin, end), packed into one word so
+// the owner can take from the end and thieves from the beginning with a
+// single compare-and-swap each.
+struct alignas(64) TaskQueue {
+  std::atomic<u64> range;
+
+  void reset(u32 begin, u32 end) {
+    range = u64(end) << 32 | begin;
+  }
+
+  bool take(bool steal, u32* task) {
+    auto r = range.load();
+    for (;;) {
+      auto begin = u32(r);
+      auto end = u32(r >> 32);
+      if (begin >= end) {
+        return false;
+      }
+      auto next = steal ? u64(end) << 32 | (begin + 1) : u64(end - 1) << 32 | begin;
+      if (range.compare_exchange_weak(r, next)) {
+        *task = steal ? begin : end - 1;
+        return true;
+      }
+    }
+  }
+};
+
+// Threads that run tasks from one TaskQueue each, started once and reused for
+// every call to parallel_for. The calling thread is worker 0.
+struct StealingPool {
+  using Task = void (*)(void* ctx, int worker, u32 i);
+
+  int thread_count = 0;
+  TaskQueue* queues = nullptr;
+  std::thread* threads = nullptr;
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  u64 generation = 0;
+  int active = 0;
+  bool quit = false;
+
+  Task task = nullptr;
+  void* ctx = nullptr;
+
+  void start(int n) {
+    thread_count = n;
+    queues = static_cast<TaskQueue*>(aligned_alloc(alignof(TaskQueue), n * sizeof(TaskQueue)));
+    for (int w = 0; w < n; w++) {
+      new (&queues[w]) TaskQueue;
+      queues[w].reset(0, 0);
+    }
+    threads = new std::thread[n];
+    for (int w = 1; w < n; w++) {
+      threads[w] = std::thread([this, w] { wait_for_work(w); });
+    }
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      quit = true;
+    }
+    wake.notify_all();
+    for (int w = 1; w < thread_count; w++) {
+      threads[w].join();
+    }
+    delete[] threads;
+    free(queues);
+  }
+
+  // Runs f(worker, i) for every i in [0, count). Each thread starts with an
+  // even share of the tasks and steals from the others once its own run out.
+  template<typename F>
+  void parallel_for(u32 count, const F& f) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (int w = 0; w < thread_count; w++) {
+        queues[w].reset(u64(count) * w / thread_count, u64(count) * (w + 1) / thread_count);
+      }
+      task = [](void* c, int w, u32 i) { (*static_cast<const F*>(c))(w, i); };
+      ctx = (void*)&f;
+      active = thread_count - 1;
+      generation++;
+    }
+    wake.notify_all();
+
+    work(0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return active == 0; });
+  }
+
+  void work(int w) {
+    u32 i;
+    while (queues[w].take(false, &i)) {
+      task(ctx, w, i);
+    }
+    for (int v = (w + 1) % thread_count; v != w; v = (v + 1) % thread_count) {
+      while (queues[v].take(true, &i)) {
+        task(ctx, w, i);
+      }
+    }
+  }
+
+  void wait_for_work(int w) {
+    u64 seen = 0;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [&] { return quit || generation != seen; });
+        if (quit) {
+          return;
+        }
+        seen = generation;
+      }
+      work(w);
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--active == 0) {
+        done.notify_one();
+      }
+    }
+  }
+};
+
+
+// Which traversal render uses: the binary Bvh a ray at a time, or the Bvh8
+// with packets of 8 primary rays, and single shadow rays tested against 8
+// boxes or triangles at a time.
+enum class Kernel { Scalar, Avx2 };
+
+struct Scene {
+  const Bvh& bvh;
+  const Bvh8& bvh8;
+  Kernel kernel;
+  // Unit direction the light shines in.
+  f32x3 light;
+};
+
+static bool occluded(const Scene& scene, const Ray& ray) {
+  Hit blocker;
+#if defined(__x86_64__)
+  if (scene.kernel == Kernel::Avx2) {
+    return trace_avx2(scene.bvh8, ray, FLT_MAX, true, &blocker);
+  }
+#endif
+  return trace(scene.bvh, ray, FLT_MAX, true, &blocker);
+}
+
+// A hash with good avalanche, from Chris Wellons' hash prospector.
+static u32 hash(u32 x) {
+  x ^= x >> 16;
+  x *= 0x7feb352d;
+  x ^= x >> 15;
+  x *= 0x846ca68b;
+  x ^= x >> 16;
+  return x;
+}
+
+// A random number in [0, 1) for one dimension of one sample of one pixel.
+// It depends on nothing else, so images don't depend on which thread traced
+// what, and a resumed render carries on with new samples.
+static f32 random01(u32 pixel, u32 sample, u32 dimension) {
+  return (hash(pixel + hash(sample + hash(dimension))) >> 8) * 0x1p-24f;
+}
+
+// Running sums of each pixel's samples, from which render estimates how
+// noisy each tile still is. Every pixel in a tile has the same number of
+// samples. Can be saved to a checkpoint file and loaded to resume a render.
+struct Accumulator {
+  static constexpr int TILE_SIZE = 16;
+
+  int width;
+  int height;
+  int tiles_x;
+  int tiles_y;
+  f32* sum;
+  f32* sum_squares;
+  u32* samples;
+
+  static Accumulator make(int width, int height) {
+    Accumulator a;
+    a.width = width;
+    a.height = height;
+    a.tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    a.tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+    a.sum = static_cast<f32*>(calloc(size_t(width) * height, sizeof(f32)));
+    a.sum_squares = static_cast<f32*>(calloc(size_t(width) * height, sizeof(f32)));
+    a.samples = static_cast<u32*>(calloc(a.tiles_x * a.tiles_y, sizeof(u32)));
+    return a;
+  }
+
+  u32 tile_count() const {
+    return tiles_x * tiles_y;
+  }
+
+  u32 tile_of(int x, int y) const {
+    return (y / TILE_SIZE) * tiles_x + x / TILE_SIZE;
+  }
+
+  f32 mean(int x, int y) const {
+    auto n = samples[tile_of(x, y)];
+    return n ? sum[y * width + x] / n : 0.0f;
+  }
+
+  // Root mean square over the pixels of tile of the standard error of their
+  // means, or FLT_MAX if there aren't enough samples to tell.
+  f32 noise(u32 tile) const {
+    auto n = samples[tile];
+    if (n < 2) {
+      return FLT_MAX;
+    }
+    auto x0 = int(tile % tiles_x) * TILE_SIZE;
+    auto y0 = int(tile / tiles_x) * TILE_SIZE;
+    f32 total = 0.0f;
+    int pixels = 0;
+    for (int y = y0; y < min(y0 + TILE_SIZE, height); y++) {
+      for (int x = x0; x < min(x0 + TILE_SIZE, width); x++) {
+        auto mean = sum[y * width + x] / n;
+        auto variance = max(sum_squares[y * width + x] / n - mean * mean, 0.0f) * n / (n - 1);
+        total += variance / n;
+        pixels++;
+      }
+    }
+    return sqrtf(total / pixels);
+  }
+
+  struct CheckpointHeader {
+    char magic[8];
+    u32 width;
+    u32 height;
+    u32 tile_size;
+    u32 padding;
+    // Identifies what was being rendered.
+    u64 scene;
+  };
+
+  static constexpr char CHECKPOINT_MAGIC[8] = {'t', 'r', 'a', 'c', 'c', 'u', 'm', '1'};
+
+  // Writes to a temporary file and renames it over path, so an interrupted
+  // save leaves the last checkpoint intact.
+  void save(const char* path, u64 scene) const {
+    char tmp_path[4096];
+    auto n = snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    assert(n < int(sizeof(tmp_path)));
+    (void)n;
+    CheckpointHeader header = {};
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.width = width;
+    header.height = height;
+    header.tile_size = TILE_SIZE;
+    header.scene = scene;
+
+    auto f = fopen(tmp_path, "wb");
+    assert(f);
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(sum, sizeof(f32), size_t(width) * height, f);
+    fwrite(sum_squares, sizeof(f32), size_t(width) * height, f);
+    fwrite(samples, sizeof(u32), tile_count(), f);
+    auto ok = !ferror(f);
+    ok = fclose(f) == 0 && ok;
+    ok = ok && rename(tmp_path, path) == 0;
+    assert(ok);
+    (void)ok;
+  }
+
+  // Loads the checkpoint at path if there is one for this size of image and
+  // scene. Returns false, leaving this as it was, if not.
+  bool load(const char* path, u64 scene) {
+    auto f = fopen(path, "rb");
+    if (!f) {
+      return false;
+    }
+    CheckpointHeader header;
+    auto pixels = size_t(width) * height;
+    auto ok = fread(&header, sizeof(header), 1, f) == 1 &&
+              memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) == 0 &&
+              header.width == u32(width) && header.height == u32(height) && header.tile_size == TILE_SIZE &&
+              header.scene == scene;
+    auto a = make(width, height);
+    ok = ok && fread(a.sum, sizeof(f32), pixels, f) == pixels &&
+         fread(a.sum_squares, sizeof(f32), pixels, f) == pixels &&
+         fread(a.samples, sizeof(u32), tile_count(), f) == tile_count();
+    fclose(f);
+    if (!ok) {
+      free(a.sum);
+      free(a.sum_squares);
+      free(a.samples);
+      return false;
+    }
+    free(sum);
+    free(sum_squares);
+    free(samples);
+    *this = a;
+    return true;
+  }
+
+  void resolve(Image& image) const {
+    for (int y = 0; y < height; y++) {
+      for (int x = 0; x < width; x++) {
+        auto c = u8(min(mean(x, y), 1.0f) * 255.0f);
+        image.at(x, y) = {c, c, c};
+      }
+    }
+  }
+};
+
+// FNV-1a of obj's geometry, to tell whether a checkpoint is of the same mesh.
+static u64 scene_id(const Obj& obj) {
+  u64 h = 0xcbf29ce484222325;
+  auto mix = [&](const void* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+      h = (h ^ static_cast<const u8*>(data)[i]) * 0x100000001b3;
+    }
+  };
+  mix(obj.vertices.buf, obj.vertices.len * sizeof(f32x3));
+  mix(obj.faces.buf, obj.faces.len * sizeof(u32x3));
+  return h;
+}
+
+struct RenderOptions {
+  // Stop after this many seconds.
+  f64 budget_s;
+  // Stop sampling a tile once its Accumulator::noise is below this.
+  f32 noise_threshold;
+  // Where to save the Accumulator as the render goes, or nullptr.
+  const char* checkpoint_path;
+  u64 scene_id;
+};
+
+struct RenderStats {
+  u64 primary_rays;
+  u64 shadow_rays;
+  f64 primary_s;
+  f64 shadow_s;
+  u32 passes;
+  // Whether every tile got below the noise threshold before the budget ran
+  // out.
+  bool converged;
+};
+
+// Renders scene progressively into accum, looking down -z at the cube from -1
+// to 1 like the rasterizers, lit by a small disc-shaped light so shadows have
+// soft edges. Each pass adds one sample to every pixel of each tile that's
+// still noisy, with a primary ray jittered within the pixel and a shadow ray
+// toward a random point on the light if it hits a surface facing it. All of
+// a pass's primary rays are traced before any shadow rays, so each kind can
+// be timed on its own. Passes continue until every tile is below the noise
+// threshold or the budget runs out.
+static RenderStats render(Accumulator& accum, const Scene& scene, const RenderOptions& options,
+                          int thread_count) {
+  constexpr int TILE_SIZE = Accumulator::TILE_SIZE;
+  // Primary rays are traced in packets of this many pixels across and down.
+  constexpr int PACKET_WIDTH = 4;
+  constexpr int PACKET_HEIGHT = 2;
+  static_assert(PACKET_WIDTH * PACKET_HEIGHT == 8 && TILE_SIZE % PACKET_WIDTH == 0 && TILE_SIZE % PACKET_HEIGHT == 0);
+  // Shadow rays start this far off the surface, so they don't hit it.
+  constexpr f32 SHADOW_BIAS = 1e-4f;
+  // Tangent of the angle the light's radius subtends.
+  constexpr f32 LIGHT_RADIUS = 0.05f;
+  // Tiles get this many samples before their noise is trusted.
+  constexpr u32 MIN_SAMPLES = 4;
+  constexpr f64 CHECKPOINT_INTERVAL_S = 10.0;
+
+  auto start = now_ns();
+  auto deadline = start + u64(options.budget_s * 1e9);
+  auto last_checkpoint = start;
+  auto width = accum.width;
+  auto height = accum.height;
+  // Called from every kernel's loop, which all have to get the same rays.
+  auto pixel_ray = [&](int x, int y, u32 sample) EXACT_MATH {
+    auto pixel = u32(y * width + x);
+    f32x3 origin = {
+      (x + random01(pixel, sample, 0)) * 2.0f / width - 1.0f,
+      (y + random01(pixel, sample, 1)) * 2.0f / height - 1.0f,
+      2.0f,
+    };
+    return Ray::make(origin, {0.0f, 0.0f, -1.0f});
+  };
+  // Two directions across the light, to pick points on it.
+  auto light_u = normalize(cross(scene.light, fabsf(scene.light.x) < 0.9f ? f32x3{1, 0, 0} : f32x3{0, 1, 0}));
+  auto light_v = cross(scene.light, light_u);
+
+  // What each pixel's primary ray hit in this pass, or triangle UINT32_MAX if
+  // nothing.
+  auto hits = static_cast<Hit*>(malloc(size_t(width) * height * sizeof(Hit)));
+  auto tile_noise = static_cast<f32*>(malloc(accum.tile_count() * sizeof(f32)));
+  for (u32 t = 0; t < accum.tile_count(); t++) {
+    tile_noise[t] = accum.noise(t);
+  }
+  auto tiles = static_cast<u32*>(malloc(accum.tile_count() * sizeof(u32)));
+  auto rays = static_cast<u64*>(malloc(thread_count * sizeof(u64)));
+  RenderStats stats = {};
+  // Started once, since a pass can take less time than starting threads.
+  StealingPool pool;
+  pool.start(thread_count);
+
+  for (;;) {
+    u32 tile_count = 0;
+    for (u32 t = 0; t < accum.tile_count(); t++) {
+      if (accum.samples[t] < MIN_SAMPLES || tile_noise[t] > options.noise_threshold) {
+        tiles[tile_count++] = t;
+      }
+    }
+    if (tile_count == 0) {
+      stats.converged = true;
+      break;
+    }
+    auto now = now_ns();
+    if (now >= deadline && stats.passes) {
+      break;
+    }
+    if (options.checkpoint_path && (now - last_checkpoint) / 1e9 >= CHECKPOINT_INTERVAL_S) {
+      accum.save(options.checkpoint_path, options.scene_id);
+      last_checkpoint = now;
+    }
+
+    for (int w = 0; w < thread_count; w++) {
+      rays[w] = 0;
+    }
+    auto phase_start = now_ns();
+    pool.parallel_for(tile_count, [&](int worker, u32 i) {
+      auto tile = tiles[i];
+      auto sample = accum.samples[tile];
+      auto x0 = int(tile % accum.tiles_x) * TILE_SIZE;
+      auto y0 = int(tile / accum.tiles_x) * TILE_SIZE;
+      auto x1 = min(x0 + TILE_SIZE, width);
+      auto y1 = min(y0 + TILE_SIZE, height);
+      rays[worker] += (x1 - x0) * (y1 - y0);
+      for (int y = y0; y < y1; y += PACKET_HEIGHT) {
+        for (int x = x0; x < x1; x += PACKET_WIDTH) {
+#if defined(__x86_64__)
+          if (scene.kernel == Kernel::Avx2) {
+            RayPacket packet;
+            u32 active = 0;
+            for (int lane = 0; lane < 8; lane++) {
+              auto px = x + lane % PACKET_WIDTH;
+              auto py = y + lane / PACKET_WIDTH;
+              auto inside = px < x1 && py < y1;
+              // Lanes off the edge of the image still need a finite ray.
+              packet.set(lane, inside ? pixel_ray(px, py, sample) : pixel_ray(x, y, sample));
+              active |= u32(inside) << lane;
+            }
+            Hit packet_hits[8];
+            trace_packet_avx2(scene.bvh8, packet, active, packet_hits);
+            for (int lane = 0; lane < 8; lane++) {
+              if (active & (1 << lane)) {
+                auto px = x + lane % PACKET_WIDTH;
+                auto py = y + lane / PACKET_WIDTH;
+                hits[py * width + px] = packet_hits[lane];
+              }
+            }
+            continue;
+          }
+#endif
+          for (int py = y; py < min(y + PACKET_HEIGHT, y1); py++) {
+            for (int px = x; px < min(x + PACKET_WIDTH, x1); px++) {
+              auto& hit = hits[py * width + px];
+              if (!trace(scene.bvh, pixel_ray(px, py, sample), FLT_MAX, false, &hit)) {
+                hit.triangle = UINT32_MAX;
+              }
+            }
+          }
+        }
+      }
+    });
+    stats.primary_s += (now_ns() - phase_start) / 1e9;
+    for (int w = 0; w < thread_count; w++) {
+      stats.primary_rays += rays[w];
+      rays[w] = 0;
+    }
+
+    phase_start = now_ns();
+    pool.parallel_for(tile_count, [&](int worker, u32 i) {
+      auto tile = tiles[i];
+      auto sample = accum.samples[tile];
+      auto x0 = int(tile % accum.tiles_x) * TILE_SIZE;
+      auto y0 = int(tile / accum.tiles_x) * TILE_SIZE;
+      u64 n = 0;
+      for (int y = y0; y < min(y0 + TILE_SIZE, height); y++) {
+        for (int x = x0; x < min(x0 + TILE_SIZE, width); x++) {
+          auto& hit = hits[y * width + x];
+          f32 intensity = 0.0f;
+          if (hit.triangle != UINT32_MAX) {
+            auto ray = pixel_ray(x, y, sample);
+            auto& tri = scene.bvh.triangles[hit.triangle];
+            auto normal = normalize(cross(tri.e1, tri.e2));
+            // Light both sides, whichever the ray sees.
+            if (dot(normal, ray.dir) > 0.0f) {
+              normal = normal * -1.0f;
+            }
+            auto lambert = -dot(normal, scene.light);
+            if (lambert > 0.0f) {
+              // A uniformly distributed point on the light's disc.
+              auto pixel = u32(y * width + x);
+              auto r = sqrtf(random01(pixel, sample, 2)) * LIGHT_RADIUS;
+              auto angle = random01(pixel, sample, 3) * 2.0f * f32(M_PI);
+              auto dir = normalize(scene.light + light_u * (r * cosf(angle)) + light_v * (r * sinf(angle)));
+              auto p = ray.origin + ray.dir * hit.t + normal * SHADOW_BIAS;
+              n++;
+              if (!occluded(scene, Ray::make(p, dir * -1.0f))) {
+                intensity = lambert;
+              }
+            }
+          }
+          accum.sum[y * width + x] += intensity;
+          accum.sum_squares[y * width + x] += intensity * intensity;
+        }
+      }
+      accum.samples[tile]++;
+      tile_noise[tile] = accum.noise(tile);
+      rays[worker] += n;
+    });
+    stats.shadow_s += (now_ns() - phase_start) / 1e9;
+    for (int w = 0; w < thread_count; w++) {
+      stats.shadow_rays += rays[w];
+    }
+    stats.passes++;
+  }
+
+  if (options.checkpoint_path) {
+    accum.save(options.checkpoint_path, options.scene_id);
+  }
+  pool.stop();
+  free(rays);
+  free(tiles);
+  free(tile_noise);
+  free(hits);
+  return stats;
+}
+
 int main(int argc, char** argv) {
-  auto obj = load_obj("head.obj");
-  (void)obj;
+  auto thread_count = max(int(std::thread::hardware_concurrency()), 1);
+  auto kernel = Kernel::Scalar;
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2")) {
+    kernel = Kernel::Avx2;
+  }
+#endif
+  RenderOptions options = {2.0, 0.005f, nullptr, 0};
+  for (int opt; (opt = getopt(argc, argv, "j:k:b:n:c:")) != -1;) {
+    switch (opt) {
+      case 'j':
+        thread_count = max(atoi(optarg), 1);
+        break;
+      case 'k':
+        if (strcmp(optarg, "scalar") == 0) {
+          kernel = Kernel::Scalar;
+          break;
+        }
+#if defined(__x86_64__)
+        if (strcmp(optarg, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+          kernel = Kernel::Avx2;
+          break;
+        }
+#endif
+        printf("unsupported kernel: %s\n", optarg);
+        return 1;
+      case 'b':
+        options.budget_s = max(atof(optarg), 0.0);
+        break;
+      case 'n':
+        options.noise_threshold = atof(optarg);
+        break;
+      case 'c':
+        options.checkpoint_path = optarg;
+        break;
+      default:
+        printf("usage: %s [-j threads] [-k avx2|scalar] [-b budget_seconds] [-n noise] [-c checkpoint] [mesh.obj]\n",
+               argv[0]);
+        return 1;
+    }
+  }
+  auto obj = load_obj(optind < argc ? argv[optind] : "head.obj");
+
+  auto start = now_ns();
+  auto bvh = BvhBuilder::build(obj, thread_count);
+  auto build_ms = (now_ns() - start) / 1e6;
+  printf("bvh: %d triangles, %u nodes, built in %.3f ms\n", obj.faces.len, bvh.node_count, build_ms);
+
+  Bvh8 bvh8 = {};
+  if (kernel == Kernel::Avx2) {
+    start = now_ns();
+    bvh8 = Bvh8::collapse(bvh);
+    auto collapse_ms = (now_ns() - start) / 1e6;
+    printf("bvh8: %u nodes, %u triangle blocks, collapsed in %.3f ms\n", bvh8.node_count, bvh8.block_count,
+           collapse_ms);
+  }
 
   static Image::Pixel image_memory[1000][1000];
   auto image = Image::from_array(image_memory);
-  (void)image;
+  auto accum = Accumulator::make(image.width, image.height);
+  options.scene_id = scene_id(obj);
+  if (options.checkpoint_path && accum.load(options.checkpoint_path, options.scene_id)) {
+    printf("resuming from %s\n", options.checkpoint_path);
+  }
+  // From the upper left, in front.
+  auto light = normalize({1.0f, -1.0f, -1.0f});
+  auto stats = render(accum, {bvh, bvh8, kernel, light}, options, thread_count);
+  auto rays = stats.primary_rays + stats.shadow_rays;
+  auto trace_s = stats.primary_s + stats.shadow_s;
+  printf("trace: %dx%d, %d threads, %lu rays in %.3f ms, %.4g rays/s\n", image.width, image.height,
+         thread_count, rays, trace_s * 1e3, rays / trace_s);
+  printf("  primary: %lu rays in %.3f ms, %.4g rays/s (%s)\n", stats.primary_rays, stats.primary_s * 1e3,
+         stats.primary_rays / stats.primary_s, kernel == Kernel::Avx2 ? "8-ray packets, bvh8" : "single rays, bvh");
+  printf("  shadow: %lu rays in %.3f ms, %.4g rays/s (%s)\n", stats.shadow_rays, stats.shadow_s * 1e3,
+         stats.shadow_rays / stats.shadow_s, kernel == Kernel::Avx2 ? "single rays, bvh8" : "single rays, bvh");
+
+  u32 min_samples = UINT32_MAX;
+  u32 max_samples = 0;
+  u32 converged = 0;
+  for (u32 t = 0; t < accum.tile_count(); t++) {
+    min_samples = min(min_samples, accum.samples[t]);
+    max_samples = max(max_samples, accum.samples[t]);
+    converged += accum.samples[t] >= 2 && accum.noise(t) <= options.noise_threshold;
+  }
+  printf("samples: %u passes, %u to %u samples per pixel, %u of %u tiles below noise %g, %s\n", stats.passes,
+         min_samples, max_samples, converged, accum.tile_count(), options.noise_threshold,
+         stats.converged ? "converged" : "out of time");
+
+  accum.resolve(image);
+  image.save_as_tga_file("out.tga");
 }